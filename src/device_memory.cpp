@@ -0,0 +1,199 @@
+#pragma once
+
+#include "device_memory.hpp"
+#include "utility.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+
+bool device_memory::take_range(block& b, size_t size, size_t* offset) {
+	for (auto range = b.free_ranges.begin(); range != b.free_ranges.end(); range++) {
+		if (range->second < size) continue;
+		*offset = range->first;
+		size_t rest = range->second - size;
+		b.free_ranges.erase(range);
+		if (rest > 0) {
+			b.free_ranges[*offset + size] = rest;
+		}
+		return true;
+	}
+	return false;
+}
+
+void device_memory::return_range(block& b, size_t offset, size_t size) {
+	auto range = b.free_ranges.emplace(offset, size).first;
+	auto next = std::next(range);
+	if (next != b.free_ranges.end() && range->first + range->second == next->first) {
+		range->second += next->second;
+		b.free_ranges.erase(next);
+	}
+	if (range != b.free_ranges.begin()) {
+		auto previous = std::prev(range);
+		if (previous->first + previous->second == range->first) {
+			previous->second += range->second;
+			b.free_ranges.erase(range);
+		}
+	}
+}
+
+void device_memory::account(const std::string& subsystem, long long bytes) {
+	for (usage* u : {&usages[subsystem], &total}) {
+		u->live += bytes;
+		u->peak = std::max(u->peak, u->live);
+	}
+}
+
+cl_mem device_memory::allocate(std::string subsystem, size_t size, const void* data) {
+	cl_int error = CL_SUCCESS;
+	size_t aligned_size = std::max<size_t>((size + alignment - 1) / alignment * alignment, alignment);
+	size_t index = 0;
+	size_t offset = 0;
+	while (index < blocks.size() && !take_range(blocks[index], aligned_size, &offset)) index++;
+	if (index == blocks.size()) {
+		block b;
+		b.size = std::max(std::min(block_size, max_block_size), aligned_size);
+		b.buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, b.size, nullptr, &error);
+		if (error != CL_SUCCESS) {
+			particle::cl::print_error(error, "device_memory::allocate " + subsystem);
+			return nullptr;
+		}
+		b.free_ranges[0] = b.size;
+		blocks.push_back(b);
+		take_range(blocks.back(), aligned_size, &offset);
+	}
+
+	cl_buffer_region region = {offset, size == 0 ? alignment : size};
+	cl_mem buffer = clCreateSubBuffer(blocks[index].buffer, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &error);
+	if (error != CL_SUCCESS) {
+		return_range(blocks[index], offset, aligned_size);
+		particle::cl::print_error(error, "device_memory::allocate " + subsystem);
+		return nullptr;
+	}
+	if (data != nullptr) {
+		error |= clEnqueueWriteBuffer(command_queue, buffer, CL_TRUE, 0, size, data, NULL, nullptr, nullptr);
+	}
+	allocations[buffer] = {subsystem, aligned_size, index, offset};
+	account(subsystem, aligned_size);
+	particle::cl::print_error(error, "device_memory::allocate " + subsystem);
+	return buffer;
+}
+
+cl_mem device_memory::adopt(std::string subsystem, cl_mem object, size_t size) {
+	if (object == nullptr) return object;
+	allocations[object] = {subsystem, size};
+	account(subsystem, size);
+	return object;
+}
+
+void device_memory::release_unfinished(cl_mem object) {
+	auto found = allocations.find(object);
+	if (found == allocations.end()) return;
+	clReleaseMemObject(object);
+	const allocation& a = found->second;
+	account(a.subsystem, -static_cast<long long>(a.size));
+	if (a.block != SIZE_MAX) {
+		return_range(blocks[a.block], a.offset, a.size);
+	}
+	allocations.erase(found);
+}
+
+// a range is only handed out again once nothing queued can still touch it
+void device_memory::release(cl_mem object) {
+	if (allocations.count(object) == 0) return;
+	clFinish(command_queue);
+	release_unfinished(object);
+}
+
+void device_memory::release(const std::vector<cl_mem>& objects) {
+	if (objects.empty()) return;
+	clFinish(command_queue);
+	for (cl_mem object : objects) {
+		release_unfinished(object);
+	}
+}
+
+void device_memory::release_subsystem(std::string subsystem) {
+	std::vector<cl_mem> objects;
+	for (auto& a : allocations) {
+		if (a.second.subsystem == subsystem) objects.push_back(a.first);
+	}
+	release(objects);
+}
+
+void device_memory::release_all() {
+	clFinish(command_queue);
+	for (auto& a : allocations) {
+		clReleaseMemObject(a.first);
+	}
+	allocations.clear();
+	for (auto& u : usages) {
+		u.second.live = 0;
+	}
+	total.live = 0;
+	for (block& b : blocks) {
+		b.free_ranges.clear();
+		if (b.buffer != nullptr) {
+			b.free_ranges[0] = b.size;
+		}
+	}
+}
+
+// emptied blocks keep their index, the allocations refer to the blocks by it
+void device_memory::trim() {
+	for (block& b : blocks) {
+		if (b.buffer == nullptr || b.free_ranges.size() != 1 || b.free_ranges.begin()->second != b.size) continue;
+		clReleaseMemObject(b.buffer);
+		b.buffer = nullptr;
+		b.size = 0;
+		b.free_ranges.clear();
+	}
+}
+
+size_t device_memory::get_live_bytes(std::string subsystem) const {
+	auto u = usages.find(subsystem);
+	return u == usages.end() ? 0 : u->second.live;
+}
+
+size_t device_memory::get_peak_bytes(std::string subsystem) const {
+	auto u = usages.find(subsystem);
+	return u == usages.end() ? 0 : u->second.peak;
+}
+
+size_t device_memory::get_pooled_bytes() const {
+	size_t pooled_bytes = 0;
+	for (const block& b : blocks) {
+		pooled_bytes += b.size;
+	}
+	return pooled_bytes;
+}
+
+void device_memory::print_report() const {
+	auto mib = [](size_t bytes) { return bytes / static_cast<double>(1 << 20); };
+	std::cout << "device memory: " << mib(total.live) << " MiB live, " << mib(total.peak) << " MiB peak, " << mib(get_pooled_bytes()) << " MiB pooled" << std::endl;
+	for (auto& u : usages) {
+		std::cout << "  " << u.first << ": " << mib(u.second.live) << " MiB live, " << mib(u.second.peak) << " MiB peak" << std::endl;
+	}
+}
+
+device_memory::device_memory(cl_device_id device, cl_context context, cl_command_queue command_queue, size_t block_size):
+	context(context),
+	command_queue(command_queue),
+	block_size(block_size) {
+	cl_uint alignment_bits = 0;
+	cl_ulong max_alloc_size = 0;
+	clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &alignment_bits, nullptr);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc_size, nullptr);
+	// sub-buffer origins have to be aligned to the base address alignment of the device
+	alignment = std::max<size_t>(alignment_bits / 8, sizeof(cl_float4));
+	max_block_size = max_alloc_size;
+}
+
+device_memory::~device_memory() {
+	release_all();
+	for (block& b : blocks) {
+		if (b.buffer != nullptr) {
+			clReleaseMemObject(b.buffer);
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+
+// owns every cl memory object of the particle system, plain buffers are aligned sub-buffers of a few large pooled blocks
+// so a reconfiguration hands them back and takes them again without going to the driver, live and peak bytes are kept per subsystem
+class device_memory {
+	struct block {
+		cl_mem buffer;
+		size_t size;
+		std::map<size_t, size_t> free_ranges;	// offset to size, neighbors are merged on release
+	};
+
+	// objects that cannot be sub-buffers, like gl shared objects, images and buffers with their own flags, are only accounted
+	struct allocation {
+		std::string subsystem;
+		size_t size;
+		size_t block = SIZE_MAX;
+		size_t offset = 0;
+	};
+
+	struct usage {
+		size_t live = 0;
+		size_t peak = 0;
+	};
+
+	cl_context context;
+	cl_command_queue command_queue;
+	size_t alignment;
+	size_t block_size;
+	size_t max_block_size;
+
+	std::vector<block> blocks;
+	std::map<cl_mem, allocation> allocations;
+	std::map<std::string, usage> usages;
+	usage total;
+
+	bool take_range(block& b, size_t size, size_t* offset);
+	void return_range(block& b, size_t offset, size_t size);
+	void account(const std::string& subsystem, long long bytes);
+	// without waiting for the queue, the callers finish it once for everything they release
+	void release_unfinished(cl_mem object);
+
+public:
+	device_memory(cl_device_id device, cl_context context, cl_command_queue command_queue, size_t block_size = 64 << 20);
+	~device_memory();
+
+	cl_mem allocate(std::string subsystem, size_t size, const void* data = nullptr);
+	cl_mem adopt(std::string subsystem, cl_mem object, size_t size);
+	void release(cl_mem object);
+	void release(const std::vector<cl_mem>& objects);
+	void release_subsystem(std::string subsystem);
+	void release_all();
+	// gives the blocks nothing is allocated from back to the driver
+	void trim();
+
+	size_t get_live_bytes(std::string subsystem) const;
+	size_t get_peak_bytes(std::string subsystem) const;
+	size_t get_pooled_bytes() const;
+	void print_report() const;
+};
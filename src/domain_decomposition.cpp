@@ -0,0 +1,506 @@
+#pragma once
+
+#include "domain_decomposition.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <numeric>
+
+
+void domain_decomposition::init_domain(domain& d, cl_device_id device) {
+	cl_int error = CL_SUCCESS;
+	cl_int object_error = CL_SUCCESS;
+	d.device = device;
+	cl_platform_id platform;
+	clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, nullptr);
+	cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform), 0};
+	d.context = clCreateContext(properties, 1, &device, nullptr, nullptr, &object_error);
+	error |= object_error;
+	d.command_queue = clCreateCommandQueue(d.context, device, NULL, &object_error);
+	error |= object_error;
+	d.memory.reset(new device_memory(device, d.context, d.command_queue));
+
+	particle::cl::build_program(device, d.context, &d.particle_simulation_program, "shaders/cl/particle_simulation.cl", distance_field_colliders ? "-D DISTANCE_FIELD" : "");
+	particle::cl::build_program(device, d.context, &d.bitonic_program, "shaders/cl/bitonic_sort.cl");
+	particle::cl::build_program(device, d.context, &d.bvh_program, "shaders/cl/bvh.cl");
+	particle::cl::build_program(device, d.context, &d.decomposition_program, "shaders/cl/domain_decomposition.cl");
+
+	d.move_kernel = clCreateKernel(d.particle_simulation_program, "move", &object_error);
+	error |= object_error;
+	d.count_kernel = clCreateKernel(d.decomposition_program, "count_slab_buckets", &object_error);
+	error |= object_error;
+	d.scatter_kernel = clCreateKernel(d.decomposition_program, "scatter_slab_buckets", &object_error);
+	error |= object_error;
+	d.apply_indices_kernel = clCreateKernel(d.bitonic_program, "apply_indices", &object_error);
+	error |= object_error;
+	d.park_kernel = clCreateKernel(d.decomposition_program, "park_particles", &object_error);
+	error |= object_error;
+
+	d.counters = d.memory->allocate("partition", sizeof(d.bucket_sizes));
+	d.active_counts = d.memory->allocate("solver", 2 * sizeof(cl_uint));
+	d.world_triangles = d.memory->allocate("world", world_triangles.size() * sizeof(cl_float4), world_triangles.data());
+	if (distance_field_colliders) {
+		size_t distances_size = static_cast<size_t>(distance_field.dimensions.s[0]) * distance_field.dimensions.s[1] * distance_field.dimensions.s[2] * sizeof(cl_float);
+		d.world_distances = d.memory->adopt("world", particle::cl::bake_distance_field(d.context, d.command_queue, d.particle_simulation_program, d.world_triangles, num_triangles, distance_field), distances_size);
+	}
+	particle::cl::print_error(error, "domain_decomposition::init_domain");
+}
+
+void domain_decomposition::allocate(domain& d, cl_uint capacity) {
+	cl_int error = CL_SUCCESS;
+	d.capacity = capacity;
+	d.bvh_levels = particle::cl::get_bvh_levels(capacity);
+	for (int i = 0; i < 2; i++) {
+		d.positions[i] = d.memory->allocate("particles", capacity * sizeof(cl_float4));
+		d.positions_old[i] = d.memory->allocate("particles", capacity * sizeof(cl_float4));
+		d.ids[i] = d.memory->allocate("particles", capacity * sizeof(cl_uint));
+	}
+	d.indices = d.memory->allocate("sort", capacity * sizeof(cl_uint));
+	d.active_indices = d.memory->allocate("solver", capacity * sizeof(cl_uint));
+	cl_uint zero = 0;
+	error |= clEnqueueFillBuffer(d.command_queue, d.active_counts, &zero, sizeof(cl_uint), 0, 2 * sizeof(cl_uint), NULL, nullptr, nullptr);
+	d.bvh = d.memory->allocate("bvh", (pow(2, ceil(log(capacity) / log(2))) - 1) * sizeof(cl_float4));
+
+	error |= clSetKernelArg(d.move_kernel, 2, sizeof(cl_uint), &d.capacity);
+	particle::cl::print_error(error, "domain_decomposition::allocate");
+
+	d.frame_parity = 0;
+	record_frames(d);
+	park(d, 0);
+}
+
+void domain_decomposition::release(domain& d) {
+	if (d.capacity == 0) return;
+	for (int parity = 0; parity < 2; parity++) {
+		for (particle::cl::kernel_step& step : d.frame_steps[parity]) {
+			clReleaseKernel(step.kernel);
+		}
+		d.frame_steps[parity].clear();
+	}
+	d.memory->release({d.positions[0], d.positions[1], d.positions_old[0], d.positions_old[1], d.ids[0], d.ids[1], d.indices, d.active_indices, d.bvh});
+	d.capacity = 0;
+}
+
+void domain_decomposition::set_slabs(std::vector<cl_float> boundaries) {
+	cl_float infinity = std::numeric_limits<cl_float>::infinity();
+	for (size_t i = 0; i < domains.size(); i++) {
+		domains[i].slab = {i == 0 ? -infinity : boundaries[i - 1], i + 1 == domains.size() ? infinity : boundaries[i]};
+	}
+}
+
+void domain_decomposition::balance_slabs() {
+	std::vector<cl_float> x;
+	for (cl_float4& position : positions) {
+		x.push_back(position.s[0]);
+	}
+	std::vector<cl_float> boundaries;
+	for (size_t i = 1; i < domains.size(); i++) {
+		auto quantile = x.begin() + i * x.size() / domains.size();
+		std::nth_element(x.begin(), quantile, x.end());
+		boundaries.push_back(*quantile);
+	}
+	set_slabs(boundaries);
+}
+
+void domain_decomposition::rebalance() {
+	cl_uint max_owned = 0;
+	for (domain& d : domains) {
+		max_owned = std::max(max_owned, d.bucket_sizes[0] + d.bucket_sizes[1] + d.bucket_sizes[2]);
+	}
+	// particles on the wrong side of the new borders migrate with the next steps
+	if (max_owned * domains.size() > 1.25 * num_particles) {
+		balance_slabs();
+	}
+}
+
+cl_kernel domain_decomposition::record_step(domain& d, std::vector<particle::cl::kernel_step>& steps, cl_program program, const char* kernel_name, size_t work_items) {
+	cl_int error = CL_SUCCESS;
+	cl_kernel kernel = clCreateKernel(program, kernel_name, &error);
+	particle::cl::print_error(error, "domain_decomposition::record_step");
+	size_t local_work_size = std::min(local_work_sizes.at(kernel_name), work_items);
+	steps.push_back({kernel, particle::cl::get_global_work_size(work_items, local_work_size), local_work_size});
+	return kernel;
+}
+
+void domain_decomposition::record_frames(domain& d) {
+	// the same sort, bvh and resolve stages as particle_system, over every slot of the domain
+	cl_int error = CL_SUCCESS;
+	for (int parity = 0; parity < 2; parity++) {
+		std::vector<particle::cl::kernel_step>& steps = d.frame_steps[parity];
+		cl_kernel init_indices_kernel = record_step(d, steps, d.bitonic_program, "init_indices", d.capacity);
+		error |= clSetKernelArg(init_indices_kernel, 0, sizeof(cl_mem), &d.indices);
+		error |= clSetKernelArg(init_indices_kernel, 1, sizeof(cl_uint), &d.capacity);
+
+		int num_work_items = pow(2, ceil(log(d.capacity) / log(2)));
+		int iterations = ceil(log(d.capacity) / log(2));
+		cl_uint direction = 0;
+		while (iterations > 1) {
+			for (int i = 0; i < iterations; i++) {
+				for (int j = 0; j <= i; j++) {
+					cl_uint stride = pow(2, i - j);
+					cl_uint merge = j == 0 ? 1 : 0;
+					cl_kernel bitonic_sort_kernel = record_step(d, steps, d.bitonic_program, "bitonic_sort", num_work_items / 2);
+					error |= clSetKernelArg(bitonic_sort_kernel, 0, sizeof(cl_mem), &d.positions[0]);
+					error |= clSetKernelArg(bitonic_sort_kernel, 1, sizeof(cl_mem), &d.indices);
+					error |= clSetKernelArg(bitonic_sort_kernel, 2, sizeof(cl_uint), &d.capacity);
+					error |= clSetKernelArg(bitonic_sort_kernel, 3, sizeof(cl_uint), &stride);
+					error |= clSetKernelArg(bitonic_sort_kernel, 4, sizeof(cl_uint), &merge);
+					error |= clSetKernelArg(bitonic_sort_kernel, 5, sizeof(cl_uint), &direction);
+				}
+			}
+			iterations--;
+			direction = (direction + 1) % 3;
+		}
+
+		cl_kernel apply_indices_kernel = record_step(d, steps, d.bitonic_program, "apply_indices", d.capacity);
+		error |= clSetKernelArg(apply_indices_kernel, 0, sizeof(cl_mem), &d.indices);
+		error |= clSetKernelArg(apply_indices_kernel, 1, sizeof(cl_mem), &d.positions[0]);
+		error |= clSetKernelArg(apply_indices_kernel, 2, sizeof(cl_mem), &d.positions[1]);
+		error |= clSetKernelArg(apply_indices_kernel, 3, sizeof(cl_mem), &d.positions_old[0]);
+		error |= clSetKernelArg(apply_indices_kernel, 4, sizeof(cl_mem), &d.positions_old[1]);
+		error |= clSetKernelArg(apply_indices_kernel, 5, sizeof(cl_mem), &d.ids[0]);
+		error |= clSetKernelArg(apply_indices_kernel, 6, sizeof(cl_mem), &d.ids[1]);
+		error |= clSetKernelArg(apply_indices_kernel, 7, sizeof(cl_uint), &d.capacity);
+		std::swap(d.positions[0], d.positions[1]);
+		std::swap(d.positions_old[0], d.positions_old[1]);
+		std::swap(d.ids[0], d.ids[1]);
+
+		size_t gws = pow(2, ceil(log(d.capacity) / log(2)) - 1);
+		for (size_t i = 0; i < d.bvh_levels.size() - 1; i++) {
+			cl_kernel construct_bvh_kernel = record_step(d, steps, d.bvh_program, "construct_bvh", gws);
+			error |= clSetKernelArg(construct_bvh_kernel, 0, sizeof(cl_mem), &d.positions[0]);
+			error |= clSetKernelArg(construct_bvh_kernel, 1, sizeof(cl_mem), &d.bvh);
+			error |= clSetKernelArg(construct_bvh_kernel, 2, sizeof(cl_uint), &d.bvh_levels[i].first);
+			error |= clSetKernelArg(construct_bvh_kernel, 3, sizeof(cl_uint), &d.bvh_levels[i].second);
+			error |= clSetKernelArg(construct_bvh_kernel, 4, sizeof(cl_uint), &d.bvh_levels[i + 1].first);
+			gws = std::max<size_t>(gws / 2, 1);
+		}
+
+		cl_uint frame_parity = parity;
+		cl_kernel compact_active_kernel = record_step(d, steps, d.particle_simulation_program, "compact_active", d.capacity);
+		error |= clSetKernelArg(compact_active_kernel, 0, sizeof(cl_mem), &d.positions[0]);
+		error |= clSetKernelArg(compact_active_kernel, 1, sizeof(cl_mem), &d.positions[1]);
+		error |= clSetKernelArg(compact_active_kernel, 2, sizeof(cl_mem), &d.positions_old[0]);
+		error |= clSetKernelArg(compact_active_kernel, 3, sizeof(cl_mem), &d.active_indices);
+		error |= clSetKernelArg(compact_active_kernel, 4, sizeof(cl_mem), &d.active_counts);
+		error |= clSetKernelArg(compact_active_kernel, 5, sizeof(cl_uint), &frame_parity);
+		error |= clSetKernelArg(compact_active_kernel, 6, sizeof(cl_uint), &d.capacity);
+
+		for (int i = 0; i < 10; i++) {
+			cl_kernel resolve_collisions_kernel = record_step(d, steps, d.particle_simulation_program, "resolve_collisions", d.capacity);
+			error |= clSetKernelArg(resolve_collisions_kernel, 0, sizeof(cl_mem), &d.positions[0]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 1, sizeof(cl_mem), &d.positions[1]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 2, sizeof(cl_mem), &d.positions_old[0]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 3, sizeof(cl_mem), &d.bvh);
+			error |= clSetKernelArg(resolve_collisions_kernel, 4, sizeof(cl_uint), &d.bvh_levels[1].second);
+			error |= clSetKernelArg(resolve_collisions_kernel, 5, sizeof(cl_mem), &d.world_triangles);
+			error |= clSetKernelArg(resolve_collisions_kernel, 6, sizeof(cl_uint), &num_triangles);
+			error |= clSetKernelArg(resolve_collisions_kernel, 7, sizeof(cl_mem), &d.active_indices);
+			error |= clSetKernelArg(resolve_collisions_kernel, 8, sizeof(cl_mem), &d.active_counts);
+			error |= clSetKernelArg(resolve_collisions_kernel, 9, sizeof(cl_uint), &frame_parity);
+			if (distance_field_colliders) {
+				error |= clSetKernelArg(resolve_collisions_kernel, 10, sizeof(cl_mem), &d.world_distances);
+				error |= clSetKernelArg(resolve_collisions_kernel, 11, sizeof(cl_float4), &distance_field.origin);
+			}
+			std::swap(d.positions[0], d.positions[1]);
+		}
+	}
+	particle::cl::print_error(error, "domain_decomposition::record_frames");
+}
+
+void domain_decomposition::swap_buffers(domain& d) {
+	std::swap(d.positions[0], d.positions[1]);
+	std::swap(d.positions_old[0], d.positions_old[1]);
+	std::swap(d.ids[0], d.ids[1]);
+	d.frame_parity = 1 - d.frame_parity;
+}
+
+cl_int domain_decomposition::upload(domain& d, const particle_range& range, cl_uint offset) {
+	cl_int error = CL_SUCCESS;
+	size_t count = range.positions.size();
+	if (count == 0) return error;
+	error |= clEnqueueWriteBuffer(d.command_queue, d.positions[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), range.positions.data(), NULL, nullptr, nullptr);
+	error |= clEnqueueWriteBuffer(d.command_queue, d.positions_old[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), range.positions_old.data(), NULL, nullptr, nullptr);
+	error |= clEnqueueWriteBuffer(d.command_queue, d.ids[0], CL_FALSE, offset * sizeof(cl_uint), count * sizeof(cl_uint), range.ids.data(), NULL, nullptr, nullptr);
+	return error;
+}
+
+cl_int domain_decomposition::download(domain& d, particle_range& range, cl_uint offset, cl_uint count) {
+	cl_int error = CL_SUCCESS;
+	range.positions.resize(count);
+	range.positions_old.resize(count);
+	range.ids.resize(count);
+	if (count == 0) return error;
+	error |= clEnqueueReadBuffer(d.command_queue, d.positions[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), range.positions.data(), NULL, nullptr, nullptr);
+	error |= clEnqueueReadBuffer(d.command_queue, d.positions_old[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), range.positions_old.data(), NULL, nullptr, nullptr);
+	error |= clEnqueueReadBuffer(d.command_queue, d.ids[0], CL_FALSE, offset * sizeof(cl_uint), count * sizeof(cl_uint), range.ids.data(), NULL, nullptr, nullptr);
+	return error;
+}
+
+cl_int domain_decomposition::park(domain& d, cl_uint first_index) {
+	if (first_index >= d.capacity) return CL_SUCCESS;
+	cl_int error = CL_SUCCESS;
+	error |= clSetKernelArg(d.park_kernel, 0, sizeof(cl_mem), &d.positions[0]);
+	error |= clSetKernelArg(d.park_kernel, 1, sizeof(cl_mem), &d.positions_old[0]);
+	error |= clSetKernelArg(d.park_kernel, 2, sizeof(cl_uint), &first_index);
+	error |= clSetKernelArg(d.park_kernel, 3, sizeof(cl_uint), &d.capacity);
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("move"), d.capacity - first_index);
+	size_t global_work_size = particle::cl::get_global_work_size(d.capacity - first_index, local_work_size);
+	error |= clEnqueueNDRangeKernel(d.command_queue, d.park_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	return error;
+}
+
+void domain_decomposition::import_particles(size_t index) {
+	cl_int error = CL_SUCCESS;
+	domain& d = domains[index];
+	std::vector<const particle_range*> migrants;
+	std::vector<const particle_range*> ghosts;
+	if (index > 0) {
+		migrants.push_back(&domains[index - 1].exports[RIGHT_MIGRANTS]);
+		ghosts.push_back(&domains[index - 1].exports[RIGHT_GHOSTS]);
+	}
+	if (index + 1 < domains.size()) {
+		migrants.push_back(&domains[index + 1].exports[LEFT_MIGRANTS]);
+		ghosts.push_back(&domains[index + 1].exports[LEFT_GHOSTS]);
+	}
+
+	// the partition left the particles that stay at the front of the domain
+	cl_uint offset = d.bucket_sizes[0] + d.bucket_sizes[1] + d.bucket_sizes[2];
+	cl_uint num_required = offset;
+	for (const particle_range* range : migrants) num_required += range->positions.size();
+	for (const particle_range* range : ghosts) num_required += range->positions.size();
+	if (num_required > d.capacity) {
+		particle_range kept;
+		error |= download(d, kept, 0, offset);
+		clFinish(d.command_queue);
+		release(d);
+		allocate(d, pow(2, ceil(log(2 * num_required) / log(2))));
+		error |= upload(d, kept, 0);
+		clFinish(d.command_queue);
+	}
+
+	for (const particle_range* range : migrants) {
+		error |= upload(d, *range, offset);
+		offset += range->positions.size();
+	}
+	d.num_owned = offset;
+	for (const particle_range* range : ghosts) {
+		error |= upload(d, *range, offset);
+		offset += range->positions.size();
+	}
+	d.num_ghosts = offset - d.num_owned;
+	error |= park(d, offset);
+	particle::cl::print_error(error, "domain_decomposition::import_particles");
+}
+
+void domain_decomposition::move_particles(domain& d, cl_float time_delta) {
+	cl_int error = CL_SUCCESS;
+	error |= clSetKernelArg(d.move_kernel, 0, sizeof(cl_mem), &d.positions_old[0]);
+	error |= clSetKernelArg(d.move_kernel, 1, sizeof(cl_mem), &d.positions[0]);
+	error |= clSetKernelArg(d.move_kernel, 3, sizeof(cl_float), &time_delta_old);
+	error |= clSetKernelArg(d.move_kernel, 4, sizeof(cl_float), &time_delta);
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("move"), d.capacity);
+	size_t global_work_size = particle::cl::get_global_work_size(d.capacity, local_work_size);
+	error |= clEnqueueNDRangeKernel(d.command_queue, d.move_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	particle::cl::print_error(error, "domain_decomposition::move_particles");
+}
+
+void domain_decomposition::partition_particles(domain& d) {
+	cl_int error = CL_SUCCESS;
+	cl_uint zero = 0;
+	error |= clEnqueueFillBuffer(d.command_queue, d.counters, &zero, sizeof(cl_uint), 0, sizeof(d.bucket_sizes), NULL, nullptr, nullptr);
+	for (cl_kernel kernel : {d.count_kernel, d.scatter_kernel}) {
+		error |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &d.positions[0]);
+		error |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d.positions_old[0]);
+		error |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d.counters);
+	}
+	error |= clSetKernelArg(d.count_kernel, 3, sizeof(cl_uint), &d.capacity);
+	error |= clSetKernelArg(d.count_kernel, 4, sizeof(cl_float2), &d.slab);
+	error |= clSetKernelArg(d.count_kernel, 5, sizeof(cl_float), &halo);
+	error |= clSetKernelArg(d.scatter_kernel, 3, sizeof(cl_mem), &d.indices);
+	error |= clSetKernelArg(d.scatter_kernel, 4, sizeof(cl_uint), &d.capacity);
+	error |= clSetKernelArg(d.scatter_kernel, 5, sizeof(cl_float2), &d.slab);
+	error |= clSetKernelArg(d.scatter_kernel, 6, sizeof(cl_float), &halo);
+
+	// the buckets are applied with the gather of the sort stage
+	error |= clSetKernelArg(d.apply_indices_kernel, 0, sizeof(cl_mem), &d.indices);
+	error |= clSetKernelArg(d.apply_indices_kernel, 1, sizeof(cl_mem), &d.positions[0]);
+	error |= clSetKernelArg(d.apply_indices_kernel, 2, sizeof(cl_mem), &d.positions[1]);
+	error |= clSetKernelArg(d.apply_indices_kernel, 3, sizeof(cl_mem), &d.positions_old[0]);
+	error |= clSetKernelArg(d.apply_indices_kernel, 4, sizeof(cl_mem), &d.positions_old[1]);
+	error |= clSetKernelArg(d.apply_indices_kernel, 5, sizeof(cl_mem), &d.ids[0]);
+	error |= clSetKernelArg(d.apply_indices_kernel, 6, sizeof(cl_mem), &d.ids[1]);
+	error |= clSetKernelArg(d.apply_indices_kernel, 7, sizeof(cl_uint), &d.capacity);
+
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("apply_indices"), d.capacity);
+	size_t global_work_size = particle::cl::get_global_work_size(d.capacity, local_work_size);
+	for (cl_kernel kernel : {d.count_kernel, d.scatter_kernel, d.apply_indices_kernel}) {
+		error |= clEnqueueNDRangeKernel(d.command_queue, kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	}
+	swap_buffers(d);
+	error |= clEnqueueReadBuffer(d.command_queue, d.counters, CL_FALSE, 0, sizeof(d.bucket_sizes), d.bucket_sizes, NULL, nullptr, nullptr);
+	particle::cl::print_error(error, "domain_decomposition::partition_particles");
+}
+
+void domain_decomposition::export_particles(size_t index, size_t* gathered) {
+	cl_int error = CL_SUCCESS;
+	domain& d = domains[index];
+	cl_uint* bucket_sizes = d.bucket_sizes;
+	cl_uint right_halo_index = bucket_sizes[0] + bucket_sizes[1];
+	cl_uint migrants_index = right_halo_index + bucket_sizes[2];
+	error |= download(d, d.exports[LEFT_GHOSTS], 0, index > 0 ? bucket_sizes[0] : 0);
+	error |= download(d, d.exports[RIGHT_GHOSTS], right_halo_index, index + 1 < domains.size() ? bucket_sizes[2] : 0);
+	error |= download(d, d.exports[LEFT_MIGRANTS], migrants_index, bucket_sizes[3]);
+	error |= download(d, d.exports[RIGHT_MIGRANTS], migrants_index + bucket_sizes[3], bucket_sizes[4]);
+
+	// everything in front of the dropped bucket is owned by this domain until the migrants are imported
+	size_t num_owned = std::min<size_t>(migrants_index + bucket_sizes[3] + bucket_sizes[4], num_particles - *gathered);
+	if (num_owned > 0) {
+		error |= clEnqueueReadBuffer(d.command_queue, d.positions[0], CL_FALSE, 0, num_owned * sizeof(cl_float4), positions.data() + *gathered, NULL, nullptr, nullptr);
+		error |= clEnqueueReadBuffer(d.command_queue, d.ids[0], CL_FALSE, 0, num_owned * sizeof(cl_uint), ids.data() + *gathered, NULL, nullptr, nullptr);
+	}
+	*gathered += num_owned;
+	particle::cl::print_error(error, "domain_decomposition::export_particles");
+}
+
+void domain_decomposition::collect_exports() {
+	size_t gathered = 0;
+	for (size_t i = 0; i < domains.size(); i++) {
+		export_particles(i, &gathered);
+	}
+	finish();
+
+	for (domain& d : domains) {
+		for (export_range range : {LEFT_GHOSTS, RIGHT_GHOSTS}) {
+			for (cl_float4& position_old : d.exports[range].positions_old) {
+				position_old.s[3] = -1 - position_old.s[3];
+			}
+		}
+	}
+}
+
+void domain_decomposition::finish() {
+	for (domain& d : domains) {
+		clFinish(d.command_queue);
+	}
+}
+
+void domain_decomposition::step(cl_float time_delta) {
+	auto start = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < domains.size(); i++) {
+		import_particles(i);
+	}
+
+	// ghosts are moved by the receiving domain exactly like by their owner, so one exchange per step is enough
+	for (domain& d : domains) {
+		move_particles(d, time_delta);
+		// the partition swaps the buffers back, so every frame runs with the same parity and compact_active never clears its count
+		cl_uint zero = 0;
+		particle::cl::print_error(clEnqueueFillBuffer(d.command_queue, d.active_counts, &zero, sizeof(cl_uint), d.frame_parity * sizeof(cl_uint), sizeof(cl_uint), NULL, nullptr, nullptr), "domain_decomposition::step");
+		particle::cl::print_error(particle::cl::enqueue_steps(d.command_queue, d.frame_steps[d.frame_parity]), "domain_decomposition::step");
+		swap_buffers(d);
+	}
+	time_delta_old = time_delta;
+
+	for (domain& d : domains) {
+		partition_particles(d);
+	}
+	finish();
+	collect_exports();
+	rebalance();
+	step_duration = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+const std::vector<cl_float4>& domain_decomposition::get_positions() const {
+	return positions;
+}
+
+const std::vector<cl_uint>& domain_decomposition::get_ids() const {
+	return ids;
+}
+
+double domain_decomposition::get_step_duration() const {
+	return step_duration;
+}
+
+size_t domain_decomposition::get_num_domains() const {
+	return domains.size();
+}
+
+void domain_decomposition::print_report() const {
+	std::cout << "domain decomposition: " << step_duration << " ms/step" << std::endl;
+	for (size_t i = 0; i < domains.size(); i++) {
+		const domain& d = domains[i];
+		std::cout << "  " << i << ": " << particle::cl::get_device_name(d.device) << " [" << d.slab.s[0] << ", " << d.slab.s[1] << ") owned " << d.num_owned << ", ghosts " << d.num_ghosts << ", capacity " << d.capacity << std::endl;
+	}
+}
+
+void domain_decomposition::print_memory_report() const {
+	for (size_t i = 0; i < domains.size(); i++) {
+		std::cout << "domain " << i << " on " << particle::cl::get_device_name(domains[i].device) << " ";
+		domains[i].memory->print_report();
+	}
+}
+
+domain_decomposition::domain_decomposition(std::vector<cl_device_id> devices, std::vector<cl_float> particle_data, std::vector<cl_float4> world_triangles, const particle::cl::distance_field* distance_field, std::map<std::string, size_t> local_work_sizes):
+	local_work_sizes(local_work_sizes),
+	world_triangles(world_triangles),
+	distance_field_colliders(distance_field != nullptr),
+	num_particles(particle_data.size() / 4),
+	num_triangles(world_triangles.size() / 5),
+	halo(0) {
+	if (distance_field_colliders) {
+		this->distance_field = *distance_field;
+	}
+	positions.resize(num_particles);
+	ids.resize(num_particles);
+	std::iota(ids.begin(), ids.end(), 0);
+	for (size_t i = 0; i < num_particles; i++) {
+		std::copy_n(&particle_data[4 * i], 4, positions[i].s);
+		// a particle can reach anything within two diameters of it during the collision iterations
+		halo = std::max(halo, 4 * positions[i].s[3]);
+	}
+
+	domains.resize(devices.size());
+	for (size_t i = 0; i < devices.size(); i++) {
+		init_domain(domains[i], devices[i]);
+		std::fill_n(domains[i].bucket_sizes, 12, 0);
+	}
+	balance_slabs();
+
+	std::vector<particle_range> ranges(domains.size());
+	for (size_t i = 0; i < num_particles; i++) {
+		size_t index = 0;
+		while (positions[i].s[0] >= domains[index].slab.s[1]) index++;
+		ranges[index].positions.push_back(positions[i]);
+		ranges[index].positions_old.push_back(positions[i]);
+		ranges[index].ids.push_back(i);
+	}
+	for (size_t i = 0; i < domains.size(); i++) {
+		cl_uint num_owned = ranges[i].positions.size();
+		allocate(domains[i], pow(2, ceil(log(std::max(2 * num_owned, 64u)) / log(2))));
+		particle::cl::print_error(upload(domains[i], ranges[i], 0), "domain_decomposition::domain_decomposition");
+		domains[i].num_owned = num_owned;
+		partition_particles(domains[i]);
+	}
+	finish();
+	collect_exports();
+}
+
+domain_decomposition::~domain_decomposition() {
+	for (domain& d : domains) {
+		release(d);
+		for (cl_kernel kernel : {d.move_kernel, d.count_kernel, d.scatter_kernel, d.apply_indices_kernel, d.park_kernel}) {
+			clReleaseKernel(kernel);
+		}
+		for (cl_program program : {d.particle_simulation_program, d.bitonic_program, d.bvh_program, d.decomposition_program}) {
+			clReleaseProgram(program);
+		}
+		d.memory.reset();
+		clReleaseCommandQueue(d.command_queue);
+		clReleaseContext(d.context);
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+#include "device_memory.hpp"
+#include "utility.hpp"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// splits the simulation into slabs along x, each simulated on its own device with ghost copies of the particles next to its borders
+class domain_decomposition {
+	enum export_range {
+		LEFT_GHOSTS,
+		RIGHT_GHOSTS,
+		LEFT_MIGRANTS,
+		RIGHT_MIGRANTS,
+		NUM_EXPORT_RANGES
+	};
+
+	struct particle_range {
+		std::vector<cl_float4> positions;
+		std::vector<cl_float4> positions_old;
+		std::vector<cl_uint> ids;
+	};
+
+	struct domain {
+		cl_device_id device;
+		cl_context context;
+		cl_command_queue command_queue;
+		// every buffer of the domain, so a growing capacity is served from the pool of its context
+		std::unique_ptr<device_memory> memory;
+
+		cl_program particle_simulation_program;
+		cl_program bitonic_program;
+		cl_program bvh_program;
+		cl_program decomposition_program;
+
+		cl_kernel move_kernel;
+		cl_kernel count_kernel;
+		cl_kernel scatter_kernel;
+		cl_kernel apply_indices_kernel;
+		cl_kernel park_kernel;
+
+		cl_mem positions[2];
+		cl_mem positions_old[2];
+		cl_mem ids[2];
+		cl_mem indices;
+		cl_mem active_indices;
+		cl_mem active_counts;
+		cl_mem bvh;
+		cl_mem counters;
+		cl_mem world_triangles;
+		cl_mem world_distances = nullptr;
+
+		// every slot up to the capacity is simulated, the ones not owned or ghosted are parked
+		cl_uint capacity = 0;
+		std::vector<std::pair<cl_uint, cl_uint>> bvh_levels;
+		std::vector<particle::cl::kernel_step> frame_steps[2];
+		int frame_parity = 0;
+
+		cl_float2 slab;
+		cl_uint num_owned = 0;
+		cl_uint num_ghosts = 0;
+		cl_uint bucket_sizes[12];
+		particle_range exports[NUM_EXPORT_RANGES];
+	};
+
+	std::vector<domain> domains;
+	std::map<std::string, size_t> local_work_sizes;
+	std::vector<cl_float4> world_triangles;
+	bool distance_field_colliders;
+	particle::cl::distance_field distance_field;
+	cl_uint num_particles;
+	cl_uint num_triangles;
+	cl_float halo;
+	cl_float time_delta_old = 0;
+
+	std::vector<cl_float4> positions;
+	std::vector<cl_uint> ids;
+	double step_duration = 0;
+
+	void init_domain(domain& d, cl_device_id device);
+	void allocate(domain& d, cl_uint capacity);
+	void release(domain& d);
+	void set_slabs(std::vector<cl_float> boundaries);
+	void balance_slabs();
+	void rebalance();
+
+	cl_kernel record_step(domain& d, std::vector<particle::cl::kernel_step>& steps, cl_program program, const char* kernel_name, size_t work_items);
+	void record_frames(domain& d);
+	void swap_buffers(domain& d);
+
+	cl_int upload(domain& d, const particle_range& range, cl_uint offset);
+	cl_int download(domain& d, particle_range& range, cl_uint offset, cl_uint count);
+	cl_int park(domain& d, cl_uint first_index);
+
+	void import_particles(size_t index);
+	void move_particles(domain& d, cl_float time_delta);
+	void partition_particles(domain& d);
+	void export_particles(size_t index, size_t* gathered);
+	void collect_exports();
+	void finish();
+
+public:
+	domain_decomposition(std::vector<cl_device_id> devices, std::vector<cl_float> particle_data, std::vector<cl_float4> world_triangles, const particle::cl::distance_field* distance_field, std::map<std::string, size_t> local_work_sizes);
+	~domain_decomposition();
+
+	void step(cl_float time_delta);
+	const std::vector<cl_float4>& get_positions() const;
+	const std::vector<cl_uint>& get_ids() const;
+	double get_step_duration() const;
+	size_t get_num_domains() const;
+	void print_report() const;
+	void print_memory_report() const;
+};
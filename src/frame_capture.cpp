@@ -0,0 +1,154 @@
+#pragma once
+
+#include "frame_capture.hpp"
+#include "utility.hpp"
+
+#include <cstdio>
+#include <iostream>
+
+
+frame_capture::frame_capture(std::string file_name, unsigned int width, unsigned int height, unsigned int frame_rate, size_t num_slots):
+	slots(num_slots),
+	width(width),
+	height(height),
+	file_name(file_name),
+	y4m(file_name.size() > 4 && file_name.compare(file_name.size() - 4, 4, ".y4m") == 0) {
+	GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	for (slot& s : slots) {
+		glGenBuffers(1, &s.buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+		glBufferStorage(GL_PIXEL_PACK_BUFFER, 4 * width * height, nullptr, flags);
+		s.pixels = static_cast<const unsigned char*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4 * width * height, flags));
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	particle::gl::print_error(glGetError(), "frame_capture::frame_capture");
+
+	if (y4m) {
+		stream.open(file_name, std::ios::binary);
+		if (!stream.is_open()) {
+			std::cout << "could not open file " << file_name << std::endl;
+		}
+		stream << "YUV4MPEG2 W" << width << " H" << height << " F" << frame_rate << ":1 Ip A1:1 C444" << std::endl;
+	}
+	writer = std::thread(&frame_capture::write_frames, this);
+}
+
+frame_capture::~frame_capture() {
+	// everything still in flight is written before the buffers go away
+	hand_over(true);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = true;
+	}
+	condition.notify_one();
+	writer.join();
+
+	for (slot& s : slots) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glDeleteBuffers(1, &s.buffer);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	std::cout << "captured " << num_captured << " frames to " << file_name << ", dropped " << num_dropped << std::endl;
+}
+
+// passes the readbacks that have finished on to the writer, in the order they were captured
+void frame_capture::hand_over(bool wait) {
+	while (!pending_slots.empty()) {
+		slot& s = slots[pending_slots.front()];
+		GLenum status = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_TIMEOUT_IGNORED : 0);
+		if (status == GL_TIMEOUT_EXPIRED) break;
+		glDeleteSync(s.fence);
+		s.fence = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			s.writing = true;
+			ready_slots.push_back(pending_slots.front());
+		}
+		condition.notify_one();
+		pending_slots.pop_front();
+	}
+}
+
+void frame_capture::capture(GLuint framebuffer) {
+	hand_over(false);
+	slot& s = slots[next_slot];
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (s.fence != nullptr || s.writing) {
+			num_dropped++;
+			return;
+		}
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	pending_slots.push_back(next_slot);
+	next_slot = (next_slot + 1) % slots.size();
+	num_captured++;
+	particle::gl::print_error(glGetError(), "frame_capture::capture");
+}
+
+void frame_capture::write_frames() {
+	while (true) {
+		size_t index;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&]() { return finished || !ready_slots.empty(); });
+			if (ready_slots.empty()) return;
+			index = ready_slots.front();
+			ready_slots.pop_front();
+		}
+		write_frame(slots[index].pixels);
+		std::lock_guard<std::mutex> lock(mutex);
+		slots[index].writing = false;
+	}
+}
+
+// gl rows start at the bottom, both formats start at the top
+void frame_capture::write_frame(const unsigned char* pixels) {
+	if (y4m) {
+		// bt.601 studio range, one full resolution plane after the other
+		std::vector<unsigned char> planes(3 * width * height);
+		for (unsigned int y = 0; y < height; y++) {
+			const unsigned char* row = pixels + 4 * width * (height - 1 - y);
+			for (unsigned int x = 0; x < width; x++) {
+				int r = row[4 * x];
+				int g = row[4 * x + 1];
+				int b = row[4 * x + 2];
+				size_t i = y * width + x;
+				planes[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+				planes[width * height + i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+				planes[2 * width * height + i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+			}
+		}
+		stream << "FRAME\n";
+		stream.write(reinterpret_cast<const char*>(planes.data()), planes.size());
+	} else {
+		char number[16];
+		std::snprintf(number, sizeof(number), "%06zu", num_written);
+		std::ofstream image(file_name + number + ".ppm", std::ios::binary);
+		image << "P6\n" << width << " " << height << "\n255\n";
+		std::vector<unsigned char> row(3 * width);
+		for (unsigned int y = 0; y < height; y++) {
+			const unsigned char* source = pixels + 4 * width * (height - 1 - y);
+			for (unsigned int x = 0; x < width; x++) {
+				std::copy_n(source + 4 * x, 3, &row[3 * x]);
+			}
+			image.write(reinterpret_cast<const char*>(row.data()), row.size());
+		}
+	}
+	num_written++;
+}
+
+size_t frame_capture::get_num_captured() const {
+	return num_captured;
+}
+
+size_t frame_capture::get_num_dropped() const {
+	return num_dropped;
+}
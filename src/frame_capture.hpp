@@ -0,0 +1,55 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// streams the color attachment of a framebuffer to disk, read back through a ring of persistently mapped pixel buffers
+// a frame is handed to the writer thread once its fence has passed, frames are dropped instead of stalling when every buffer is in flight
+class frame_capture {
+	struct slot {
+		GLuint buffer;
+		const unsigned char* pixels;
+		GLsync fence = nullptr;
+		bool writing = false;
+	};
+
+	std::vector<slot> slots;
+	size_t next_slot = 0;
+	std::deque<size_t> pending_slots;
+	unsigned int width;
+	unsigned int height;
+
+	// a .y4m file name is one yuv 4:4:4 stream, anything else is the prefix of numbered ppm images
+	std::string file_name;
+	bool y4m;
+	std::ofstream stream;
+	size_t num_captured = 0;
+	size_t num_dropped = 0;
+	size_t num_written = 0;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<size_t> ready_slots;
+	bool finished = false;
+
+	void hand_over(bool wait);
+	void write_frames();
+	void write_frame(const unsigned char* pixels);
+
+public:
+	frame_capture(std::string file_name, unsigned int width, unsigned int height, unsigned int frame_rate, size_t num_slots = 4);
+	~frame_capture();
+
+	void capture(GLuint framebuffer);
+	size_t get_num_captured() const;
+	size_t get_num_dropped() const;
+};
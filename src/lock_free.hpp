@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+
+namespace particle {
+	// the producer fills the back slot and publishes it, the consumer takes the latest published slot as its front
+	// neither side ever waits, the producer overwrites states the consumer has not taken yet
+	template <typename T>
+	class triple_buffer {
+		static constexpr unsigned int fresh = 4;
+
+		T slots[3];
+		std::atomic<unsigned int> middle{1};	// the fresh bit is set until the consumer has taken the slot
+		unsigned int back = 0;
+		unsigned int front = 2;
+
+	public:
+		// only while neither the producer nor the consumer runs
+		T& get_slot(size_t index) {
+			return slots[index];
+		}
+
+		T& get_back() {
+			return slots[back];
+		}
+
+		void publish() {
+			back = middle.exchange(back | fresh, std::memory_order_acq_rel) & 3;
+		}
+
+		bool update() {
+			if ((middle.load(std::memory_order_relaxed) & fresh) == 0) return false;
+			front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+			return true;
+		}
+
+		T& get_front() {
+			return slots[front];
+		}
+	};
+
+	// ring of one producer and one consumer thread, a full queue drops what is pushed
+	template <typename T, size_t capacity>
+	class spsc_queue {
+		T items[capacity];
+		std::atomic<size_t> head{0};
+		std::atomic<size_t> tail{0};
+
+	public:
+		bool push(const T& item) {
+			size_t current_tail = tail.load(std::memory_order_relaxed);
+			size_t next_tail = (current_tail + 1) % capacity;
+			if (next_tail == head.load(std::memory_order_acquire)) return false;
+			items[current_tail] = item;
+			tail.store(next_tail, std::memory_order_release);
+			return true;
+		}
+
+		bool pop(T* item) {
+			size_t current_head = head.load(std::memory_order_relaxed);
+			if (current_head == tail.load(std::memory_order_acquire)) return false;
+			*item = items[current_head];
+			head.store((current_head + 1) % capacity, std::memory_order_release);
+			return true;
+		}
+	};
+}
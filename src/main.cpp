@@ -1,49 +1,164 @@
 #include <GL/glew.h>
 #define CL_USE_DEPRECATED_OPENCL_2_0_APIS
 #include <CL/cl.h>
+#include <algorithm>
 #include <vector>
 #include <ctime>
+#include <iostream>
+#include <string>
 #include "particle_system.hpp"
 
-int main() {
-
-	const cl_uint num_particles = 512;
-
-	srand(static_cast<unsigned>(time(nullptr)));
-	auto generate_random = []() {
-		return static_cast<float>(rand()) / static_cast<float> (RAND_MAX);
-	};
+int main(int argc, char** argv) {
+	particle_system::configuration config;
+	particle::seed_distribution distribution;
+	distribution.num_particles = 512;
+	distribution.seed = static_cast<cl_ulong>(time(nullptr));
+	// a headless run either records a golden trace or is validated against one, traces/free_fall.trace is the committed one
+	std::string golden_file;
+	bool record_golden = false;
+	particle::metric_tolerances tolerances;
+	cl_uint num_steps = 600;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		std::string value = i + 1 < argc ? argv[i + 1] : "";
+		bool numeric = !value.empty() && value.find_first_not_of("0123456789") == std::string::npos;
+		bool decimal = !value.empty() && value.find_first_not_of("0123456789.") == std::string::npos;
+		if (arg == "--autotune") {
+			config.tune_local_work_sizes = true;
+		} else if (arg == "--device" && !value.empty()) {
+			// either an index into the printed device list or a substring of the device name
+			if (numeric) config.device_selection.index = std::stoi(value);
+			else config.device_selection.name = value;
+			i++;
+		} else if (arg == "--device-type" && !value.empty()) {
+			if (value == "cpu") config.device_selection.device_type = CL_DEVICE_TYPE_CPU;
+			else if (value == "gpu") config.device_selection.device_type = CL_DEVICE_TYPE_GPU;
+			else if (value == "accelerator") config.device_selection.device_type = CL_DEVICE_TYPE_ACCELERATOR;
+			else if (value == "all") config.device_selection.device_type = CL_DEVICE_TYPE_ALL;
+			else {
+				std::cout << "--device-type takes cpu, gpu, accelerator or all, not " << value << std::endl;
+				return 1;
+			}
+			i++;
+		} else if (arg == "--partition" && !value.empty()) {
+			if (value == "numa") config.device_selection.partition_numa = true;
+			else if (numeric) config.device_selection.partition_compute_units = std::stoi(value);
+			i++;
+		} else if (arg == "--sub-device" && numeric) {
+			config.device_selection.sub_device = std::stoi(value);
+			i++;
+		} else if (arg == "--domains" && numeric) {
+			config.num_domains = std::max(std::stoi(value), 1);
+			i++;
+		} else if (arg == "--tiles" && numeric) {
+			config.num_tiles = std::max(std::stoi(value), 1);
+			i++;
+		} else if (arg == "--scaling") {
+			config.report_scaling = true;
+		} else if (arg == "--distance-field") {
+			config.distance_field_colliders = true;
+			if (!value.empty() && value.find_first_not_of("0123456789.") == std::string::npos) {
+				config.distance_field_cell_size = std::stof(value);
+				i++;
+			}
+		} else if (arg == "--gauss-seidel") {
+			config.gauss_seidel_solver = true;
+			if (numeric) {
+				config.solver_iterations = std::max(std::stoi(value), 1);
+				i++;
+			}
+		} else if (arg == "--neighbor-lists") {
+			config.neighbor_lists = true;
+			if (!value.empty() && value.find_first_not_of("0123456789.") == std::string::npos) {
+				config.neighbor_skin = std::stof(value);
+				i++;
+			}
+		} else if (arg == "--statistics") {
+			config.statistics_interval = numeric ? std::max(std::stoi(value), 1) : 60;
+			i += numeric ? 1 : 0;
+		} else if (arg == "--residual") {
+			config.report_residual = true;
+		} else if (arg == "--memory") {
+			config.report_memory = true;
+		} else if (arg == "--threaded") {
+			config.threaded = true;
+		} else if (arg == "--particles" && numeric) {
+			distribution.num_particles = std::max(std::stoul(value), 1ul);
+			i++;
+		} else if (arg == "--scenes" && numeric) {
+			config.num_scenes = std::max(std::stoi(value), 1);
+			i++;
+		} else if (arg == "--seed" && numeric) {
+			distribution.seed = std::stoull(value);
+			i++;
+		} else if (arg == "--time-step" && !value.empty()) {
+			config.fixed_time_delta = std::stof(value);
+			i++;
+		} else if ((arg == "--record-golden" || arg == "--validate") && !value.empty()) {
+			golden_file = value;
+			record_golden = arg == "--record-golden";
+			i++;
+		} else if (arg == "--energy-tolerance" && decimal) {
+			tolerances.energy = std::stod(value);
+			i++;
+		} else if (arg == "--momentum-tolerance" && decimal) {
+			tolerances.momentum = std::stod(value);
+			i++;
+		} else if (arg == "--penetration-tolerance" && decimal) {
+			tolerances.penetration = std::stod(value);
+			i++;
+		} else if (arg == "--count-tolerance" && decimal) {
+			tolerances.count = std::stod(value);
+			i++;
+		} else if (arg == "--capture" && !value.empty()) {
+			config.capture_file = value;
+			i++;
+		} else if (arg == "--capture-frames" && numeric) {
+			config.capture_frames = std::stoul(value);
+			i++;
+		} else if (arg == "--steps" && numeric) {
+			num_steps = std::stoul(value);
+			i++;
+		}
+	}
+	if (config.gauss_seidel_solver && config.neighbor_lists) {
+		std::cout << "--gauss-seidel builds its contacts every frame and cannot be combined with --neighbor-lists" << std::endl;
+		return 1;
+	}
 
-	std::vector<cl_float> positions;
-	positions.resize(3 * num_particles);
-	std::vector<cl_float> radii;
-	radii.resize(num_particles);
+	// spread over a square that grows with the particle count, dropped from between 10 and 15 units high
+	float extent = distribution.num_particles / 16.f / 2.f;
+	distribution.box_min = {{-extent, 10, -extent, 0.1f}};
+	distribution.box_max = {{extent, 15, extent, 0.1f}};
 
-	float radius = num_particles / 16.f /2.f;
-	for (int i = 0; i < 3 * num_particles; i+=3) {
-		positions[i] = 2 * radius * generate_random() - radius;
-		positions[i + 1] = 5 * generate_random() + 10;
-		positions[i + 2] = 2 * radius * generate_random() - radius;
-		radii[i / 3] = 0.1f;
+	if (golden_file.empty()) {
+		// captured videos play back at the simulated speed
+		if (!config.capture_file.empty() && config.fixed_time_delta <= 0) {
+			config.fixed_time_delta = 1 / 60.f;
+		}
+		particle_system(config, distribution).enter_main_loop();
+		return 0;
 	}
 
-//	positions[3 * (num_particles - 4)] = -4.48f;
-//	positions[3 * (num_particles - 4) + 1] = 3;
-//	positions[3 * (num_particles - 4) + 2] = 1;
-//
-//	positions[3 * (num_particles - 3)] = -5.51;
-//	positions[3 * (num_particles - 3) + 1] = 4;
-//	positions[3 * (num_particles - 3) + 2] = 6.01;
-//
-//	positions[3 * (num_particles - 2)] = -4.5f;
-//	positions[3 * (num_particles - 2) + 1] = 4;
-//	positions[3 * (num_particles - 2) + 2] = 0;
-//
-//	positions[3 * (num_particles - 1)] = -4.48f;
-//	positions[3 * (num_particles - 1) + 1] = 3;
-//	positions[3 * (num_particles - 1) + 2] = 0;
-
-	particle_system(256, positions, radii).enter_main_loop();
-	return 0;
+	// the scene of a validation run comes from the golden trace, the variant to check from the other arguments
+	particle::physics_trace golden;
+	if (!record_golden) {
+		if (!particle::load_trace(golden_file, &golden)) return 1;
+		config.num_scenes = golden.num_scenes;
+		distribution.num_particles = golden.num_particles / golden.num_scenes;
+		distribution.seed = golden.seed;
+		distribution.box_min = golden.box_min;
+		distribution.box_max = golden.box_max;
+		config.fixed_time_delta = golden.time_delta;
+		num_steps = golden.steps.size();
+	} else if (config.fixed_time_delta <= 0) {
+		config.fixed_time_delta = 1 / 60.f;
+	}
+	config.headless = true;
+	particle::physics_trace trace = particle_system(config, distribution).run_headless(num_steps);
+	if (record_golden) {
+		return particle::save_trace(golden_file, trace) ? 0 : 1;
+	}
+	return particle::compare_traces(golden, trace, tolerances) ? 0 : 1;
 }
 
@@ -14,13 +14,79 @@
 #include <glm/gtc/type_ptr.hpp>
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <sstream>
 
 
 void particle_system::init() {
+	for (std::string kernel_name : {"move", "init_indices", "bitonic_sort", "apply_indices", "construct_bvh", "compact_active", "resolve_collisions", "build_contacts", "color_contacts", "gauss_seidel_sweep", "contact_residual", "build_neighbor_lists", "resolve_neighbors", "max_displacement", "physics_metrics", "export_velocities", "seed_particles", "seed_colors", "shade_tiles"}) {
+		local_work_sizes[kernel_name] = config.local_work_size;
+	}
+	size_scenes();
+
+	if (config.capture_file.empty()) {
+		init_window();
+	} else if (!particle::gl::create_surfaceless_context()) {
+		exit(EXIT_FAILURE);
+	}
+	// under the surfaceless egl context of a capture only a glew built with GLEW_EGL finds the entry points
+	GLenum glew_error = glewInit();
+	if (glew_error != GLEW_OK) {
+		std::cout << "could not initialize glew - " << reinterpret_cast<const char*>(glewGetErrorString(glew_error)) << (config.capture_file.empty() ? "" : ", capture needs glew built with GLEW_EGL") << std::endl;
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+	glViewport(0, 0, window_width, window_height);
+	glEnable(GL_CULL_FACE);
+
+	if (!particle::cl::init_opencl(config.device_selection, &device, &context, &command_queue, &gl_sharing)) {
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+	particle::gl::print_error(glGetError(), "particle_system::init");
+	init_gl();
+	init_cl();
+	if (!config.capture_file.empty()) {
+		unsigned int frame_rate = config.fixed_time_delta > 0 ? static_cast<unsigned int>(std::round(1 / config.fixed_time_delta)) : 60;
+		capture = std::make_unique<frame_capture>(config.capture_file, width, height, frame_rate);
+		sim = true;
+	}
+}
+
+bool particle_system::streams_tiles() const {
+	return config.num_tiles > 1 && config.num_domains <= 1 && config.num_scenes == 1;
+}
+
+void particle_system::size_scenes() {
+	// every scene is laid out with the same size, a remainder would fall off the end
+	if (num_particles % config.num_scenes != 0) {
+		std::cout << num_particles << " particles do not split into " << config.num_scenes << " scenes of the same size" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	scene_size = num_particles / config.num_scenes;
+	if (streams_tiles()) {
+		scene_size = std::min(scene_size, config.max_rendered_particles);
+	}
+	num_bvh_branch_nodes = pow(2, ceil(log(scene_size) / log(2))) - 1;
+	bvh_levels = particle::cl::get_bvh_levels(scene_size);
+}
+
+void particle_system::init_window() {
 	if (!glfwInit())
 		exit(EXIT_FAILURE);
+	if (config.headless) {
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	}
 	window = glfwCreateWindow(width, height, "Particle System", nullptr, nullptr);
 	if (!window) {
 		glfwTerminate();
@@ -28,18 +94,11 @@ void particle_system::init() {
 	}
 
 	glfwMakeContextCurrent(window);
-	glewInit();
-	glViewport(0, 0, width, height);
 
 	auto key_callback = [](GLFWwindow* window, int key, int scancode, int action, int mods) {
 		particle_system* ps = static_cast<particle_system*>(glfwGetWindowUserPointer(window));
 		if (key == GLFW_KEY_X && action != GLFW_REPEAT) {
-			if (ps->sim) {
-				ps->time -= glfwGetTime();
-			} else {
-				ps->time += glfwGetTime();
-			}
-			ps->sim = action != GLFW_RELEASE;
+			ps->simulation_events.push({input_event::SIMULATION, action != GLFW_RELEASE, glfwGetTime(), 0, 0});
 		}
 	};
 
@@ -57,12 +116,9 @@ void particle_system::init() {
 	auto cursor_position_callback = [](GLFWwindow* window, double x, double y) {
 		particle_system* ps = static_cast<particle_system*>(glfwGetWindowUserPointer(window));
 		if (ps->mouse_pressed) {
-			glm::vec3 right = normalize(cross(ps->eye - ps->center, ps->up));
-			glm::vec3 up = normalize(cross(right, ps->eye - ps->center));
-
 			float x_delta = 0.001 * (x - ps->mouse_x);
 			float y_delta = 0.001 * (y - ps->mouse_y);
-			ps->eye = ps->center + length(ps->eye - ps->center) * normalize(normalize(ps->eye - ps->center) + x_delta * right + y_delta * up);
+			ps->render_events.push({input_event::ORBIT, true, 0, x_delta, y_delta});
 
 			ps->mouse_x = x;
 			ps->mouse_y = y;
@@ -72,8 +128,7 @@ void particle_system::init() {
 
 	auto scroll_callback = [](GLFWwindow* window, double x, double y) {
 		particle_system* ps = static_cast<particle_system*>(glfwGetWindowUserPointer(window));
-		glm::vec3 new_eye = ps->eye - static_cast<float>(0.5 * y)* normalize(ps->eye - ps->center);
-		ps->eye = length(new_eye) > 1 ? new_eye : normalize(ps->eye);
+		ps->render_events.push({input_event::ZOOM, false, 0, 0, static_cast<float>(y)});
 	};
 
 	glfwSetWindowUserPointer(window, this);
@@ -81,54 +136,49 @@ void particle_system::init() {
 	glfwSetMouseButtonCallback(window, mouse_button_callback);
 	glfwSetCursorPosCallback(window, cursor_position_callback);
 	glfwSetScrollCallback(window, scroll_callback);
-	glEnable(GL_CULL_FACE);
-
-	particle::cl::init_opencl(&device, &context, &command_queue);
-	particle::gl::print_error(glGetError(), "particle_system::init");
-	init_gl();
-	init_cl();
+	glfwSetFramebufferSizeCallback(window, [](GLFWwindow* window, int width, int height) {
+		static_cast<particle_system*>(glfwGetWindowUserPointer(window))->resize(width, height);
+	});
 }
 
 void particle_system::init_gl() {
 
 	glGenFramebuffers(1, &gl_framebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, gl_framebuffer);
-
-	GLuint gl_colorbuffer;
-	glGenRenderbuffers(1, &gl_colorbuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, gl_colorbuffer);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gl_colorbuffer);
-
-	glGenTextures(1, &gl_position_texture);
-	glBindTexture(GL_TEXTURE_2D, gl_position_texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gl_position_texture, 0);
-
-	GLuint gl_depthbuffer;
-	glGenRenderbuffers(1, &gl_depthbuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, gl_depthbuffer);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gl_depthbuffer);
-	particle::gl::print_error_framebuffer(glCheckFramebufferStatus(GL_FRAMEBUFFER), "particle_system::init_gl");
-
-	glGenTextures(1, &gl_light_texture);
-	glBindTexture(GL_TEXTURE_3D, gl_light_texture);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, 32, 16, 256, 0, GL_RGBA, GL_FLOAT, nullptr);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
-
+	glGenTextures(1, &gl_color_texture);
+	glGenTextures(1, &gl_normal_texture);
+	glGenTextures(1, &gl_depth_texture);
+	allocate_gl_textures();
 
 	particle::gl::print_error(glGetError(), "particle_system::init_gl");
 	init_gl_particle();
 	init_gl_world();
 }
 
+// redefining the storage on resize keeps the names the framebuffer and the cl images are created from
+void particle_system::allocate_gl_textures() {
+	glBindFramebuffer(GL_FRAMEBUFFER, gl_framebuffer);
+
+	glBindTexture(GL_TEXTURE_2D, gl_color_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gl_color_texture, 0);
+
+	glBindTexture(GL_TEXTURE_2D, gl_normal_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, width, height, 0, GL_RG, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gl_normal_texture, 0);
+
+	glBindTexture(GL_TEXTURE_2D, gl_depth_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gl_depth_texture, 0);
+	particle::gl::print_error_framebuffer(glCheckFramebufferStatus(GL_FRAMEBUFFER), "particle_system::allocate_gl_textures");
+	particle::gl::print_error(glGetError(), "particle_system::allocate_gl_textures");
+}
+
 void particle_system::init_gl_particle() {
 	GLuint vertex_shader = particle::gl::compile_shader("shaders/gl/particle.vert", GL_VERTEX_SHADER);
 	GLuint fragment_shader = particle::gl::compile_shader("shaders/gl/particle.frag", GL_FRAGMENT_SHADER);
@@ -140,28 +190,18 @@ void particle_system::init_gl_particle() {
 
 	std::vector<GLfloat> particle_geometry = particle::create_sphere(1, 4);
 
-	auto generate_random = []() {
-		return static_cast<GLfloat>(rand()) / static_cast<GLfloat> (RAND_MAX);
-	};
-	std::vector<GLfloat> particle_colors;
-	particle_colors.resize(3 * num_particles);
-	for (size_t i = 0; i < 3 * num_particles; i += 3) {
-		particle_colors[i] = generate_random();
-		particle_colors[i + 1] = generate_random();
-		particle_colors[i + 2] = generate_random();
-	}
-
 
 	glGenVertexArrays(2, gl_particle_vao);
 	glGenBuffers(2, gl_positions);
-	GLuint gl_particle_geometry;
 	glGenBuffers(1, &gl_particle_geometry);
-	glGenBuffers(2, gl_particle_colors);
+	glGenBuffers(2, gl_particle_ids);
+	glGenBuffers(1, &gl_particle_colors);
+	glGenTextures(1, &gl_particle_color_texture);
+	allocate_gl_particles();
 
 	for (int i = 0; i < 2; i++) {
 		glBindVertexArray(gl_particle_vao[i]);
 		glBindBuffer(GL_ARRAY_BUFFER, gl_positions[i]);
-		glBufferData(GL_ARRAY_BUFFER, num_particles * sizeof(cl_float4), h_particle_data.data(), GL_DYNAMIC_DRAW);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, nullptr);
 		glVertexAttribDivisorARB(0, 1);
@@ -171,16 +211,33 @@ void particle_system::init_gl_particle() {
 		glEnableVertexAttribArray(1);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
 
-		glBindBuffer(GL_ARRAY_BUFFER, gl_particle_colors[i]);
-		glBufferData(GL_ARRAY_BUFFER, particle_colors.size() * sizeof(GLfloat), particle_colors.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, gl_particle_ids[i]);
 		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+		glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, 0, nullptr);
 		glVertexAttribDivisorARB(2, 1);
 	}
 
 	particle::gl::print_error(glGetError(), "particle_system::init_gl_particle");
 }
 
+// the vertex arrays refer to the buffer names, so a reconfiguration only has to redefine the storage
+void particle_system::allocate_gl_particles() {
+	// ids, colors and seeded positions are written by seed_particles
+	size_t num_drawn = streams_tiles() ? scene_size : num_particles;
+	glBindBuffer(GL_TEXTURE_BUFFER, gl_particle_colors);
+	glBufferData(GL_TEXTURE_BUFFER, 3 * num_drawn * sizeof(GLfloat), nullptr, GL_STATIC_DRAW);
+	glBindTexture(GL_TEXTURE_BUFFER, gl_particle_color_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, gl_particle_colors);
+
+	for (int i = 0; i < 2; i++) {
+		glBindBuffer(GL_ARRAY_BUFFER, gl_positions[i]);
+		glBufferData(GL_ARRAY_BUFFER, num_drawn * sizeof(cl_float4), h_particle_data.empty() ? nullptr : h_particle_data.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, gl_particle_ids[i]);
+		glBufferData(GL_ARRAY_BUFFER, num_drawn * sizeof(cl_uint), nullptr, GL_DYNAMIC_DRAW);
+	}
+	particle::gl::print_error(glGetError(), "particle_system::allocate_gl_particles");
+}
+
 void particle_system::init_gl_world() {
 	GLuint vertex_shader = particle::gl::compile_shader("shaders/gl/world.vert", GL_VERTEX_SHADER);
 	GLuint fragment_shader = particle::gl::compile_shader("shaders/gl/world.frag", GL_FRAGMENT_SHADER);
@@ -227,13 +284,13 @@ void particle_system::init_gl_world() {
 	}
 	
 	num_triangles = h_world_positions.size() / 9;
+	h_world_triangles = particle::create_triangle_table(h_world_positions);
 	glGenBuffers(1, &gl_world_positions);
 	glBindBuffer(GL_ARRAY_BUFFER, gl_world_positions);
 	glBufferData(GL_ARRAY_BUFFER, h_world_positions.size() * sizeof(cl_float), h_world_positions.data(), GL_STATIC_DRAW);
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
 
-	GLuint gl_world_normals;
 	glGenBuffers(1, &gl_world_normals);
 	glBindBuffer(GL_ARRAY_BUFFER, gl_world_normals);
 	glBufferData(GL_ARRAY_BUFFER, h_world_normals.size() * sizeof(cl_float), h_world_normals.data(), GL_STATIC_DRAW);
@@ -244,102 +301,425 @@ void particle_system::init_gl_world() {
 }
 
 void particle_system::init_cl() {	
-	particle::cl::build_program(device, context, &cl_particle_simulation_program, "shaders/cl/particle_simulation.cl");
-	particle::cl::build_program(device, context, &cl_bitonic_program, "shaders/cl/bitonic_sort.cl");
-	particle::cl::build_program(device, context, &cl_bvh_program, "shaders/cl/bvh.cl");
-	particle::cl::build_program(device, context, &cl_cull_program, "shaders/cl/cull_lights.cl");
+	if (config.statistics_interval > 0 && !particle::cl::has_extension(device, "cl_khr_int64_base_atomics")) {
+		std::cout << "statistics need 64 bit atomics, the device has no cl_khr_int64_base_atomics" << std::endl;
+		config.statistics_interval = 0;
+	}
+	std::string scene_options = "-D SCENE_SIZE=" + std::to_string(scene_size) + " -D SCENE_BVH_SIZE=" + std::to_string(num_bvh_branch_nodes);
+	std::string simulation_options = scene_options + " -D MAX_CONTACTS=" + std::to_string(config.max_contacts) + " -D MAX_COLORS=" + std::to_string(config.max_colors);
+	if (config.distance_field_colliders) {
+		simulation_options += " -D DISTANCE_FIELD";
+	}
+	if (config.statistics_interval > 0) {
+		simulation_options += " -D STATISTICS -I shaders/cl";
+	}
+	particle::cl::build_program(device, context, &cl_particle_simulation_program, "shaders/cl/particle_simulation.cl", simulation_options);
+	particle::cl::build_program(device, context, &cl_bitonic_program, "shaders/cl/bitonic_sort.cl", scene_options);
+	particle::cl::build_program(device, context, &cl_bvh_program, "shaders/cl/bvh.cl", scene_options);
+
 
+	// the gauss-seidel solver finds its contacts through the bvh of every frame
+	if (config.gauss_seidel_solver && config.neighbor_lists) {
+		std::cout << "the gauss-seidel solver does not run on neighbor lists, building the contacts every frame" << std::endl;
+		config.neighbor_lists = false;
+	}
+	// the render thread draws what the simulation thread hands over, which the other drivers of the simulation do not
+	if (config.threaded && (!config.capture_file.empty() || config.headless || config.num_domains > 1 || config.num_tiles > 1)) {
+		std::cout << "threaded runs need a window and a single device without tiles, running serially" << std::endl;
+		config.threaded = false;
+	}
 
 	cl_int error = CL_SUCCESS;
-	move_kernel = clCreateKernel(cl_particle_simulation_program, "move", nullptr);
-	resolve_collisions_kernel = clCreateKernel(cl_particle_simulation_program, "resolve_collisions", nullptr);
-	bitonic_sort_kernel = clCreateKernel(cl_bitonic_program, "bitonic_sort", nullptr);
-	init_indices_kernel = clCreateKernel(cl_bitonic_program, "init_indices", nullptr);
-	apply_indices_kernel = clCreateKernel(cl_bitonic_program, "apply_indices", nullptr);
-	construct_bvh_kernel = clCreateKernel(cl_bvh_program, "construct_bvh", nullptr);
-	cull_lights_kernel = clCreateKernel(cl_cull_program, "cull_lights", nullptr);
-	calculate_aabb_kernel = clCreateKernel(cl_cull_program, "calculate_aabb", nullptr);
-	
+	move_kernel = clCreateKernel(cl_particle_simulation_program, "move", &error);
+	render_queue = config.threaded ? clCreateCommandQueue(context, device, NULL, &error) : command_queue;
+
+	// the pooled blocks survive a reconfiguration, only the first init_cl creates the memory layer
+	if (!memory) {
+		memory.reset(new device_memory(device, context, command_queue));
+	}
+	if (streams_tiles()) {
+		init_tile_streaming();
+		return;
+	}
 	for (int i = 0; i < 2; i++) {
-		cl_particle_positions[i] = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, gl_positions[i], nullptr);
-		cl_particle_positions_old[i] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, num_particles * sizeof(cl_float4), h_particle_data.data(), nullptr);
-		cl_particle_colors[i] = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, gl_particle_colors[i], nullptr);
+		if (config.threaded) {
+			cl_particle_positions[i] = memory->allocate("particles", num_particles * sizeof(cl_float4), h_particle_data.empty() ? nullptr : h_particle_data.data());
+			cl_particle_ids[i] = memory->allocate("particles", num_particles * sizeof(cl_uint));
+		} else {
+			cl_particle_positions[i] = share_gl_buffer("particles", gl_positions[i], CL_MEM_READ_WRITE, num_particles * sizeof(cl_float4));
+			cl_particle_ids[i] = share_gl_buffer("particles", gl_particle_ids[i], CL_MEM_READ_WRITE, num_particles * sizeof(cl_uint));
+		}
+		cl_particle_positions_old[i] = memory->allocate("particles", num_particles * sizeof(cl_float4), h_particle_data.empty() ? nullptr : h_particle_data.data());
+	}
+	if (config.threaded) {
+		cl_rendered_positions = share_gl_buffer("handoff", gl_positions[0], CL_MEM_READ_WRITE, scene_size * sizeof(cl_float4));
+		cl_rendered_ids = share_gl_buffer("handoff", gl_particle_ids[0], CL_MEM_READ_WRITE, scene_size * sizeof(cl_uint));
+		for (size_t i = 0; i < 3; i++) {
+			simulation_state& state = states.get_slot(i);
+			state.positions = memory->allocate("handoff", scene_size * sizeof(cl_float4));
+			state.ids = memory->allocate("handoff", scene_size * sizeof(cl_uint));
+			state.bvh = memory->allocate("handoff", num_bvh_branch_nodes * sizeof(cl_float4));
+		}
+	}
+	cl_particle_colors = share_gl_buffer("particles", gl_particle_colors, CL_MEM_WRITE_ONLY, 3 * num_particles * sizeof(cl_float));
+	size_t bvh_size = config.num_scenes * num_bvh_branch_nodes * sizeof(cl_float4);
+	cl_bvh = memory->adopt("bvh", clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bvh_size, nullptr, &error), bvh_size);
+	cl_particle_indices = memory->allocate("sort", num_particles * sizeof(cl_uint));
+	cl_active_indices = memory->allocate("solver", num_particles * sizeof(cl_uint));
+	cl_active_counts = memory->allocate("solver", 2 * config.num_scenes * sizeof(cl_uint));
+	if (config.gauss_seidel_solver) {
+		cl_contacts = memory->allocate("solver", config.max_contacts * num_particles * sizeof(cl_uint));
+		cl_contact_counts = memory->allocate("solver", num_particles * sizeof(cl_uint));
+		cl_contact_colors = memory->allocate("solver", num_particles * sizeof(cl_uint));
+	}
+	cl_residuals = memory->allocate("solver", 4 * sizeof(cl_uint));
+	if (config.statistics_interval > 0) {
+		cl_statistics = memory->allocate("statistics", sizeof(particle::cl::statistics));
+		if (config.threaded) {
+			cl_uint zero = 0;
+			cl_render_statistics = memory->allocate("statistics", sizeof(particle::cl::statistics));
+			error |= clEnqueueFillBuffer(command_queue, cl_render_statistics, &zero, sizeof(cl_uint), 0, sizeof(particle::cl::statistics), NULL, nullptr, nullptr);
+		}
+	}
+	if (config.neighbor_lists) {
+		cl_neighbor_references = memory->allocate("neighbors", num_particles * sizeof(cl_float4));
+		cl_neighbor_offsets = memory->allocate("neighbors", num_particles * sizeof(cl_uint));
+		cl_neighbor_counts = memory->allocate("neighbors", num_particles * sizeof(cl_uint));
+		cl_neighbors = memory->allocate("neighbors", config.neighbor_capacity * num_particles * sizeof(cl_uint));
+		cl_neighbor_totals = memory->allocate("neighbors", config.num_scenes * sizeof(cl_uint));
+		cl_displacement = memory->allocate("neighbors", 3 * sizeof(cl_uint));
 	}
-	cl_bvh = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, num_bvh_branch_nodes * sizeof(cl_float4), nullptr, nullptr);
-	cl_particle_indices = clCreateBuffer(context, CL_MEM_READ_WRITE, num_particles * sizeof(cl_uint), nullptr, nullptr);
-	cl_world_positions = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, gl_world_positions, nullptr);
-	cl_world_depths = clCreateFromGLTexture(context, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, gl_position_texture, nullptr);
-	cl_culled_lights = clCreateFromGLTexture(context, CL_MEM_READ_WRITE, GL_TEXTURE_3D, 0, gl_light_texture, nullptr);
-	cl_aabbs = clCreateBuffer(context, CL_MEM_READ_WRITE, 32 * 16 * 2 * sizeof(cl_float3), nullptr, nullptr);
+	cl_world_triangles = memory->allocate("world", h_world_triangles.size() * sizeof(cl_float4), h_world_triangles.data());
+	if (config.distance_field_colliders) {
+		distance_field = particle::cl::get_distance_field(h_world_positions, config.distance_field_cell_size, 2 * config.distance_field_cell_size + 1);
+		cl_uint4 dimensions = distance_field.dimensions;
+		size_t distances_size = static_cast<size_t>(dimensions.s[0]) * dimensions.s[1] * dimensions.s[2] * sizeof(cl_float);
+		cl_world_distances = memory->adopt("world", particle::cl::bake_distance_field(context, command_queue, cl_particle_simulation_program, cl_world_triangles, num_triangles, distance_field), distances_size);
+	}
+	share_gbuffer();
 
 
 	cl_float time_delta_previous = 0;
 	error |= clSetKernelArg(move_kernel, 2, sizeof(cl_uint), &num_particles);
 	error |= clSetKernelArg(move_kernel, 3, sizeof(cl_float), &time_delta_previous);
 
-	error |= clSetKernelArg(init_indices_kernel, 0, sizeof(cl_mem), &cl_particle_indices);
-	error |= clSetKernelArg(init_indices_kernel, 1, sizeof(cl_mem), &num_particles);
-	error |= clSetKernelArg(bitonic_sort_kernel, 1, sizeof(cl_mem), &cl_particle_indices);
-	error |= clSetKernelArg(bitonic_sort_kernel, 2, sizeof(cl_uint), &num_particles);
-	error |= clSetKernelArg(apply_indices_kernel, 0, sizeof(cl_mem), &cl_particle_indices);
-	error |= clSetKernelArg(apply_indices_kernel, 7, sizeof(cl_mem), &num_particles);
-	
-	error |= clSetKernelArg(construct_bvh_kernel, 1, sizeof(cl_mem), &cl_bvh);
 
-	error |= clSetKernelArg(resolve_collisions_kernel, 3, sizeof(cl_mem), &cl_bvh);
-	error |= clSetKernelArg(resolve_collisions_kernel, 4, sizeof(cl_uint), &bvh_levels[1].second);
-	error |= clSetKernelArg(resolve_collisions_kernel, 5, sizeof(cl_mem), &cl_world_positions);
-	error |= clSetKernelArg(resolve_collisions_kernel, 6, sizeof(cl_uint), &num_triangles);
+	particle::cl::print_error(error, "particle_system::init_cl");
 
-	error |= clSetKernelArg(cull_lights_kernel, 1, sizeof(cl_mem), &cl_bvh);
-	error |= clSetKernelArg(cull_lights_kernel, 2, sizeof(cl_uint), &bvh_levels[1].second);
-	error |= clSetKernelArg(cull_lights_kernel, 3, sizeof(cl_mem), &cl_aabbs);
-	error |= clSetKernelArg(cull_lights_kernel, 4, sizeof(cl_mem), &cl_culled_lights);
+	load_local_work_sizes();
+	seed_particles();
+	create_shade_tiles_kernel();
+
+	command_buffers_supported = particle::cl::load_command_buffer_functions(device, &command_buffer_functions);
+	record_frames();
+	if (config.threaded) {
+		// the seeded particles are the first state the render thread shows
+		construct_bvh(render_steps);
+		particle::cl::print_error(particle::cl::enqueue_steps(command_queue, render_steps), "particle_system::init_cl");
+		publish_state();
+		present_latest_state();
+	}
 
-	error |= clSetKernelArg(calculate_aabb_kernel, 0, sizeof(cl_mem), &cl_world_depths);
-	error |= clSetKernelArg(calculate_aabb_kernel, 1, sizeof(cl_mem), &cl_aabbs);
-	particle::cl::print_error(error, "particle_system::init_cl");
+	// the domain decomposition splits a single scene
+	if (config.num_domains > 1 && config.num_scenes == 1) {
+		std::vector<cl_device_id> domain_devices = particle::cl::select_domain_devices(config.device_selection, config.num_domains);
+		if (!domain_devices.empty()) {
+			domains.reset(new domain_decomposition(domain_devices, h_particle_data, h_world_triangles, config.distance_field_colliders ? &distance_field : nullptr, local_work_sizes));
+		}
+	}
+	if (config.report_memory) {
+		memory->print_report();
+		if (domains) {
+			domains->print_memory_report();
+		}
+	}
 }
 
-void particle_system::move_particles() {
+// the tiles are simulated from pinned host memory, the device only keeps the particles that are drawn and the bvh shade_tiles traces over them
+void particle_system::init_tile_streaming() {
+	cl_particle_positions[0] = share_gl_buffer("particles", gl_positions[0], CL_MEM_READ_WRITE, scene_size * sizeof(cl_float4));
+	cl_particle_ids[0] = share_gl_buffer("particles", gl_particle_ids[0], CL_MEM_READ_WRITE, scene_size * sizeof(cl_uint));
+	cl_particle_colors = share_gl_buffer("particles", gl_particle_colors, CL_MEM_WRITE_ONLY, 3 * scene_size * sizeof(cl_float));
+	cl_bvh = memory->allocate("bvh", num_bvh_branch_nodes * sizeof(cl_float4));
+	if (config.distance_field_colliders) {
+		distance_field = particle::cl::get_distance_field(h_world_positions, config.distance_field_cell_size, 2 * config.distance_field_cell_size + 1);
+	}
+	share_gbuffer();
+
+	load_local_work_sizes();
+	seed_particles();
+	create_shade_tiles_kernel();
+
+	tiles.reset(new tile_streaming(device, config.num_tiles, std::move(h_particle_data), h_world_triangles, config.distance_field_colliders ? &distance_field : nullptr, local_work_sizes));
+	h_particle_data.clear();
+	upload_gathered();
+	if (config.report_memory) {
+		memory->print_report();
+		tiles->print_memory_report();
+	}
+}
+
+// everything init_cl creates, the pooled device memory stays for the next init_cl
+void particle_system::release_cl() {
+	unmap_views();
+	clFinish(command_queue);
+	domains.reset();
+	tiles.reset();
+	release_frames();
+	for (particle::cl::kernel_step& step : render_steps) {
+		clReleaseKernel(step.kernel);
+	}
+	render_steps.clear();
+	for (cl_kernel* kernel : {&move_kernel, &shade_tiles_kernel, &physics_metrics_kernel, &export_velocities_kernel}) {
+		if (*kernel != nullptr) {
+			clReleaseKernel(*kernel);
+			*kernel = nullptr;
+		}
+	}
+	for (cl_program program : {cl_particle_simulation_program, cl_bitonic_program, cl_bvh_program, cl_shade_program}) {
+		clReleaseProgram(program);
+	}
+
+	if (render_queue != command_queue) {
+		clReleaseCommandQueue(render_queue);
+		render_queue = command_queue;
+	}
+
+	memory->release_all();
+	gl_mirrors.clear();
+	gl_objects.clear();
+	// the optional buffers are told apart by being null
+	for (cl_mem* buffer : {&cl_contacts, &cl_contact_counts, &cl_contact_colors, &cl_neighbor_references, &cl_neighbor_offsets, &cl_neighbor_counts, &cl_neighbors, &cl_neighbor_totals, &cl_displacement, &cl_statistics, &cl_render_statistics, &cl_metric_sums, &cl_max_penetration, &cl_world_distances, &cl_rendered_positions, &cl_rendered_ids}) {
+		*buffer = nullptr;
+	}
+	std::fill_n(cl_view_buffers, NUM_VIEW_BUFFERS, nullptr);
+}
+
+void particle_system::share_gbuffer() {
+	cl_gbuffer_depths = share_gl_texture("gbuffer", gl_depth_texture, CL_MEM_READ_ONLY, {CL_R, CL_FLOAT}, GL_DEPTH_COMPONENT, GL_FLOAT);
+	cl_gbuffer_normals = share_gl_texture("gbuffer", gl_normal_texture, CL_MEM_READ_ONLY, {CL_RG, CL_HALF_FLOAT}, GL_RG, GL_HALF_FLOAT);
+	cl_shaded_colors = share_gl_texture("gbuffer", gl_color_texture, CL_MEM_WRITE_ONLY, {CL_RGBA, CL_UNORM_INT8}, GL_RGBA, GL_UNSIGNED_BYTE);
+}
+
+void particle_system::seed_particles() {
+	cl_program seed_program;
+	particle::cl::build_program(device, context, &seed_program, "shaders/cl/seed_particles.cl");
 	cl_int error = CL_SUCCESS;
-	cl_float current_time = glfwGetTime();
+	cl_int kernel_error = CL_SUCCESS;
+	cl_kernel init_indices_kernel = clCreateKernel(cl_bitonic_program, "init_indices", &kernel_error);
+	error |= kernel_error;
+	cl_kernel seed_colors_kernel = clCreateKernel(seed_program, "seed_colors", &kernel_error);
+	error |= kernel_error;
+	cl_kernel seed_particles_kernel = clCreateKernel(seed_program, "seed_particles", &kernel_error);
+	error |= kernel_error;
+	cl_uint2 seed = {{static_cast<cl_uint>(seed_distribution.seed), static_cast<cl_uint>(seed_distribution.seed >> 32)}};
+
+	// a tiled scene is seeded on the host and handed to its tiles, the device only colors the particles it draws
+	bool stream_tiles = streams_tiles();
+	cl_uint num_seeded = stream_tiles ? scene_size : num_particles;
+	if (stream_tiles && h_particle_data.empty()) {
+		h_particle_data = particle::seed_particles(seed_distribution, num_particles);
+	}
+	auto enqueue = [&](cl_kernel kernel, const char* kernel_name) {
+		size_t local_work_size = std::min<size_t>(local_work_sizes.at(kernel_name), num_seeded);
+		size_t global_work_size = particle::cl::get_global_work_size(num_seeded, local_work_size);
+		return clEnqueueNDRangeKernel(command_queue, kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	};
+
+	glFinish();
+	std::vector<cl_mem> cl_mem_objects = {cl_particle_colors};
+	if (!stream_tiles) {
+		cl_mem_objects.insert(cl_mem_objects.end(), {cl_particle_positions[0], cl_particle_ids[0], cl_particle_ids[1]});
+	}
+	error |= acquire_gl_objects(command_queue, cl_mem_objects);
+	for (int i = 0; i < (stream_tiles ? 0 : 2); i++) {
+		error |= clSetKernelArg(init_indices_kernel, 0, sizeof(cl_mem), &cl_particle_ids[i]);
+		error |= clSetKernelArg(init_indices_kernel, 1, sizeof(cl_uint), &num_particles);
+		error |= enqueue(init_indices_kernel, "init_indices");
+	}
+	error |= clSetKernelArg(seed_colors_kernel, 0, sizeof(cl_mem), &cl_particle_colors);
+	error |= clSetKernelArg(seed_colors_kernel, 1, sizeof(cl_uint), &num_seeded);
+	error |= clSetKernelArg(seed_colors_kernel, 2, sizeof(cl_uint2), &seed);
+	error |= enqueue(seed_colors_kernel, "seed_colors");
+
+	if (h_particle_data.empty()) {
+		error |= clSetKernelArg(seed_particles_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+		error |= clSetKernelArg(seed_particles_kernel, 1, sizeof(cl_mem), &cl_particle_positions_old[0]);
+		error |= clSetKernelArg(seed_particles_kernel, 2, sizeof(cl_uint), &num_particles);
+		error |= clSetKernelArg(seed_particles_kernel, 3, sizeof(cl_uint2), &seed);
+		error |= clSetKernelArg(seed_particles_kernel, 4, sizeof(cl_float4), &seed_distribution.box_min);
+		error |= clSetKernelArg(seed_particles_kernel, 5, sizeof(cl_float4), &seed_distribution.box_max);
+		error |= enqueue(seed_particles_kernel, "seed_particles");
+
+		// the domain decomposition distributes the particles from the host
+		if (config.num_domains > 1 || config.report_scaling) {
+			h_particle_data.resize(4 * num_particles);
+			error |= clEnqueueReadBuffer(command_queue, cl_particle_positions[0], CL_FALSE, 0, num_particles * sizeof(cl_float4), h_particle_data.data(), NULL, nullptr, nullptr);
+		}
+	}
+	error |= release_gl_objects(command_queue, cl_mem_objects);
+	clFinish(command_queue);
+
+	clReleaseKernel(init_indices_kernel);
+	clReleaseKernel(seed_colors_kernel);
+	clReleaseKernel(seed_particles_kernel);
+	clReleaseProgram(seed_program);
+	particle::cl::print_error(error, "particle_system::seed_particles");
+}
+
+cl_mem particle_system::share_gl_buffer(std::string subsystem, GLuint gl_buffer, cl_mem_flags flags, size_t size) {
+	cl_int error = CL_SUCCESS;
+	cl_mem buffer;
+	if (gl_sharing) {
+		buffer = clCreateFromGLBuffer(context, flags, gl_buffer, &error);
+	} else {
+		std::vector<char> data(size);
+		glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, size, data.data());
+		buffer = clCreateBuffer(context, flags | CL_MEM_COPY_HOST_PTR, size, data.data(), &error);
+		gl_mirrors[buffer] = {gl_buffer, GL_ARRAY_BUFFER, GL_NONE, GL_NONE, size, false, (flags & CL_MEM_READ_ONLY) == 0};
+	}
+	particle::cl::print_error(error, "particle_system::share_gl_buffer");
+	gl_objects.insert(buffer);
+	return memory->adopt(subsystem, buffer, size);
+}
+
+cl_mem particle_system::share_gl_texture(std::string subsystem, GLuint gl_texture, cl_mem_flags flags, cl_image_format format, GLenum gl_format, GLenum gl_type) {
+	cl_int error = CL_SUCCESS;
+	cl_mem image;
+	if (gl_sharing) {
+		image = clCreateFromGLTexture(context, flags, GL_TEXTURE_2D, 0, gl_texture, &error);
+	} else {
+		cl_image_desc description = {CL_MEM_OBJECT_IMAGE2D, width, height, 1, 1, 0, 0, 0, 0, nullptr};
+		image = clCreateImage(context, flags, &format, &description, nullptr, &error);
+		gl_mirrors[image] = {gl_texture, GL_TEXTURE_2D, gl_format, gl_type, width * height * sizeof(cl_float), (flags & CL_MEM_WRITE_ONLY) == 0, (flags & CL_MEM_READ_ONLY) == 0};
+	}
+	particle::cl::print_error(error, "particle_system::share_gl_texture");
+	gl_objects.insert(image);
+	return memory->adopt(subsystem, image, width * height * sizeof(cl_float));
+}
+
+cl_int particle_system::acquire_gl_objects(cl_command_queue queue, const std::vector<cl_mem>& cl_mem_objects) {
+	if (gl_sharing) {
+		std::vector<cl_mem> shared_objects;
+		std::copy_if(cl_mem_objects.begin(), cl_mem_objects.end(), std::back_inserter(shared_objects), [&](cl_mem object) { return gl_objects.count(object) > 0; });
+		if (shared_objects.empty()) return CL_SUCCESS;
+		return clEnqueueAcquireGLObjects(queue, shared_objects.size(), shared_objects.data(), NULL, nullptr, nullptr);
+	}
+
+	cl_int error = CL_SUCCESS;
+	for (cl_mem cl_mem_object : cl_mem_objects) {
+		auto mirror = gl_mirrors.find(cl_mem_object);
+		if (mirror == gl_mirrors.end() || !mirror->second.to_cl) continue;
+		std::vector<char> data(mirror->second.size);
+		if (mirror->second.target == GL_TEXTURE_2D) {
+			size_t origin[3] = {0, 0, 0};
+			size_t region[3] = {width, height, 1};
+			glBindTexture(GL_TEXTURE_2D, mirror->second.gl_object);
+			glGetTexImage(GL_TEXTURE_2D, 0, mirror->second.gl_format, mirror->second.gl_type, data.data());
+			error |= clEnqueueWriteImage(queue, cl_mem_object, CL_TRUE, origin, region, 0, 0, data.data(), NULL, nullptr, nullptr);
+		} else {
+			glBindBuffer(mirror->second.target, mirror->second.gl_object);
+			glGetBufferSubData(mirror->second.target, 0, data.size(), data.data());
+			error |= clEnqueueWriteBuffer(queue, cl_mem_object, CL_TRUE, 0, data.size(), data.data(), NULL, nullptr, nullptr);
+		}
+	}
+	return error;
+}
+
+cl_int particle_system::release_gl_objects(cl_command_queue queue, const std::vector<cl_mem>& cl_mem_objects) {
+	if (gl_sharing) {
+		std::vector<cl_mem> shared_objects;
+		std::copy_if(cl_mem_objects.begin(), cl_mem_objects.end(), std::back_inserter(shared_objects), [&](cl_mem object) { return gl_objects.count(object) > 0; });
+		if (shared_objects.empty()) return CL_SUCCESS;
+		return clEnqueueReleaseGLObjects(queue, shared_objects.size(), shared_objects.data(), NULL, nullptr, nullptr);
+	}
+
+	cl_int error = CL_SUCCESS;
+	for (cl_mem cl_mem_object : cl_mem_objects) {
+		auto mirror = gl_mirrors.find(cl_mem_object);
+		if (mirror == gl_mirrors.end() || !mirror->second.to_gl) continue;
+		std::vector<char> data(mirror->second.size);
+		if (mirror->second.target == GL_TEXTURE_2D) {
+			size_t origin[3] = {0, 0, 0};
+			size_t region[3] = {width, height, 1};
+			error |= clEnqueueReadImage(queue, cl_mem_object, CL_TRUE, origin, region, 0, 0, data.data(), NULL, nullptr, nullptr);
+			glBindTexture(GL_TEXTURE_2D, mirror->second.gl_object);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, mirror->second.gl_format, mirror->second.gl_type, data.data());
+		} else {
+			error |= clEnqueueReadBuffer(queue, cl_mem_object, CL_TRUE, 0, data.size(), data.data(), NULL, nullptr, nullptr);
+			glBindBuffer(mirror->second.target, mirror->second.gl_object);
+			glBufferSubData(mirror->second.target, 0, data.size(), data.data());
+		}
+	}
+	return error;
+}
+
+// offscreen runs have no glfw to ask
+double particle_system::get_time() const {
+	if (window == nullptr) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	return glfwGetTime();
+}
+
+cl_float particle_system::advance_time() {
+	if (config.fixed_time_delta > 0) {
+		return config.fixed_time_delta;
+	}
+	cl_float current_time = get_time();
 	cl_float time_delta = current_time - time;
 	time = current_time;
+	return time_delta;
+}
+
+void particle_system::move_particles() {
+	cl_int error = CL_SUCCESS;
+	cl_float time_delta = advance_time();
 	error |= clSetKernelArg(move_kernel, 0, sizeof(cl_mem), &cl_particle_positions_old[0]);
 	error |= clSetKernelArg(move_kernel, 1, sizeof(cl_mem), &cl_particle_positions[0]);
 	error |= clSetKernelArg(move_kernel, 4, sizeof(cl_float), &time_delta);
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("move"), num_particles);
+	size_t global_work_size = particle::cl::get_global_work_size(num_particles, local_work_size);
 	error |= clEnqueueNDRangeKernel(command_queue, move_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
 	error |= clSetKernelArg(move_kernel, 3, sizeof(cl_float), &time_delta);
+	last_time_delta = time_delta;
 	particle::cl::print_error(error, "particle_system::move_particles");
 }
 
-void particle_system::sort_particles() {
+cl_kernel particle_system::record_step(std::vector<particle::cl::kernel_step>& steps, cl_program program, const char* kernel_name, size_t work_items) {
 	cl_int error = CL_SUCCESS;
-	error |= clEnqueueNDRangeKernel(command_queue, init_indices_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
-	
-//	clEnqueueReadBuffer(command_queue, cl_particle_positions_old[0], true, 0, h_particle_data.size() * sizeof(cl_float), h_particle_data.data(), NULL, nullptr, nullptr);
-//	for (int i = 0; i < h_particle_data.size() && i < 4 * 20; i += 4) {
-//		std::cout << h_particle_data[i] << ' ' << h_particle_data[i + 1] << ' ' << h_particle_data[i + 2] << ' ' << h_particle_data[i + 3] << std::endl;
-//	} std::cout << std::endl;
+	cl_kernel kernel = clCreateKernel(program, kernel_name, &error);
+	particle::cl::print_error(error, "particle_system::record_step");
+	size_t local_work_size = std::min(local_work_sizes.at(kernel_name), work_items);
+	steps.push_back({kernel, particle::cl::get_global_work_size(work_items, local_work_size), local_work_size, config.num_scenes});
+	return kernel;
+}
 
-	{
-		error |= clSetKernelArg(bitonic_sort_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
-		int num_work_items = pow(2, ceil(log(num_particles) / log(2)));
-		size_t global_work_size = particle::cl::get_global_work_size(num_work_items / 2, local_work_size);
-		int iterations = ceil(log(num_particles) / log(2));
-		int direction = 0;
+void particle_system::sort_particles(std::vector<particle::cl::kernel_step>& steps, bool keep_order) {
+	cl_int error = CL_SUCCESS;
+	cl_kernel init_indices_kernel = record_step(steps, cl_bitonic_program, "init_indices", scene_size);
+	error |= clSetKernelArg(init_indices_kernel, 0, sizeof(cl_mem), &cl_particle_indices);
+	error |= clSetKernelArg(init_indices_kernel, 1, sizeof(cl_uint), &scene_size);
+
+	// without sorting the identity permutation still moves every ping-pong pair to its other buffer
+	if (!keep_order) {
+		int num_work_items = pow(2, ceil(log(scene_size) / log(2)));
+		int iterations = ceil(log(scene_size) / log(2));
+		cl_uint direction = 0;
 
 		while (iterations > 1) {
-			error |= clSetKernelArg(bitonic_sort_kernel, 5, sizeof(cl_uint), &direction);
 			for (int i = 0; i < iterations; i++) {
 				for (int j = 0; j <= i; j++) {
 					cl_uint stride = pow(2, i - j);
 					cl_uint merge = j == 0 ? 1 : 0;
+					cl_kernel bitonic_sort_kernel = record_step(steps, cl_bitonic_program, "bitonic_sort", num_work_items / 2);
+					error |= clSetKernelArg(bitonic_sort_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+					error |= clSetKernelArg(bitonic_sort_kernel, 1, sizeof(cl_mem), &cl_particle_indices);
+					error |= clSetKernelArg(bitonic_sort_kernel, 2, sizeof(cl_uint), &scene_size);
 					error |= clSetKernelArg(bitonic_sort_kernel, 3, sizeof(cl_uint), &stride);
 					error |= clSetKernelArg(bitonic_sort_kernel, 4, sizeof(cl_uint), &merge);
-					error |= clEnqueueNDRangeKernel(command_queue, bitonic_sort_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
-
+					error |= clSetKernelArg(bitonic_sort_kernel, 5, sizeof(cl_uint), &direction);
 				}
 			}
 			iterations--;
@@ -347,105 +727,653 @@ void particle_system::sort_particles() {
 		}
 	}
 
+	cl_kernel apply_indices_kernel = record_step(steps, cl_bitonic_program, "apply_indices", scene_size);
+	error |= clSetKernelArg(apply_indices_kernel, 0, sizeof(cl_mem), &cl_particle_indices);
 	error |= clSetKernelArg(apply_indices_kernel, 1, sizeof(cl_mem), &cl_particle_positions[0]);
 	error |= clSetKernelArg(apply_indices_kernel, 2, sizeof(cl_mem), &cl_particle_positions[1]);
 	error |= clSetKernelArg(apply_indices_kernel, 3, sizeof(cl_mem), &cl_particle_positions_old[0]);
 	error |= clSetKernelArg(apply_indices_kernel, 4, sizeof(cl_mem), &cl_particle_positions_old[1]);
-	error |= clSetKernelArg(apply_indices_kernel, 5, sizeof(cl_mem), &cl_particle_colors[0]);
-	error |= clSetKernelArg(apply_indices_kernel, 6, sizeof(cl_mem), &cl_particle_colors[1]);
-	error |= clEnqueueNDRangeKernel(command_queue, apply_indices_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	error |= clSetKernelArg(apply_indices_kernel, 5, sizeof(cl_mem), &cl_particle_ids[0]);
+	error |= clSetKernelArg(apply_indices_kernel, 6, sizeof(cl_mem), &cl_particle_ids[1]);
+	error |= clSetKernelArg(apply_indices_kernel, 7, sizeof(cl_uint), &scene_size);
 	std::swap(cl_particle_positions[0], cl_particle_positions[1]);
 	std::swap(cl_particle_positions_old[0], cl_particle_positions_old[1]);
-	std::swap(cl_particle_colors[0], cl_particle_colors[1]);
+	std::swap(cl_particle_ids[0], cl_particle_ids[1]);
 
 	std::swap(gl_particle_vao[0], gl_particle_vao[1]);
 	particle::cl::print_error(error, "particle_system::sort_particles");
-
-//	clEnqueueReadBuffer(command_queue, cl_particle_positions_old[0], true, 0, h_particle_data.size() * sizeof(cl_float), h_particle_data.data(), NULL, nullptr, nullptr);
-//	for (int i = 0; i < h_particle_data.size() && i < 4 * 20; i += 4) {
-//		std::cout << h_particle_data[i] << ' ' << h_particle_data[i + 1] << ' ' << h_particle_data[i + 2] << ' ' << h_particle_data[i + 3] << std::endl;
-//	} std::cout << std::endl;
 }
 
-void particle_system::construct_bvh() {
+void particle_system::construct_bvh(std::vector<particle::cl::kernel_step>& steps) {
 	cl_int error = CL_SUCCESS;
-	error |= clSetKernelArg(construct_bvh_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
-	size_t gws = pow(2, ceil(log(num_particles) / log(2)) - 1);
-	size_t lws = std::min(gws, local_work_size);
+	size_t gws = pow(2, ceil(log(scene_size) / log(2)) - 1);
 	for (size_t i = 0; i < bvh_levels.size() - 1; i++) {
+		cl_kernel construct_bvh_kernel = record_step(steps, cl_bvh_program, "construct_bvh", gws);
+		error |= clSetKernelArg(construct_bvh_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+		error |= clSetKernelArg(construct_bvh_kernel, 1, sizeof(cl_mem), &cl_bvh);
 		error |= clSetKernelArg(construct_bvh_kernel, 2, sizeof(cl_uint), &bvh_levels[i].first);
 		error |= clSetKernelArg(construct_bvh_kernel, 3, sizeof(cl_uint), &bvh_levels[i].second);
 		error |= clSetKernelArg(construct_bvh_kernel, 4, sizeof(cl_uint), &bvh_levels[i + 1].first);
-		error |= clEnqueueNDRangeKernel(command_queue, construct_bvh_kernel, 1, nullptr, &gws, &lws, NULL, nullptr, nullptr);
-		gws /= 2;
+		gws = std::max<size_t>(gws / 2, 1);
 	}
-
-//	std::vector<float> temp(4 * num_bvh_branch_nodes);	
-//	error |= clEnqueueReadBuffer(command_queue, cl_bvh, true, 0, temp.size() * sizeof(cl_float), temp.data(), NULL, nullptr, nullptr);
-//	for (int i = 0; i < 4 * num_bvh_branch_nodes && i < 4 * 20; i += 4) {
-//		std::cout << temp[i] << ' ' << temp[i + 1] << ' ' << temp[i + 2] << ' ' << temp[i + 3] << std::endl;
-//	} std::cout << std::endl;
-
 	particle::cl::print_error(error, "particle_system::construct_bvh");
 }
 
-void particle_system::resolve_particle_collisions() {
+void particle_system::resolve_particle_collisions(std::vector<particle::cl::kernel_step>& steps, cl_uint parity, bool rebuild_neighbor_lists) {
+	cl_int error = CL_SUCCESS;
+	// resolve_collisions is dispatched over every particle but only the awake ones listed here do any work
+	cl_kernel compact_active_kernel = record_step(steps, cl_particle_simulation_program, "compact_active", scene_size);
+	error |= clSetKernelArg(compact_active_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+	error |= clSetKernelArg(compact_active_kernel, 1, sizeof(cl_mem), &cl_particle_positions[1]);
+	error |= clSetKernelArg(compact_active_kernel, 2, sizeof(cl_mem), &cl_particle_positions_old[0]);
+	error |= clSetKernelArg(compact_active_kernel, 3, sizeof(cl_mem), &cl_active_indices);
+	error |= clSetKernelArg(compact_active_kernel, 4, sizeof(cl_mem), &cl_active_counts);
+	error |= clSetKernelArg(compact_active_kernel, 5, sizeof(cl_uint), &parity);
+	error |= clSetKernelArg(compact_active_kernel, 6, sizeof(cl_uint), &scene_size);
+
+	if (config.gauss_seidel_solver) {
+		sweep_particle_collisions(steps, parity);
+	} else if (config.neighbor_lists) {
+		resolve_neighbor_collisions(steps, parity, rebuild_neighbor_lists);
+	} else {
+		for (int i = 0; i < 10; i++) {
+			cl_kernel resolve_collisions_kernel = record_step(steps, cl_particle_simulation_program, "resolve_collisions", scene_size);
+			error |= clSetKernelArg(resolve_collisions_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 1, sizeof(cl_mem), &cl_particle_positions[1]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 2, sizeof(cl_mem), &cl_particle_positions_old[0]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 3, sizeof(cl_mem), &cl_bvh);
+			error |= clSetKernelArg(resolve_collisions_kernel, 4, sizeof(cl_uint), &bvh_levels[1].second);
+			error |= clSetKernelArg(resolve_collisions_kernel, 5, sizeof(cl_mem), &cl_world_triangles);
+			error |= clSetKernelArg(resolve_collisions_kernel, 6, sizeof(cl_uint), &num_triangles);
+			error |= clSetKernelArg(resolve_collisions_kernel, 7, sizeof(cl_mem), &cl_active_indices);
+			error |= clSetKernelArg(resolve_collisions_kernel, 8, sizeof(cl_mem), &cl_active_counts);
+			error |= clSetKernelArg(resolve_collisions_kernel, 9, sizeof(cl_uint), &parity);
+			error |= set_world_collider_args(resolve_collisions_kernel, 10);
+			error |= set_statistics_arg(resolve_collisions_kernel);
+			std::swap(cl_particle_positions[0], cl_particle_positions[1]);
+			std::swap(gl_positions[0], gl_positions[1]);
+		}
+	}
+	if (config.report_residual) {
+		measure_residual(steps, parity);
+	}
+	
+	particle::cl::print_error(error, "particle_system::resolve_particle_collisions");
+}
+
+void particle_system::resolve_neighbor_collisions(std::vector<particle::cl::kernel_step>& steps, cl_uint parity, bool rebuild_neighbor_lists) {
 	cl_int error = CL_SUCCESS;
-	error |= clSetKernelArg(resolve_collisions_kernel, 2, sizeof(cl_mem), &cl_particle_positions_old[0]);
+	if (rebuild_neighbor_lists) {
+		cl_kernel build_kernel = record_step(steps, cl_particle_simulation_program, "build_neighbor_lists", scene_size);
+		error |= clSetKernelArg(build_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+		error |= clSetKernelArg(build_kernel, 1, sizeof(cl_mem), &cl_bvh);
+		error |= clSetKernelArg(build_kernel, 2, sizeof(cl_uint), &bvh_levels[1].second);
+		error |= clSetKernelArg(build_kernel, 3, sizeof(cl_mem), &cl_neighbor_references);
+		error |= clSetKernelArg(build_kernel, 4, sizeof(cl_mem), &cl_neighbor_offsets);
+		error |= clSetKernelArg(build_kernel, 5, sizeof(cl_mem), &cl_neighbor_counts);
+		error |= clSetKernelArg(build_kernel, 6, sizeof(cl_mem), &cl_neighbors);
+		error |= clSetKernelArg(build_kernel, 7, sizeof(cl_mem), &cl_neighbor_totals);
+		error |= clSetKernelArg(build_kernel, 8, sizeof(cl_mem), &cl_displacement);
+		error |= clSetKernelArg(build_kernel, 9, sizeof(cl_float), &config.neighbor_skin);
+		error |= clSetKernelArg(build_kernel, 10, sizeof(cl_uint), &scene_size);
+		error |= clSetKernelArg(build_kernel, 11, sizeof(cl_uint), &config.neighbor_capacity);
+		error |= set_statistics_arg(build_kernel);
+	}
+
 	for (int i = 0; i < 10; i++) {
-		error |= clSetKernelArg(resolve_collisions_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
-		error |= clSetKernelArg(resolve_collisions_kernel, 1, sizeof(cl_mem), &cl_particle_positions[1]);
-		error |= clEnqueueNDRangeKernel(command_queue, resolve_collisions_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+		cl_kernel resolve_neighbors_kernel = record_step(steps, cl_particle_simulation_program, "resolve_neighbors", scene_size);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 1, sizeof(cl_mem), &cl_particle_positions[1]);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 2, sizeof(cl_mem), &cl_particle_positions_old[0]);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 3, sizeof(cl_mem), &cl_neighbor_offsets);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 4, sizeof(cl_mem), &cl_neighbor_counts);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 5, sizeof(cl_mem), &cl_neighbors);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 6, sizeof(cl_uint), &config.neighbor_capacity);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 7, sizeof(cl_mem), &cl_world_triangles);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 8, sizeof(cl_uint), &num_triangles);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 9, sizeof(cl_mem), &cl_active_indices);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 10, sizeof(cl_mem), &cl_active_counts);
+		error |= clSetKernelArg(resolve_neighbors_kernel, 11, sizeof(cl_uint), &parity);
+		error |= set_world_collider_args(resolve_neighbors_kernel, 12);
+		error |= set_statistics_arg(resolve_neighbors_kernel);
 		std::swap(cl_particle_positions[0], cl_particle_positions[1]);
 		std::swap(gl_positions[0], gl_positions[1]);
 	}
-	
-	particle::cl::print_error(error, "particle_system::resolve_particle_collisions");
+
+	cl_kernel max_displacement_kernel = record_step(steps, cl_particle_simulation_program, "max_displacement", scene_size);
+	error |= clSetKernelArg(max_displacement_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+	error |= clSetKernelArg(max_displacement_kernel, 1, sizeof(cl_mem), &cl_particle_positions_old[0]);
+	error |= clSetKernelArg(max_displacement_kernel, 2, sizeof(cl_mem), &cl_neighbor_references);
+	error |= clSetKernelArg(max_displacement_kernel, 3, sizeof(cl_mem), &cl_displacement);
+	error |= clSetKernelArg(max_displacement_kernel, 4, sizeof(cl_mem), &cl_neighbor_totals);
+	error |= clSetKernelArg(max_displacement_kernel, 5, sizeof(cl_uint), &scene_size);
+	particle::cl::print_error(error, "particle_system::resolve_neighbor_collisions");
+}
+
+void particle_system::sweep_particle_collisions(std::vector<particle::cl::kernel_step>& steps, cl_uint parity) {
+	cl_int error = CL_SUCCESS;
+	cl_kernel build_contacts_kernel = record_step(steps, cl_particle_simulation_program, "build_contacts", scene_size);
+	error |= clSetKernelArg(build_contacts_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+	error |= clSetKernelArg(build_contacts_kernel, 1, sizeof(cl_mem), &cl_bvh);
+	error |= clSetKernelArg(build_contacts_kernel, 2, sizeof(cl_uint), &bvh_levels[1].second);
+	error |= clSetKernelArg(build_contacts_kernel, 3, sizeof(cl_mem), &cl_contacts);
+	error |= clSetKernelArg(build_contacts_kernel, 4, sizeof(cl_mem), &cl_contact_counts);
+	error |= clSetKernelArg(build_contacts_kernel, 5, sizeof(cl_mem), &cl_contact_colors);
+	error |= clSetKernelArg(build_contacts_kernel, 6, sizeof(cl_mem), &cl_active_indices);
+	error |= clSetKernelArg(build_contacts_kernel, 7, sizeof(cl_mem), &cl_active_counts);
+	error |= clSetKernelArg(build_contacts_kernel, 8, sizeof(cl_uint), &parity);
+	error |= set_statistics_arg(build_contacts_kernel);
+
+	// the number of colors is only known on the device, so there are as many coloring rounds and sweeps as there may be colors
+	for (cl_uint round = 0; round < config.max_colors; round++) {
+		cl_kernel color_contacts_kernel = record_step(steps, cl_particle_simulation_program, "color_contacts", scene_size);
+		error |= clSetKernelArg(color_contacts_kernel, 0, sizeof(cl_mem), &cl_contacts);
+		error |= clSetKernelArg(color_contacts_kernel, 1, sizeof(cl_mem), &cl_contact_counts);
+		error |= clSetKernelArg(color_contacts_kernel, 2, sizeof(cl_mem), &cl_contact_colors);
+		error |= clSetKernelArg(color_contacts_kernel, 3, sizeof(cl_mem), &cl_particle_positions_old[0]);
+		error |= clSetKernelArg(color_contacts_kernel, 4, sizeof(cl_mem), &cl_active_indices);
+		error |= clSetKernelArg(color_contacts_kernel, 5, sizeof(cl_mem), &cl_active_counts);
+		error |= clSetKernelArg(color_contacts_kernel, 6, sizeof(cl_uint), &parity);
+	}
+
+	// a frame swaps the positions an odd number of times, an odd number of leftover sweeps is evened out by a sweep that only copies
+	cl_uint last_color = config.max_colors + config.solver_iterations % 2;
+	for (cl_uint i = 0; i < config.solver_iterations; i++) {
+		// the last color collects the particles left uncolored
+		for (cl_uint color = 0; color <= (i + 1 == config.solver_iterations ? last_color : config.max_colors); color++) {
+			// the leftovers are not independent and go through both buffers like the jacobi iterations
+			bool leftovers = color >= config.max_colors;
+			cl_kernel sweep_kernel = record_step(steps, cl_particle_simulation_program, "gauss_seidel_sweep", scene_size);
+			error |= clSetKernelArg(sweep_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+			error |= clSetKernelArg(sweep_kernel, 1, sizeof(cl_mem), &cl_particle_positions[leftovers ? 1 : 0]);
+			error |= clSetKernelArg(sweep_kernel, 2, sizeof(cl_mem), &cl_particle_positions_old[0]);
+			error |= clSetKernelArg(sweep_kernel, 3, sizeof(cl_mem), &cl_contacts);
+			error |= clSetKernelArg(sweep_kernel, 4, sizeof(cl_mem), &cl_contact_counts);
+			error |= clSetKernelArg(sweep_kernel, 5, sizeof(cl_mem), &cl_contact_colors);
+			error |= clSetKernelArg(sweep_kernel, 6, sizeof(cl_uint), &color);
+			error |= clSetKernelArg(sweep_kernel, 7, sizeof(cl_mem), &cl_world_triangles);
+			error |= clSetKernelArg(sweep_kernel, 8, sizeof(cl_uint), &num_triangles);
+			error |= clSetKernelArg(sweep_kernel, 9, sizeof(cl_mem), &cl_active_indices);
+			error |= clSetKernelArg(sweep_kernel, 10, sizeof(cl_mem), &cl_active_counts);
+			error |= clSetKernelArg(sweep_kernel, 11, sizeof(cl_uint), &parity);
+			error |= set_world_collider_args(sweep_kernel, 12);
+			if (leftovers) {
+				std::swap(cl_particle_positions[0], cl_particle_positions[1]);
+				std::swap(gl_positions[0], gl_positions[1]);
+			}
+		}
+	}
+	particle::cl::print_error(error, "particle_system::sweep_particle_collisions");
+}
+
+void particle_system::measure_residual(std::vector<particle::cl::kernel_step>& steps, cl_uint parity) {
+	cl_int error = CL_SUCCESS;
+	cl_kernel contact_residual_kernel = record_step(steps, cl_particle_simulation_program, "contact_residual", scene_size);
+	error |= clSetKernelArg(contact_residual_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+	error |= clSetKernelArg(contact_residual_kernel, 1, sizeof(cl_mem), &cl_particle_positions_old[0]);
+	error |= clSetKernelArg(contact_residual_kernel, 2, sizeof(cl_mem), &cl_bvh);
+	error |= clSetKernelArg(contact_residual_kernel, 3, sizeof(cl_uint), &bvh_levels[1].second);
+	error |= clSetKernelArg(contact_residual_kernel, 4, sizeof(cl_mem), &cl_active_indices);
+	error |= clSetKernelArg(contact_residual_kernel, 5, sizeof(cl_mem), &cl_active_counts);
+	error |= clSetKernelArg(contact_residual_kernel, 6, sizeof(cl_uint), &parity);
+	error |= clSetKernelArg(contact_residual_kernel, 7, sizeof(cl_mem), &cl_residuals);
+	particle::cl::print_error(error, "particle_system::measure_residual");
+}
+
+// kernels built with STATISTICS take the counters as their last argument
+// the simulation counters unless others are given
+cl_int particle_system::set_statistics_arg(cl_kernel kernel, cl_mem statistics) {
+	if (cl_statistics == nullptr) return CL_SUCCESS;
+	if (statistics == nullptr) {
+		statistics = cl_statistics;
+	}
+	cl_uint num_args;
+	cl_int error = clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &num_args, nullptr);
+	error |= clSetKernelArg(kernel, num_args - 1, sizeof(cl_mem), &statistics);
+	return error;
+}
+
+cl_int particle_system::set_world_collider_args(cl_kernel kernel, cl_uint first_index) {
+	cl_int error = CL_SUCCESS;
+	if (cl_world_distances != nullptr) {
+		error |= clSetKernelArg(kernel, first_index, sizeof(cl_mem), &cl_world_distances);
+		error |= clSetKernelArg(kernel, first_index + 1, sizeof(cl_float4), &distance_field.origin);
+	}
+	return error;
+}
+
+void particle_system::record_frames() {
+	release_frames();
+	cl_uint zero = 0;
+	cl_int error = clEnqueueFillBuffer(command_queue, cl_active_counts, &zero, sizeof(cl_uint), 0, 2 * config.num_scenes * sizeof(cl_uint), NULL, nullptr, nullptr);
+	error |= clEnqueueFillBuffer(command_queue, cl_residuals, &zero, sizeof(cl_uint), 0, 4 * sizeof(cl_uint), NULL, nullptr, nullptr);
+	if (cl_statistics != nullptr) {
+		error |= clEnqueueFillBuffer(command_queue, cl_statistics, &zero, sizeof(cl_uint), 0, sizeof(particle::cl::statistics), NULL, nullptr, nullptr);
+		statistics_frames = 0;
+	}
+	if (config.neighbor_lists) {
+		error |= clEnqueueFillBuffer(command_queue, cl_neighbor_totals, &zero, sizeof(cl_uint), 0, config.num_scenes * sizeof(cl_uint), NULL, nullptr, nullptr);
+		error |= clEnqueueFillBuffer(command_queue, cl_displacement, &zero, sizeof(cl_uint), 0, 3 * sizeof(cl_uint), NULL, nullptr, nullptr);
+	}
+	particle::cl::print_error(error, "particle_system::record_frames");
+	// everything after move only depends on which buffer of each ping-pong pair is current, so one recording per parity covers every frame
+	for (int parity = 0; parity < 2; parity++) {
+		sort_particles(frame_steps[parity]);
+		construct_bvh(frame_steps[parity]);
+		resolve_particle_collisions(frame_steps[parity], parity, true);
+		if (command_buffers_supported) {
+			frame_command_buffers[parity] = particle::cl::create_command_buffer(command_buffer_functions, command_queue, frame_steps[parity]);
+		}
+		if (config.neighbor_lists) {
+			// both kinds of frames start from the same buffers
+			swap_frame_buffers();
+			sort_particles(reuse_steps[parity], true);
+			resolve_particle_collisions(reuse_steps[parity], parity, false);
+			if (command_buffers_supported) {
+				reuse_command_buffers[parity] = particle::cl::create_command_buffer(command_buffer_functions, command_queue, reuse_steps[parity]);
+			}
+		}
+	}
+	frame_parity = 0;
+	rebuild_neighbor_lists = true;
+}
+
+void particle_system::release_frames() {
+	for (int parity = 0; parity < 2; parity++) {
+		for (auto* steps : {&frame_steps[parity], &reuse_steps[parity]}) {
+			for (particle::cl::kernel_step& step : *steps) {
+				clReleaseKernel(step.kernel);
+			}
+			steps->clear();
+		}
+		for (cl_command_buffer_khr* command_buffer : {&frame_command_buffers[parity], &reuse_command_buffers[parity]}) {
+			if (*command_buffer != nullptr) {
+				command_buffer_functions.release(*command_buffer);
+				*command_buffer = nullptr;
+			}
+		}
+	}
+}
+
+cl_int particle_system::replay_frame() {
+	bool reuse = config.neighbor_lists && !rebuild_neighbor_lists;
+	cl_command_buffer_khr command_buffer = reuse ? reuse_command_buffers[frame_parity] : frame_command_buffers[frame_parity];
+	if (command_buffer != nullptr) {
+		return command_buffer_functions.enqueue(1, &command_queue, command_buffer, NULL, nullptr, nullptr);
+	}
+	return particle::cl::enqueue_steps(command_queue, reuse ? reuse_steps[frame_parity] : frame_steps[frame_parity]);
+}
+
+void particle_system::swap_frame_buffers() {
+	// a recorded frame swaps every ping-pong pair an odd number of times
+	std::swap(cl_particle_positions[0], cl_particle_positions[1]);
+	std::swap(cl_particle_positions_old[0], cl_particle_positions_old[1]);
+	std::swap(cl_particle_ids[0], cl_particle_ids[1]);
+	// a threaded run always draws the buffers the handoff is copied into
+	if (!config.threaded) {
+		std::swap(gl_particle_vao[0], gl_particle_vao[1]);
+	}
+	frame_parity = 1 - frame_parity;
 }
 
 void particle_system::simulate() {
-	glFinish();
-	std::vector<cl_mem> cl_mem_objects = {cl_particle_positions[0], cl_particle_positions[1], cl_world_positions};
-	cl_int error = clEnqueueAcquireGLObjects(command_queue, cl_mem_objects.size(), cl_mem_objects.data(), NULL, nullptr, nullptr);
+	// the simulation thread has no gl context and its buffers are not shared, so it leaves the gl bookkeeping to the render thread
+	std::vector<cl_mem> cl_mem_objects = {cl_particle_positions[0], cl_particle_positions[1], cl_particle_ids[0], cl_particle_ids[1]};
+	cl_int error = CL_SUCCESS;
+	if (!config.threaded) {
+		glFinish();
+		error |= acquire_gl_objects(command_queue, cl_mem_objects);
+	}
+	cl_float previous_time_delta = last_time_delta;
 	move_particles();
-	sort_particles();
-	construct_bvh();
-	resolve_particle_collisions();
-	error |= clEnqueueReleaseGLObjects(command_queue, cl_mem_objects.size(), cl_mem_objects.data(), NULL, nullptr, nullptr);
+	if (config.neighbor_lists) {
+		// the lists have to hold until the end of this frame, so its move is bounded by the last step displacement at this time step plus the fall under gravity
+		cl_float displacements[2];
+		std::memcpy(displacements, h_displacement, sizeof(displacements));
+		cl_float speed = previous_time_delta > 0 ? displacements[1] / previous_time_delta : 0;
+		cl_float reach = displacements[0] + speed * last_time_delta + 9.81f * last_time_delta * last_time_delta / 2;
+		rebuild_neighbor_lists = rebuild_neighbor_lists || 2 * reach > config.neighbor_skin;
+		cl_uint zero = 0;
+		error |= clEnqueueFillBuffer(command_queue, cl_displacement, &zero, sizeof(cl_uint), sizeof(cl_uint), sizeof(cl_uint), NULL, nullptr, nullptr);
+	}
+	error |= replay_frame();
+	if (config.report_residual) {
+		error |= clEnqueueReadBuffer(command_queue, cl_residuals, CL_FALSE, 2 * frame_parity * sizeof(cl_uint), 2 * sizeof(cl_uint), h_residuals, NULL, nullptr, nullptr);
+	}
+	if (config.neighbor_lists) {
+		error |= clEnqueueReadBuffer(command_queue, cl_displacement, CL_FALSE, 0, 3 * sizeof(cl_uint), h_displacement, NULL, nullptr, nullptr);
+	}
+	// the counters also hold the tiles shaded since the last readback, they are cleared right behind the read in the same queue
+	if (cl_statistics != nullptr && ++statistics_frames == config.statistics_interval) {
+		cl_uint zero = 0;
+		error |= clEnqueueReadBuffer(command_queue, cl_statistics, CL_FALSE, 0, sizeof(particle::cl::statistics), &h_statistics, NULL, nullptr, nullptr);
+		error |= clEnqueueFillBuffer(command_queue, cl_statistics, &zero, sizeof(cl_uint), 0, sizeof(particle::cl::statistics), NULL, nullptr, nullptr);
+		statistics_frames = 0;
+		has_statistics = true;
+	}
+	if (!config.threaded) {
+		error |= release_gl_objects(command_queue, cl_mem_objects);
+	}
 	clFinish(command_queue);
+	rebuild_neighbor_lists = false;
+	swap_frame_buffers();
+	if (config.neighbor_lists && h_displacement[2] != 0) {
+		grow_neighbor_lists();
+	}
 	particle::cl::print_error(error, "particle_system::simulate");
 }
 
-void particle_system::cull_lights() {
+// the lists of this frame were cut short, the next frame rebuilds them with twice the room instead of reusing them
+void particle_system::grow_neighbor_lists() {
+	config.neighbor_capacity *= 2;
+	std::cout << "neighbor lists overflowed, growing them to " << config.neighbor_capacity << " neighbors per particle" << std::endl;
+	memory->release(cl_neighbors);
+	cl_neighbors = memory->allocate("neighbors", config.neighbor_capacity * num_particles * sizeof(cl_uint));
+	h_displacement[2] = 0;
+	record_frames();
+}
+
+void particle_system::simulate_domains() {
+	if (domains) {
+		domains->step(advance_time());
+	} else {
+		tiles->step(advance_time());
+	}
+	upload_gathered();
+}
+
+// of a tiled scene only the particles with ids below the drawn scene size, in the gathered order that keeps the tiles together in the bvh
+void particle_system::upload_gathered() {
+	const std::vector<cl_float4>* positions = &(domains ? domains->get_positions() : tiles->get_positions());
+	const std::vector<cl_uint>* ids = &(domains ? domains->get_ids() : tiles->get_ids());
+	if (tiles) {
+		h_drawn_positions.clear();
+		h_drawn_ids.clear();
+		for (size_t i = 0; i < ids->size(); i++) {
+			if ((*ids)[i] >= scene_size) continue;
+			h_drawn_positions.push_back((*positions)[i]);
+			h_drawn_ids.push_back((*ids)[i]);
+		}
+		positions = &h_drawn_positions;
+		ids = &h_drawn_ids;
+	}
+
+	glFinish();
+	std::vector<cl_mem> cl_mem_objects = {cl_particle_positions[0], cl_particle_ids[0]};
+	cl_int error = acquire_gl_objects(command_queue, cl_mem_objects);
+	error |= clEnqueueWriteBuffer(command_queue, cl_particle_positions[0], CL_FALSE, 0, positions->size() * sizeof(cl_float4), positions->data(), NULL, nullptr, nullptr);
+	error |= clEnqueueWriteBuffer(command_queue, cl_particle_ids[0], CL_FALSE, 0, ids->size() * sizeof(cl_uint), ids->data(), NULL, nullptr, nullptr);
+	// shade_tiles still needs a bvh over the rendered particles
+	if (render_steps.empty()) {
+		construct_bvh(render_steps);
+	}
+	error |= particle::cl::enqueue_steps(command_queue, render_steps);
+	error |= release_gl_objects(command_queue, cl_mem_objects);
+	clFinish(command_queue);
+	particle::cl::print_error(error, "particle_system::upload_gathered");
+}
+
+void particle_system::report_scaling() {
+	std::vector<cl_device_id> devices = particle::cl::select_domain_devices(config.device_selection, config.num_domains);
+	const int warm_up_steps = 10;
+	const int steps = 100;
+	double single_domain_duration = 0;
+	std::cout << "domains  ms/step  speedup  efficiency" << std::endl;
+	for (size_t num_domains = 1; num_domains <= devices.size(); num_domains++) {
+		domain_decomposition decomposition(std::vector<cl_device_id>(devices.begin(), devices.begin() + num_domains), h_particle_data, h_world_triangles, config.distance_field_colliders ? &distance_field : nullptr, local_work_sizes);
+		double duration = 0;
+		for (int i = 0; i < warm_up_steps + steps; i++) {
+			decomposition.step(1 / 60.f);
+			if (i >= warm_up_steps) duration += decomposition.get_step_duration();
+		}
+		duration /= steps;
+		if (num_domains == 1) single_domain_duration = duration;
+		double speedup = single_domain_duration / duration;
+		std::cout << num_domains << "  " << duration << "  " << speedup << "  " << speedup / num_domains << std::endl;
+	}
+}
+
+void particle_system::create_shade_tiles_kernel() {
+	if (shade_tiles_kernel != nullptr) {
+		clReleaseKernel(shade_tiles_kernel);
+		clReleaseProgram(cl_shade_program);
+	}
+	// the tile reduction is sized at compile time, so every local work size needs its own build
+	std::string resolution = " -D WINDOW_WIDTH=" + std::to_string(width) + " -D WINDOW_HEIGHT=" + std::to_string(height) + " -D VIEWPORT_WIDTH=" + std::to_string(window_width) + " -D VIEWPORT_HEIGHT=" + std::to_string(window_height);
+	particle::cl::build_program(device, context, &cl_shade_program, "shaders/cl/shade_tiles.cl", "-D LOCAL_WORK_SIZE=" + std::to_string(local_work_sizes.at("shade_tiles")) + resolution + (gl_sharing ? " -D DEPTH_IMAGES" : "") + (cl_statistics != nullptr ? " -D STATISTICS -I shaders/cl" : ""));
+	cl_int error = CL_SUCCESS;
+	shade_tiles_kernel = clCreateKernel(cl_shade_program, "shade_tiles", &error);
+	// a profiled size can still build a tile reduction the device cannot hold, that build is replaced by one with the default size
+	size_t local_work_size = local_work_sizes.at("shade_tiles");
+	if (local_work_size != config.local_work_size) {
+		size_t max_size = 0;
+		cl_ulong local_mem_size = 0;
+		cl_ulong max_local_mem_size = 0;
+		if (error == CL_SUCCESS) {
+			clGetKernelWorkGroupInfo(shade_tiles_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_size, nullptr);
+			clGetKernelWorkGroupInfo(shade_tiles_kernel, device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, nullptr);
+		}
+		clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &max_local_mem_size, nullptr);
+		if (error != CL_SUCCESS || local_work_size > max_size || local_mem_size > max_local_mem_size) {
+			std::cout << "ignoring the local work size " << local_work_size << " of shade_tiles, the device cannot run its build" << std::endl;
+			if (shade_tiles_kernel != nullptr) clReleaseKernel(shade_tiles_kernel);
+			clReleaseProgram(cl_shade_program);
+			shade_tiles_kernel = nullptr;
+			local_work_sizes["shade_tiles"] = config.local_work_size;
+			create_shade_tiles_kernel();
+			return;
+		}
+	}
+	error |= set_statistics_arg(shade_tiles_kernel, cl_render_statistics);
+	error |= clSetKernelArg(shade_tiles_kernel, 0, sizeof(cl_mem), &cl_gbuffer_depths);
+	error |= clSetKernelArg(shade_tiles_kernel, 1, sizeof(cl_mem), &cl_gbuffer_normals);
+	error |= clSetKernelArg(shade_tiles_kernel, 4, sizeof(cl_uint), &bvh_levels[1].second);
+	error |= clSetKernelArg(shade_tiles_kernel, 7, sizeof(cl_mem), &cl_shaded_colors);
+	particle::cl::print_error(error, "particle_system::create_shade_tiles_kernel");
+}
+
+cl_int particle_system::enqueue_shade_tiles(cl_command_queue queue, const glm::mat4& projection, const glm::mat4& view, cl_event* event) {
+	cl_int error = CL_SUCCESS;
+	cl_float16 inverse_projection_view;
+	std::copy_n(value_ptr(inverse(projection * view)), 16, inverse_projection_view.s);
+	cl_float4 camera_position = {eye.x, eye.y, eye.z, 1};
+	cl_mem positions = config.threaded ? cl_rendered_positions : cl_particle_positions[0];
+	cl_mem bvh = config.threaded ? states.get_front().bvh : cl_bvh;
+	error |= clSetKernelArg(shade_tiles_kernel, 2, sizeof(cl_mem), &positions);
+	error |= clSetKernelArg(shade_tiles_kernel, 3, sizeof(cl_mem), &bvh);
+	error |= clSetKernelArg(shade_tiles_kernel, 5, sizeof(cl_float16), &inverse_projection_view);
+	error |= clSetKernelArg(shade_tiles_kernel, 6, sizeof(cl_float4), &camera_position);
+
+	size_t local_work_size = local_work_sizes.at("shade_tiles");
+	size_t global_work_size = local_work_size * 32 * 16;
+	error |= clEnqueueNDRangeKernel(queue, shade_tiles_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, event);
+	return error;
+}
+
+void particle_system::shade_tiles(const glm::mat4& projection, const glm::mat4& view) {
 	glFinish();
-	std::vector<cl_mem> cl_mem_objects = {cl_particle_positions[0], cl_world_depths, cl_culled_lights};
-	cl_int error = clEnqueueAcquireGLObjects(command_queue, cl_mem_objects.size(), cl_mem_objects.data(), NULL, nullptr, nullptr);
+	std::vector<cl_mem> cl_mem_objects = {config.threaded ? cl_rendered_positions : cl_particle_positions[0], cl_gbuffer_depths, cl_gbuffer_normals, cl_shaded_colors};
+	cl_int error = acquire_gl_objects(render_queue, cl_mem_objects);
+	error |= enqueue_shade_tiles(render_queue, projection, view, nullptr);
+	error |= release_gl_objects(render_queue, cl_mem_objects);
+	clFinish(render_queue);
+	particle::cl::print_error(error, "particle_system::shade_tiles");
+}
+
+std::string particle_system::get_profile_file_name() {
+	std::string device_name = particle::cl::get_device_name(device);
+	std::replace_if(device_name.begin(), device_name.end(), [](char c) { return !isalnum(static_cast<unsigned char>(c)); }, '_');
+	return "profiles/" + device_name + ".txt";
+}
+
+// a profile may come from another driver or window size, sizes the autotuner could not have picked keep the default
+void particle_system::load_local_work_sizes() {
+	auto max_work_group_size = [&](const std::string& kernel_name) {
+		size_t max_size = 0;
+		clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_size, nullptr);
+		// the seeding and shading programs are only built with the sizes, their kernels are bounded by the device here and shade_tiles again by its build
+		for (cl_program program : {cl_particle_simulation_program, cl_bitonic_program, cl_bvh_program}) {
+			cl_int error = CL_SUCCESS;
+			cl_kernel kernel = clCreateKernel(program, kernel_name.c_str(), &error);
+			if (error == CL_SUCCESS) {
+				clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_size, nullptr);
+				clReleaseKernel(kernel);
+				break;
+			}
+		}
+		return max_size;
+	};
+
+	std::ifstream file(get_profile_file_name());
+	unsigned int profile_num_particles;
+	std::string kernel_name;
+	size_t local_work_size;
+	while (file >> profile_num_particles >> kernel_name >> local_work_size) {
+		if (profile_num_particles != num_particles || !local_work_sizes.count(kernel_name)) continue;
+		// powers of two divide the work sizes of bitonic_sort and construct_bvh, every thread of a tile shades the same number of pixels
+		bool valid = local_work_size > 0 && (local_work_size & (local_work_size - 1)) == 0 && local_work_size <= max_work_group_size(kernel_name);
+		if (kernel_name == "shade_tiles") {
+			valid = valid && (width / 32) * (height / 16) % local_work_size == 0;
+		}
+		if (valid) {
+			local_work_sizes[kernel_name] = local_work_size;
+		} else {
+			std::cout << "ignoring the profiled local work size " << local_work_size << " of " << kernel_name << std::endl;
+		}
+	}
+}
+
+void particle_system::save_local_work_sizes() {
+	std::vector<std::string> lines;
 	{
-		size_t global_work_size[3] = {256 * 32 * 16, 1, 1};
-		size_t local_work_size[3] = {256, 1, 1};
-		error |= clEnqueueNDRangeKernel(command_queue, calculate_aabb_kernel, 1, nullptr, global_work_size, local_work_size, NULL, nullptr, nullptr);
+		std::ifstream file(get_profile_file_name());
+		std::string line;
+		while (std::getline(file, line)) {
+			std::istringstream line_stream(line);
+			unsigned int profile_num_particles;
+			if (line_stream >> profile_num_particles && profile_num_particles != num_particles) {
+				lines.push_back(line);
+			}
+		}
+	}
+	for (auto& local_work_size : local_work_sizes) {
+		lines.push_back(std::to_string(num_particles) + " " + local_work_size.first + " " + std::to_string(local_work_size.second));
+	}
 
-		std::vector<cl_float> temp3(32 * 16 * 2 * 3);
-		error |= clEnqueueReadBuffer(command_queue, cl_aabbs, CL_TRUE, 0, temp3.size() * sizeof(cl_float), temp3.data(), NULL, nullptr, nullptr);
-		int a = 0;
+	std::filesystem::create_directories("profiles");
+	std::ofstream file(get_profile_file_name());
+	for (std::string& line : lines) {
+		file << line << std::endl;
 	}
+}
+
+void particle_system::autotune(const glm::mat4& projection, const glm::mat4& view) {
+	cl_int error = CL_SUCCESS;
+	cl_command_queue profiling_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+	const int repetitions = 5;
+
+	glFinish();
+	std::vector<cl_mem> cl_mem_objects = {cl_particle_positions[0], cl_particle_positions[1], cl_particle_ids[0], cl_particle_ids[1], cl_gbuffer_depths, cl_gbuffer_normals, cl_shaded_colors};
+	error |= acquire_gl_objects(profiling_queue, cl_mem_objects);
+
+	auto tune = [&](const std::string& kernel_name, std::vector<size_t> candidates, std::function<double()> measure, std::function<void()> apply) {
+		size_t best_local_work_size = local_work_sizes.at(kernel_name);
+		double best_duration = std::numeric_limits<double>::max();
+		for (size_t candidate : candidates) {
+			local_work_sizes[kernel_name] = candidate;
+			apply();
+			double duration = measure();
+			if (duration < best_duration) {
+				best_duration = duration;
+				best_local_work_size = candidate;
+			}
+		}
+		local_work_sizes[kernel_name] = best_local_work_size;
+		apply();
+		std::cout << kernel_name << ": " << best_local_work_size << " (" << best_duration << " ms)" << std::endl;
+	};
 
 	{
-		error |= clSetKernelArg(cull_lights_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
-		size_t global_work_size[3] = {32, 16, 1};
-		size_t local_work_size[3] = {32, 8, 1};
-		error |= clEnqueueNDRangeKernel(command_queue, cull_lights_kernel, 3, nullptr, global_work_size, local_work_size, NULL, nullptr, nullptr);
+		// a zero time step keeps the particles where they are while move is timed
+		cl_float time_delta_old = 1;
+		cl_float time_delta = 0;
+		error |= clSetKernelArg(move_kernel, 0, sizeof(cl_mem), &cl_particle_positions_old[0]);
+		error |= clSetKernelArg(move_kernel, 1, sizeof(cl_mem), &cl_particle_positions[0]);
+		error |= clSetKernelArg(move_kernel, 3, sizeof(cl_float), &time_delta_old);
+		error |= clSetKernelArg(move_kernel, 4, sizeof(cl_float), &time_delta);
+		tune("move", particle::cl::get_local_work_size_candidates(device, move_kernel), [&]() {
+			size_t local_work_size = std::min<size_t>(local_work_sizes.at("move"), num_particles);
+			return particle::cl::time_kernel(profiling_queue, move_kernel, particle::cl::get_global_work_size(num_particles, local_work_size), local_work_size, repetitions);
+		}, []() {});
+		time_delta_old = 0;
+		error |= clSetKernelArg(move_kernel, 3, sizeof(cl_float), &time_delta_old);
 	}
 
-	std::vector<float> temp(16 * 16 * 8);	
-//	error |= clEnqueueReadBuffer(command_queue, cl_world_depths, true, 0, temp.size() * sizeof(cl_float), temp.data(), NULL, nullptr, nullptr);
-//	for (int i = 0; i < 16 * 16 * 8; i += 4) {
-//		std::cout << temp[i] << ' ' << temp[i + 1] << ' ' << temp[i + 2] << ' ' << temp[i + 3] << std::endl;
-//	} std::cout << std::endl;
+	std::vector<std::pair<std::string, cl_program>> recorded_kernels = {
+		{"init_indices", cl_bitonic_program},
+		{"bitonic_sort", cl_bitonic_program},
+		{"apply_indices", cl_bitonic_program},
+		{"construct_bvh", cl_bvh_program},
+		{"compact_active", cl_particle_simulation_program}
+	};
+	if (config.gauss_seidel_solver) {
+		recorded_kernels.push_back({"build_contacts", cl_particle_simulation_program});
+		recorded_kernels.push_back({"color_contacts", cl_particle_simulation_program});
+		recorded_kernels.push_back({"gauss_seidel_sweep", cl_particle_simulation_program});
+	} else if (config.neighbor_lists) {
+		recorded_kernels.push_back({"build_neighbor_lists", cl_particle_simulation_program});
+		recorded_kernels.push_back({"resolve_neighbors", cl_particle_simulation_program});
+		recorded_kernels.push_back({"max_displacement", cl_particle_simulation_program});
+	} else {
+		recorded_kernels.push_back({"resolve_collisions", cl_particle_simulation_program});
+	}
+	if (config.report_residual) {
+		recorded_kernels.push_back({"contact_residual", cl_particle_simulation_program});
+	}
+	for (auto& recorded_kernel : recorded_kernels) {
+		cl_int kernel_error = CL_SUCCESS;
+		cl_kernel kernel = clCreateKernel(recorded_kernel.second, recorded_kernel.first.c_str(), &kernel_error);
+		error |= kernel_error;
+		tune(recorded_kernel.first, particle::cl::get_local_work_size_candidates(device, kernel), [&]() {
+			double duration = 0;
+			for (int i = 0; i < repetitions; i++) {
+				duration += particle::cl::time_steps(profiling_queue, frame_steps[frame_parity], recorded_kernel.first);
+				swap_frame_buffers();
+			}
+			return duration / repetitions;
+		}, [&]() {
+			record_frames();
+		});
+		clReleaseKernel(kernel);
+	}
 
-	error |= clEnqueueReleaseGLObjects(command_queue, cl_mem_objects.size(), cl_mem_objects.data(), NULL, nullptr, nullptr);
-	clFinish(command_queue);
-	particle::cl::print_error(error, "particle_system::cull_lights");
+	// every thread of a tile has to shade the same number of pixels
+	std::vector<size_t> shade_tiles_candidates;
+	for (size_t candidate : particle::cl::get_local_work_size_candidates(device, shade_tiles_kernel)) {
+		if ((width / 32) * (height / 16) % candidate == 0) {
+			shade_tiles_candidates.push_back(candidate);
+		}
+	}
+	tune("shade_tiles", shade_tiles_candidates, [&]() {
+		double duration = 0;
+		for (int i = 0; i < repetitions; i++) {
+			cl_event event;
+			if (enqueue_shade_tiles(profiling_queue, projection, view, &event) != CL_SUCCESS) {
+				return std::numeric_limits<double>::max();
+			}
+			duration += particle::cl::get_event_duration(event);
+			clReleaseEvent(event);
+		}
+		return duration / repetitions;
+	}, [&]() {
+		create_shade_tiles_kernel();
+	});
+
+	error |= release_gl_objects(profiling_queue, cl_mem_objects);
+	clFinish(profiling_queue);
+	clReleaseCommandQueue(profiling_queue);
+	particle::cl::print_error(error, "particle_system::autotune");
+	save_local_work_sizes();
 }
 
 void particle_system::prepass(const glm::mat4& projection, const glm::mat4& view) {
@@ -461,11 +1389,6 @@ void particle_system::prepass(const glm::mat4& projection, const glm::mat4& view
 	glUseProgram(gl_world_program);
 	glBindVertexArray(gl_world_vao);
 	glUniformMatrix4fv(0, 1, GL_FALSE, value_ptr(projection * view));
-	glUniform3f(1, eye.x, eye.y, eye.z);
-
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D, gl_light_texture);
-	
 	glDrawArrays(GL_TRIANGLES, 0, 3 * num_triangles);
 	particle::gl::print_error(glGetError(), "particle_system::prepass");
 }
@@ -475,52 +1398,82 @@ void particle_system::render(const glm::mat4& projection, const glm::mat4& view)
 	std::vector<GLenum> draw_buffers = {GL_COLOR_ATTACHMENT0, GL_NONE};
 	glDrawBuffers(draw_buffers.size(), draw_buffers.data());
 
+	// the world is already shaded into the color attachment by shade_tiles, only the particles are rasterized on top
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LEQUAL);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDepthMask(GL_FALSE);
-
-	glUseProgram(gl_world_program);
-	glBindVertexArray(gl_world_vao);
-	glUniformMatrix4fv(0, 1, GL_FALSE, value_ptr(projection * view));
-	glUniform3f(1, eye.x, eye.y, eye.z);
-	glDrawArrays(GL_TRIANGLES, 0, 3 * num_triangles);
-
 	glDepthMask(GL_TRUE);
 
 	glUseProgram(gl_particle_program);
 	glBindVertexArray(gl_particle_vao[0]);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, gl_particle_color_texture);
 	glUniformMatrix4fv(3, 1, GL_FALSE, value_ptr(projection * view));
-	glDrawArraysInstancedARB(GL_TRIANGLES, 0, pow(2, 4) * 36, num_particles);
+	glDrawArraysInstancedARB(GL_TRIANGLES, 0, pow(2, 4) * 36, scene_size);
 
 	
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, gl_framebuffer);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-
-	glfwSwapBuffers(window);
+	if (capture) {
+		capture->capture(gl_framebuffer);
+	} else {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, gl_framebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, window_width, window_height, 0, 0, window_width, window_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glfwSwapBuffers(window);
+	}
 	particle::gl::print_error(glGetError(), "particle_system::render");
 }
 
 void particle_system::enter_main_loop() {
-	
-	double last_time = glfwGetTime();
+	// a tiled run records no frames and keeps no full size buffers to time them on
+	if (config.tune_local_work_sizes && !tiles) {
+		glm::mat4 projection = glm::perspective(0.9272952f, static_cast<float>(window_width) / static_cast<float>(window_height), 0.001f, 1000.0f);
+		glm::mat4 view = lookAt(eye, center, up);
+		prepass(projection, view);
+		autotune(projection, view);
+	}
+	if (config.report_scaling && config.num_scenes == 1) {
+		report_scaling();
+	}
+
+	if (config.threaded) {
+		stopping = false;
+		std::thread simulation_thread(&particle_system::simulation_loop, this);
+		render_loop();
+		stopping = true;
+		simulation_thread.join();
+		return;
+	}
+
+	double last_time = get_time();
 	unsigned int number_frames = 0;
 
-	while (true) {
-		glm::mat4 projection = glm::perspective(0.9272952f, static_cast<float>(width) / static_cast<float>(height), 0.001f, 1000.0f);
+	while (!capture || capture->get_num_captured() + capture->get_num_dropped() < config.capture_frames) {
+		glm::mat4 projection = glm::perspective(0.9272952f, static_cast<float>(window_width) / static_cast<float>(window_height), 0.001f, 1000.0f);
 		glm::mat4 view = lookAt(eye, center, up);
 		prepass(projection, view);
-		cull_lights();
+		shade_tiles(projection, view);
 		render(projection, view);
 
-		glfwPollEvents();
+		if (window != nullptr) {
+			glfwPollEvents();
+		}
+		input_event event;
+		while (render_events.pop(&event)) {
+			apply_render_event(event);
+		}
+		while (simulation_events.pop(&event)) {
+			apply_simulation_event(event);
+		}
 		if(sim) {
-			simulate();
+			if (domains || tiles) {
+				simulate_domains();
+			} else {
+				simulate();
+			}
 		}
-		double current_time = glfwGetTime();
+		double current_time = get_time();
 		if (current_time - last_time >= 1.0) {
 			std::cout << number_frames << " fps" << std::endl;
+			print_simulation_report();
 			number_frames = 0;
 			last_time = current_time;
 		}
@@ -528,30 +1481,426 @@ void particle_system::enter_main_loop() {
 	}
 }
 
-particle_system::particle_system(size_t local_work_size, std::vector<cl_float> positions, std::vector<cl_float> radii):
-	global_work_size(particle::cl::get_global_work_size(positions.size(), local_work_size)),
-	local_work_size(local_work_size),
-	num_particles(positions.size() / 3),
-	num_bvh_branch_nodes(pow(2, ceil(log(num_particles) / log(2))) - 1),
+void particle_system::print_simulation_report() {
+	if (domains) {
+		domains->print_report();
+	} else if (tiles) {
+		tiles->print_report();
+	} else if (config.report_residual) {
+		cl_float max_penetration;
+		std::memcpy(&max_penetration, &h_residuals[0], sizeof(cl_float));
+		std::cout << "residual: " << max_penetration << " max penetration, " << h_residuals[1] << " penetrating pairs" << std::endl;
+	}
+	if (has_statistics) {
+		particle::cl::print_statistics(h_statistics, config.statistics_interval);
+		has_statistics = false;
+	}
+}
+
+void particle_system::apply_render_event(const input_event& event) {
+	if (event.type == input_event::ORBIT) {
+		glm::vec3 right = normalize(cross(eye - center, up));
+		glm::vec3 up = normalize(cross(right, eye - center));
+		eye = center + length(eye - center) * normalize(normalize(eye - center) + event.x_delta * right + event.y_delta * up);
+	} else if (event.type == input_event::ZOOM) {
+		glm::vec3 new_eye = eye - 0.5f * event.y_delta * normalize(eye - center);
+		eye = length(new_eye) > 1 ? new_eye : normalize(eye);
+	}
+}
+
+// the clock only runs while the simulation does
+void particle_system::apply_simulation_event(const input_event& event) {
+	if (sim) {
+		time -= event.time;
+	} else {
+		time += event.time;
+	}
+	sim = event.pressed;
+}
+
+// the copies wait for the frame on the in-order queue, so the slot is complete once it is published
+void particle_system::publish_state() {
+	simulation_state& state = states.get_back();
+	cl_int error = CL_SUCCESS;
+	error |= clEnqueueCopyBuffer(command_queue, cl_particle_positions[0], state.positions, 0, 0, scene_size * sizeof(cl_float4), NULL, nullptr, nullptr);
+	error |= clEnqueueCopyBuffer(command_queue, cl_particle_ids[0], state.ids, 0, 0, scene_size * sizeof(cl_uint), NULL, nullptr, nullptr);
+	error |= clEnqueueCopyBuffer(command_queue, cl_bvh, state.bvh, 0, 0, num_bvh_branch_nodes * sizeof(cl_float4), NULL, nullptr, nullptr);
+	clFinish(command_queue);
+	particle::cl::print_error(error, "particle_system::publish_state");
+	states.publish();
+}
+
+// the front slot is not written while the render thread holds it, the bvh is read by shade_tiles right from the slot
+void particle_system::present_latest_state() {
+	if (!states.update()) return;
+	const simulation_state& state = states.get_front();
+	glFinish();
+	std::vector<cl_mem> cl_mem_objects = {cl_rendered_positions, cl_rendered_ids};
+	cl_int error = acquire_gl_objects(render_queue, cl_mem_objects);
+	error |= clEnqueueCopyBuffer(render_queue, state.positions, cl_rendered_positions, 0, 0, scene_size * sizeof(cl_float4), NULL, nullptr, nullptr);
+	error |= clEnqueueCopyBuffer(render_queue, state.ids, cl_rendered_ids, 0, 0, scene_size * sizeof(cl_uint), NULL, nullptr, nullptr);
+	error |= release_gl_objects(render_queue, cl_mem_objects);
+	clFinish(render_queue);
+	particle::cl::print_error(error, "particle_system::present_latest_state");
+}
+
+// never touches gl, the window and its context stay with the render thread
+void particle_system::simulation_loop() {
+	double last_time = get_time();
+	unsigned int number_steps = 0;
+
+	while (!stopping) {
+		input_event event;
+		while (simulation_events.pop(&event)) {
+			apply_simulation_event(event);
+		}
+		if (!sim) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		simulate();
+		publish_state();
+
+		double current_time = get_time();
+		if (current_time - last_time >= 1.0) {
+			std::cout << number_steps << " steps/s" << std::endl;
+			print_simulation_report();
+			number_steps = 0;
+			last_time = current_time;
+		}
+		number_steps++;
+	}
+}
+
+// draws whatever the simulation finished last and never waits for the next step
+void particle_system::render_loop() {
+	double last_time = get_time();
+	unsigned int number_frames = 0;
+	particle::cl::statistics render_statistics = {};
+	cl_uint statistics_frames = 0;
+	bool has_render_statistics = false;
+
+	while (!glfwWindowShouldClose(window)) {
+		glfwPollEvents();
+		input_event event;
+		while (render_events.pop(&event)) {
+			apply_render_event(event);
+		}
+		present_latest_state();
+
+		glm::mat4 projection = glm::perspective(0.9272952f, static_cast<float>(window_width) / static_cast<float>(window_height), 0.001f, 1000.0f);
+		glm::mat4 view = lookAt(eye, center, up);
+		prepass(projection, view);
+		shade_tiles(projection, view);
+		render(projection, view);
+		if (cl_render_statistics != nullptr && ++statistics_frames == config.statistics_interval) {
+			cl_uint zero = 0;
+			cl_int error = clEnqueueReadBuffer(render_queue, cl_render_statistics, CL_TRUE, 0, sizeof(particle::cl::statistics), &render_statistics, NULL, nullptr, nullptr);
+			error |= clEnqueueFillBuffer(render_queue, cl_render_statistics, &zero, sizeof(cl_uint), 0, sizeof(particle::cl::statistics), NULL, nullptr, nullptr);
+			particle::cl::print_error(error, "particle_system::render_loop");
+			statistics_frames = 0;
+			has_render_statistics = true;
+		}
+
+		double current_time = get_time();
+		if (current_time - last_time >= 1.0) {
+			std::cout << number_frames << " fps" << std::endl;
+			if (has_render_statistics) {
+				particle::cl::print_statistics(render_statistics, config.statistics_interval);
+				has_render_statistics = false;
+			}
+			number_frames = 0;
+			last_time = current_time;
+		}
+		number_frames++;
+	}
+}
+
+particle_system::particle_system(configuration config, const std::vector<cl_float>& positions, const std::vector<cl_float>& radii):
+	config(config),
+	num_particles(radii.size()),
 	eye(15, 12, 0), center(-10, 0, 0), up(0, 1, 0) {
-	for (size_t i = 0; i < radii.size(); i++) {
-		h_particle_data.push_back(positions[i * 3]);
-		h_particle_data.push_back(positions[i * 3 + 1]);
-		h_particle_data.push_back(positions[i * 3 + 2]);
-		h_particle_data.push_back(radii[i]);
-	}
-	bvh_levels.push_back({0, num_particles});
-	cl_uint level_size = pow(2, ceil(log(num_particles) / log(2)) - 1);
-	cl_uint num_nodes = ceil(num_particles / 2.f);
-	cl_uint start_index = level_size - 1;
-	while (level_size > 0) {
-		bvh_levels.push_back({start_index, start_index + num_nodes});
-		level_size = floor(level_size / 2.f);
-		num_nodes = ceil(num_nodes / 2.f);
-		start_index -= level_size;
-		
+	h_particle_data.resize(4 * num_particles);
+	for (size_t i = 0; i < num_particles; i++) {
+		std::copy_n(&positions[3 * i], 3, &h_particle_data[4 * i]);
+		h_particle_data[4 * i + 3] = radii[i];
 	}
 	init();
 }
 
-particle_system::~particle_system() {}
\ No newline at end of file
+particle_system::particle_system(configuration config, particle::seed_distribution distribution):
+	config(config),
+	seed_distribution(distribution),
+	num_particles(config.num_scenes * distribution.num_particles),
+	eye(15, 12, 0), center(-10, 0, 0), up(0, 1, 0) {
+	init();
+}
+
+particle::physics_metrics particle_system::measure_physics() {
+	cl_int error = CL_SUCCESS;
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("physics_metrics"), scene_size);
+	particle::cl::kernel_step step = {physics_metrics_kernel, particle::cl::get_global_work_size(scene_size, local_work_size), local_work_size, config.num_scenes};
+	size_t num_groups = config.num_scenes * step.global_work_size / local_work_size;
+	if (physics_metrics_kernel == nullptr) {
+		step.kernel = physics_metrics_kernel = clCreateKernel(cl_particle_simulation_program, "physics_metrics", &error);
+		cl_metric_sums = memory->allocate("metrics", num_groups * sizeof(cl_float8));
+		cl_max_penetration = memory->allocate("metrics", sizeof(cl_uint));
+	}
+
+	glFinish();
+	std::vector<cl_mem> cl_mem_objects = {cl_particle_positions[0]};
+	error |= acquire_gl_objects(command_queue, cl_mem_objects);
+	// the bvh of a frame is built before its particles are resolved and reuse frames keep an older one, the pairs are counted through one of their own
+	if (render_steps.empty()) {
+		construct_bvh(render_steps);
+	}
+	for (particle::cl::kernel_step& step : render_steps) {
+		error |= clSetKernelArg(step.kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+	}
+	error |= particle::cl::enqueue_steps(command_queue, render_steps);
+	cl_float time_delta = config.fixed_time_delta;
+	cl_uint zero = 0;
+	error |= clSetKernelArg(physics_metrics_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+	error |= clSetKernelArg(physics_metrics_kernel, 1, sizeof(cl_mem), &cl_particle_positions_old[0]);
+	error |= clSetKernelArg(physics_metrics_kernel, 2, sizeof(cl_mem), &cl_bvh);
+	error |= clSetKernelArg(physics_metrics_kernel, 3, sizeof(cl_uint), &bvh_levels[1].second);
+	error |= clSetKernelArg(physics_metrics_kernel, 4, sizeof(cl_mem), &cl_world_triangles);
+	error |= clSetKernelArg(physics_metrics_kernel, 5, sizeof(cl_uint), &num_triangles);
+	error |= clSetKernelArg(physics_metrics_kernel, 6, sizeof(cl_float), &time_delta);
+	error |= clSetKernelArg(physics_metrics_kernel, 7, sizeof(cl_uint), &scene_size);
+	error |= clSetKernelArg(physics_metrics_kernel, 8, local_work_size * sizeof(cl_float8), nullptr);
+	error |= clSetKernelArg(physics_metrics_kernel, 9, sizeof(cl_mem), &cl_metric_sums);
+	error |= clSetKernelArg(physics_metrics_kernel, 10, sizeof(cl_mem), &cl_max_penetration);
+	error |= set_world_collider_args(physics_metrics_kernel, 11);
+	error |= clEnqueueFillBuffer(command_queue, cl_max_penetration, &zero, sizeof(cl_uint), 0, sizeof(cl_uint), NULL, nullptr, nullptr);
+	error |= particle::cl::enqueue_step(command_queue, step, nullptr);
+
+	std::vector<cl_float8> partial_sums(num_groups);
+	cl_uint max_penetration_bits;
+	error |= clEnqueueReadBuffer(command_queue, cl_metric_sums, CL_FALSE, 0, num_groups * sizeof(cl_float8), partial_sums.data(), NULL, nullptr, nullptr);
+	error |= clEnqueueReadBuffer(command_queue, cl_max_penetration, CL_FALSE, 0, sizeof(cl_uint), &max_penetration_bits, NULL, nullptr, nullptr);
+	error |= release_gl_objects(command_queue, cl_mem_objects);
+	clFinish(command_queue);
+	particle::cl::print_error(error, "particle_system::measure_physics");
+
+	// the groups are summed in double so the totals do not depend on the local work size more than the float sums within a group do
+	std::array<double, 8> sums = {};
+	for (const cl_float8& partial_sum : partial_sums) {
+		for (int i = 0; i < 8; i++) {
+			sums[i] += partial_sum.s[i];
+		}
+	}
+	cl_float max_penetration;
+	std::memcpy(&max_penetration, &max_penetration_bits, sizeof(cl_float));
+
+	particle::physics_metrics metrics;
+	metrics.kinetic_energy = sums[0];
+	metrics.potential_energy = sums[1];
+	std::copy_n(&sums[2], 3, metrics.momentum);
+	metrics.max_penetration = max_penetration;
+	metrics.mean_penetration = sums[6] > 0 ? sums[5] / sums[6] : 0;
+	metrics.penetrating_pairs = static_cast<cl_uint>(sums[6]);
+	metrics.world_penetrations = static_cast<cl_uint>(sums[7]);
+	return metrics;
+}
+
+particle::physics_trace particle_system::run_headless(cl_uint num_steps) {
+	particle::physics_trace trace;
+	trace.num_particles = num_particles;
+	trace.num_scenes = config.num_scenes;
+	trace.seed = seed_distribution.seed;
+	trace.box_min = seed_distribution.box_min;
+	trace.box_max = seed_distribution.box_max;
+	trace.time_delta = config.fixed_time_delta;
+	if (domains || tiles || config.fixed_time_delta <= 0) {
+		std::cout << "headless runs need a fixed time step and a single domain without tiles" << std::endl;
+		return trace;
+	}
+	for (cl_uint i = 0; i < num_steps; i++) {
+		simulate();
+		particle::physics_metrics metrics = measure_physics();
+		if (!trace.steps.empty()) {
+			const double* previous = trace.steps.back().momentum;
+			metrics.momentum_drift = std::sqrt(std::pow(metrics.momentum[0] - previous[0], 2) + std::pow(metrics.momentum[1] - previous[1], 2) + std::pow(metrics.momentum[2] - previous[2], 2));
+		}
+		trace.steps.push_back(metrics);
+	}
+	return trace;
+}
+
+void particle_system::step(cl_uint num_steps) {
+	for (cl_uint i = 0; i < num_steps; i++) {
+		if (domains || tiles) {
+			simulate_domains();
+		} else {
+			simulate();
+		}
+	}
+}
+
+// the pointers of a map are returned right away, so the unmaps can follow the pending maps in the same queue
+void particle_system::unmap_views() {
+	cl_int error = CL_SUCCESS;
+	if (view_fence != nullptr) {
+		clReleaseEvent(view_fence);
+		view_fence = nullptr;
+	}
+	for (size_t i = 0; i < NUM_VIEW_BUFFERS; i++) {
+		if (h_view_data[i] != nullptr) {
+			error |= clEnqueueUnmapMemObject(command_queue, cl_view_buffers[i], h_view_data[i], NULL, nullptr, nullptr);
+			h_view_data[i] = nullptr;
+		}
+	}
+	particle::cl::print_error(error, "particle_system::unmap_views");
+}
+
+cl_event particle_system::export_state() {
+	if (domains || tiles) {
+		std::cout << "exported states need a single domain without tiles" << std::endl;
+		return nullptr;
+	}
+	cl_int error = CL_SUCCESS;
+	unmap_views();
+	bool contacts = cl_contacts != nullptr;
+	size_t sizes[NUM_VIEW_BUFFERS] = {num_particles * sizeof(cl_float4), num_particles * sizeof(cl_float4), num_particles * sizeof(cl_uint), contacts ? config.max_contacts * num_particles * sizeof(cl_uint) : 0, contacts ? num_particles * sizeof(cl_uint) : 0};
+	if (export_velocities_kernel == nullptr) {
+		export_velocities_kernel = clCreateKernel(cl_particle_simulation_program, "export_velocities", &error);
+		// pinned host memory the device writes through, on devices sharing the host memory mapping it copies nothing
+		for (size_t i = 0; i < NUM_VIEW_BUFFERS; i++) {
+			if (sizes[i] == 0) continue;
+			cl_view_buffers[i] = memory->adopt("views", clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizes[i], nullptr, &error), sizes[i]);
+		}
+	}
+
+	glFinish();
+	std::vector<cl_mem> cl_mem_objects = {cl_particle_positions[0], cl_particle_ids[0]};
+	error |= acquire_gl_objects(command_queue, cl_mem_objects);
+	error |= clEnqueueCopyBuffer(command_queue, cl_particle_positions[0], cl_view_buffers[VIEW_POSITIONS], 0, 0, sizes[VIEW_POSITIONS], NULL, nullptr, nullptr);
+	error |= clEnqueueCopyBuffer(command_queue, cl_particle_ids[0], cl_view_buffers[VIEW_IDS], 0, 0, sizes[VIEW_IDS], NULL, nullptr, nullptr);
+	if (contacts) {
+		error |= clEnqueueCopyBuffer(command_queue, cl_contacts, cl_view_buffers[VIEW_CONTACTS], 0, 0, sizes[VIEW_CONTACTS], NULL, nullptr, nullptr);
+		error |= clEnqueueCopyBuffer(command_queue, cl_contact_counts, cl_view_buffers[VIEW_CONTACT_COUNTS], 0, 0, sizes[VIEW_CONTACT_COUNTS], NULL, nullptr, nullptr);
+	}
+	error |= clSetKernelArg(export_velocities_kernel, 0, sizeof(cl_mem), &cl_particle_positions[0]);
+	error |= clSetKernelArg(export_velocities_kernel, 1, sizeof(cl_mem), &cl_particle_positions_old[0]);
+	error |= clSetKernelArg(export_velocities_kernel, 2, sizeof(cl_mem), &cl_view_buffers[VIEW_VELOCITIES]);
+	error |= clSetKernelArg(export_velocities_kernel, 3, sizeof(cl_float), &last_time_delta);
+	error |= clSetKernelArg(export_velocities_kernel, 4, sizeof(cl_uint), &num_particles);
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("export_velocities"), num_particles);
+	size_t global_work_size = particle::cl::get_global_work_size(num_particles, local_work_size);
+	error |= clEnqueueNDRangeKernel(command_queue, export_velocities_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	error |= release_gl_objects(command_queue, cl_mem_objects);
+
+	for (size_t i = 0; i < NUM_VIEW_BUFFERS; i++) {
+		if (cl_view_buffers[i] == nullptr) continue;
+		cl_int map_error = CL_SUCCESS;
+		h_view_data[i] = clEnqueueMapBuffer(command_queue, cl_view_buffers[i], CL_FALSE, CL_MAP_READ, 0, sizes[i], NULL, nullptr, nullptr, &map_error);
+		error |= map_error;
+	}
+	error |= clEnqueueMarkerWithWaitList(command_queue, NULL, nullptr, &view_fence);
+	clFlush(command_queue);
+	particle::cl::print_error(error, "particle_system::export_state");
+	return view_fence;
+}
+
+particle_system::state_view particle_system::sync() {
+	state_view view;
+	if (view_fence == nullptr) return view;
+	particle::cl::print_error(clWaitForEvents(1, &view_fence), "particle_system::sync");
+	view.positions = static_cast<const cl_float4*>(h_view_data[VIEW_POSITIONS]);
+	view.velocities = static_cast<const cl_float4*>(h_view_data[VIEW_VELOCITIES]);
+	view.ids = static_cast<const cl_uint*>(h_view_data[VIEW_IDS]);
+	view.contacts = static_cast<const cl_uint*>(h_view_data[VIEW_CONTACTS]);
+	view.contact_counts = static_cast<const cl_uint*>(h_view_data[VIEW_CONTACT_COUNTS]);
+	view.num_particles = num_particles;
+	view.max_contacts = cl_contacts != nullptr ? config.max_contacts : 0;
+	return view;
+}
+
+bool particle_system::get_statistics(particle::cl::statistics* statistics) const {
+	if (cl_statistics == nullptr) return false;
+	*statistics = h_statistics;
+	return true;
+}
+
+void particle_system::reconfigure(configuration config, particle::seed_distribution distribution) {
+	config.device_selection = this->config.device_selection;
+	config.headless = this->config.headless;
+	config.capture_file = this->config.capture_file;
+	config.capture_frames = this->config.capture_frames;
+	release_cl();
+
+	this->config = config;
+	seed_distribution = distribution;
+	h_particle_data.clear();
+	num_particles = config.num_scenes * distribution.num_particles;
+	size_scenes();
+	allocate_gl_particles();
+	init_cl();
+}
+
+void particle_system::resize(unsigned int window_width, unsigned int window_height) {
+	if (window_width == 0 || window_height == 0) return;
+	this->window_width = window_width;
+	this->window_height = window_height;
+
+	glViewport(0, 0, window_width, window_height);
+
+	// the render targets are padded up to the smallest tiles of the 32 x 16 grid whose pixels every work item of a shade_tiles group shares equally
+	size_t local_work_size = local_work_sizes.at("shade_tiles");
+	size_t min_tile_width = (window_width + 31) / 32;
+	size_t min_tile_height = (window_height + 15) / 16;
+	size_t tile_width = 0;
+	size_t tile_height = 0;
+	for (size_t candidate_width = min_tile_width; candidate_width < min_tile_width + local_work_size; candidate_width++) {
+		size_t height_step = local_work_size / std::gcd(candidate_width, local_work_size);
+		size_t candidate_height = (min_tile_height + height_step - 1) / height_step * height_step;
+		if (tile_width == 0 || candidate_width * candidate_height < tile_width * tile_height) {
+			tile_width = candidate_width;
+			tile_height = candidate_height;
+		}
+	}
+	unsigned int render_width = 32 * tile_width;
+	unsigned int render_height = 16 * tile_height;
+
+	// the cl images have to go before the storage of their textures is redefined, the shading kernel is built for the viewport either way
+	clFinish(command_queue);
+	if (render_width == width && render_height == height) {
+		create_shade_tiles_kernel();
+		return;
+	}
+	for (cl_mem image : {cl_gbuffer_depths, cl_gbuffer_normals, cl_shaded_colors}) {
+		gl_mirrors.erase(image);
+		gl_objects.erase(image);
+	}
+	memory->release_subsystem("gbuffer");
+	width = render_width;
+	height = render_height;
+	allocate_gl_textures();
+	share_gbuffer();
+	create_shade_tiles_kernel();
+}
+
+particle_system::~particle_system() {
+	capture.reset();
+	release_cl();
+	memory.reset();
+	clReleaseCommandQueue(command_queue);
+	clReleaseContext(context);
+
+	glDeleteFramebuffers(1, &gl_framebuffer);
+	for (GLuint texture : {gl_color_texture, gl_normal_texture, gl_depth_texture, gl_particle_color_texture}) {
+		glDeleteTextures(1, &texture);
+	}
+	for (GLuint buffer : {gl_positions[0], gl_positions[1], gl_particle_ids[0], gl_particle_ids[1], gl_particle_colors, gl_particle_geometry, gl_world_positions, gl_world_normals}) {
+		glDeleteBuffers(1, &buffer);
+	}
+	glDeleteVertexArrays(2, gl_particle_vao);
+	glDeleteVertexArrays(1, &gl_world_vao);
+	glDeleteProgram(gl_particle_program);
+	glDeleteProgram(gl_world_program);
+	if (window != nullptr) {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+	}
+}
\ No newline at end of file
@@ -5,15 +5,87 @@
 #include <CL/cl.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
+#include "utility.hpp"
+#include "device_memory.hpp"
+#include "domain_decomposition.hpp"
+#include "tile_streaming.hpp"
+#include "frame_capture.hpp"
+#include "lock_free.hpp"
 
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
 
 class particle_system {
-	GLFWwindow* window;
-	const unsigned int width = 2560;
-	const unsigned int height = 1536;
+public:
+	struct configuration {
+		size_t local_work_size = 256;
+		bool tune_local_work_sizes = false;
+		particle::cl::device_selection device_selection;
+		cl_uint num_domains = 1;
+		bool report_scaling = false;
+		// more than one tile streams the particles through the device a slab at a time, for scenes larger than device memory
+		cl_uint num_tiles = 1;
+		// a tiled scene only keeps this many of its particles on the device to draw them
+		cl_uint max_rendered_particles = 1 << 20;
+		// sampled signed distances make world collisions independent of the triangle count, but only fit static worlds
+		bool distance_field_colliders = false;
+		float distance_field_cell_size = 0.2f;
+		// in place gauss-seidel sweeps over a colored contact graph instead of the ten jacobi iterations
+		bool gauss_seidel_solver = false;
+		cl_uint solver_iterations = 3;
+		cl_uint max_contacts = 16;
+		cl_uint max_colors = 16;
+		bool report_residual = false;
+		// independent scenes of the same size simulated side by side in the same launches, only the first one is rendered
+		cl_uint num_scenes = 1;
+		// the sort, bvh and traversal only run when a particle has moved half the skin since the neighbor lists were built
+		bool neighbor_lists = false;
+		float neighbor_skin = 0.05f;
+		cl_uint neighbor_capacity = 32;
+		// frames between readbacks of the traversal and tile counters, the kernels are only built with them when it is not 0
+		cl_uint statistics_interval = 0;
+		// simulated seconds per frame instead of the wall clock, needed for reproducible runs
+		cl_float fixed_time_delta = 0;
+		// hidden window, the simulation is only stepped through run_headless
+		bool headless = false;
+		// renders on a surfaceless egl context without any window and streams capture_frames frames to this file, see frame_capture
+		std::string capture_file;
+		cl_uint capture_frames = 600;
+		// live and peak device memory per subsystem after every init_cl
+		bool report_memory = false;
+		// simulates on its own thread and renders the latest finished frame, only for a single device without capture
+		bool threaded = false;
+	};
+
+	// the state of every scene after the last step, read in place from host mapped memory, the w of a position is the radius
+	// the contacts are only kept by the gauss-seidel solver, max_contacts slots per particle that index into positions
+	struct state_view {
+		const cl_float4* positions = nullptr;
+		const cl_float4* velocities = nullptr;
+		const cl_uint* ids = nullptr;
+		const cl_uint* contacts = nullptr;
+		const cl_uint* contact_counts = nullptr;
+		cl_uint num_particles = 0;
+		cl_uint max_contacts = 0;
+	};
+
+private:
+	configuration config;
+
+	GLFWwindow* window = nullptr;
+	// the render targets are the window padded up to the shade_tiles grid, the final blit copies the window out of their lower left
+	unsigned int width = 2560;
+	unsigned int height = 1536;
+	unsigned int window_width = 2560;
+	unsigned int window_height = 1536;
 	bool mouse_pressed = false;
+	// only touched by the simulation side, the window callbacks reach it through simulation_events
 	bool sim = false;
 	float mouse_x = 0;
 	float mouse_y = 0; 
@@ -21,20 +93,51 @@ class particle_system {
 	glm::vec3 center;
 	glm::vec3 up;
 
+	// the window callbacks run on the render thread and only queue what happened
+	struct input_event {
+		enum event_type {
+			SIMULATION,
+			ORBIT,
+			ZOOM
+		};
+		event_type type;
+		bool pressed;
+		double time;
+		float x_delta;
+		float y_delta;
+	};
+	particle::spsc_queue<input_event, 256> render_events;
+	particle::spsc_queue<input_event, 256> simulation_events;
+
+	// the first scene of a finished frame, copied out by the simulation thread for the render thread
+	struct simulation_state {
+		cl_mem positions;
+		cl_mem ids;
+		cl_mem bvh;
+	};
+	particle::triple_buffer<simulation_state> states;
+	std::atomic<bool> stopping{false};
+
 
 	//ogl
 	GLuint gl_framebuffer;
-	GLuint gl_position_texture;
-	GLuint gl_light_texture;
+	GLuint gl_color_texture;
+	GLuint gl_depth_texture;
+	GLuint gl_normal_texture;
 
 	GLuint gl_particle_program;
 	GLuint gl_particle_vao[2];
+	GLuint gl_particle_geometry;
 	GLuint gl_positions[2];
-	GLuint gl_particle_colors[2];
+	// the sorted buffers only carry the id of every particle, static attributes stay in id order and are looked up while rendering
+	GLuint gl_particle_ids[2];
+	GLuint gl_particle_colors;
+	GLuint gl_particle_color_texture;
 
 	GLuint gl_world_program;
 	GLuint gl_world_vao;
 	GLuint gl_world_positions;
+	GLuint gl_world_normals;
 
 
 
@@ -42,66 +145,204 @@ class particle_system {
 	cl_device_id device;
 	cl_context context;
 	cl_command_queue command_queue;
+	// the same queue unless threaded, then shade_tiles and the state handoff run on their own
+	cl_command_queue render_queue;
+	std::unique_ptr<device_memory> memory;
+
+	// without cl_khr_gl_sharing every shared object is a plain cl object copied to or from its gl counterpart on acquire and release
+	struct gl_mirror {
+		GLuint gl_object;
+		GLenum target;
+		GLenum gl_format;
+		GLenum gl_type;
+		size_t size;
+		bool to_cl;
+		bool to_gl;
+	};
+	bool gl_sharing;
+	std::map<cl_mem, gl_mirror> gl_mirrors;
+	// the simulation buffers of a threaded run are not shared, acquire and release skip whatever is not in here
+	std::set<cl_mem> gl_objects;
 
 	cl_program cl_particle_simulation_program;
 	cl_program cl_bitonic_program;
 	cl_program cl_bvh_program;
-	cl_program cl_cull_program;
+	cl_program cl_shade_program;
 
 	cl_kernel move_kernel;
-	cl_kernel resolve_collisions_kernel;
-	cl_kernel init_indices_kernel;
-	cl_kernel apply_indices_kernel;
-	cl_kernel bitonic_sort_kernel;
-	cl_kernel construct_bvh_kernel;
-	cl_kernel cull_lights_kernel;
-	cl_kernel calculate_aabb_kernel;
+	cl_kernel shade_tiles_kernel = nullptr;
 
-	size_t global_work_size;
-	size_t local_work_size;
+	bool command_buffers_supported = false;
+	particle::cl::command_buffer_functions command_buffer_functions;
+	std::vector<particle::cl::kernel_step> frame_steps[2];
+	cl_command_buffer_khr frame_command_buffers[2] = {nullptr, nullptr};
+	// frames that keep the particle order and reuse the neighbor lists
+	std::vector<particle::cl::kernel_step> reuse_steps[2];
+	cl_command_buffer_khr reuse_command_buffers[2] = {nullptr, nullptr};
+	bool rebuild_neighbor_lists = true;
+	cl_uint h_displacement[3] = {};	// since the lists were built and of the last step as float bits, and whether a list overflowed
+	int frame_parity = 0;
 
+	std::map<std::string, size_t> local_work_sizes;
+
+	// with more than one domain or tile the simulation runs there and the gathered particles are only rendered here
+	std::unique_ptr<domain_decomposition> domains;
+	std::unique_ptr<tile_streaming> tiles;
+	std::vector<particle::cl::kernel_step> render_steps;
+	std::unique_ptr<frame_capture> capture;
+
+	// only filled when the particles come from the host or the domain decomposition or tile streaming needs them there
 	std::vector<cl_float> h_particle_data;
+	std::vector<cl_float4> h_drawn_positions;
+	std::vector<cl_uint> h_drawn_ids;
+	particle::seed_distribution seed_distribution;
 	std::vector<cl_uint> h_level_sizes;
 	unsigned int num_particles;
+	// the first scene is the one drawn, of a tiled scene only the particles with the smallest ids
+	unsigned int scene_size;
 	unsigned int num_bvh_branch_nodes;
 	std::vector<std::pair<cl_uint, cl_uint>> bvh_levels;
 
 	std::vector<cl_float> h_world_positions;
+	std::vector<cl_float4> h_world_triangles;
 	unsigned int num_triangles;
 
-	cl_mem cl_world_depths;
-	cl_mem cl_culled_lights;
-	cl_mem cl_aabbs;
+	cl_mem cl_gbuffer_depths;
+	cl_mem cl_gbuffer_normals;
+	cl_mem cl_shaded_colors;
 	cl_mem cl_particle_positions[2];
 	cl_mem cl_particle_positions_old[2];
-	cl_mem cl_particle_colors[2];
+	cl_mem cl_particle_ids[2];
+	cl_mem cl_particle_colors;
+	cl_mem cl_rendered_positions = nullptr;
+	cl_mem cl_rendered_ids = nullptr;
 	cl_mem cl_particle_indices;
+	cl_mem cl_active_indices;
+	cl_mem cl_active_counts;
+	cl_mem cl_contacts = nullptr;
+	cl_mem cl_contact_counts = nullptr;
+	cl_mem cl_contact_colors = nullptr;
+	cl_mem cl_residuals;
+	cl_uint h_residuals[2] = {0, 0};
+	cl_mem cl_neighbor_references = nullptr;
+	cl_mem cl_neighbor_offsets = nullptr;
+	cl_mem cl_neighbor_counts = nullptr;
+	cl_mem cl_neighbors = nullptr;
+	cl_mem cl_neighbor_totals = nullptr;
+	cl_mem cl_displacement = nullptr;
+	cl_mem cl_statistics = nullptr;
+	// a threaded run counts the shaded tiles on the render queue in counters of their own
+	cl_mem cl_render_statistics = nullptr;
+	particle::cl::statistics h_statistics = {};
+	cl_uint statistics_frames = 0;
+	bool has_statistics = false;
+	cl_kernel physics_metrics_kernel = nullptr;
+	cl_mem cl_metric_sums = nullptr;
+	cl_mem cl_max_penetration = nullptr;
 	cl_mem cl_bvh;
 
-	cl_mem cl_world_positions;
+	// snapshots the device copies into while they are unmapped, they stay mapped for the host from the fence to the next export_state
+	enum view_buffer {
+		VIEW_POSITIONS,
+		VIEW_VELOCITIES,
+		VIEW_IDS,
+		VIEW_CONTACTS,
+		VIEW_CONTACT_COUNTS,
+		NUM_VIEW_BUFFERS
+	};
+	cl_kernel export_velocities_kernel = nullptr;
+	cl_mem cl_view_buffers[NUM_VIEW_BUFFERS] = {};
+	void* h_view_data[NUM_VIEW_BUFFERS] = {};
+	cl_event view_fence = nullptr;
+	cl_float last_time_delta = 0;
+
+	cl_mem cl_world_triangles;
+	cl_mem cl_world_distances = nullptr;
+	particle::cl::distance_field distance_field;
 	cl_mem cl_level_sizes;
 
 	cl_float time;
 
 	void init();
+	void init_window();
 	void init_gl();
 	void init_gl_particle();
 	void init_gl_world();
+	void allocate_gl_particles();
+	void allocate_gl_textures();
 	void init_cl();
+	void init_tile_streaming();
+	bool streams_tiles() const;
+	void size_scenes();
+	void release_cl();
+	void share_gbuffer();
+	void seed_particles();
+
+	cl_mem share_gl_buffer(std::string subsystem, GLuint gl_buffer, cl_mem_flags flags, size_t size);
+	cl_mem share_gl_texture(std::string subsystem, GLuint gl_texture, cl_mem_flags flags, cl_image_format format, GLenum gl_format, GLenum gl_type);
+	cl_int acquire_gl_objects(cl_command_queue queue, const std::vector<cl_mem>& cl_mem_objects);
+	cl_int release_gl_objects(cl_command_queue queue, const std::vector<cl_mem>& cl_mem_objects);
 
 	void prepass(const glm::mat4& projection, const glm::mat4& view);
 	void render(const glm::mat4& projection, const glm::mat4& view);
 	void simulate();
-	void cull_lights();
+	void simulate_domains();
+	void upload_gathered();
+	void simulation_loop();
+	void render_loop();
+	void publish_state();
+	void present_latest_state();
+	void apply_render_event(const input_event& event);
+	void apply_simulation_event(const input_event& event);
+	void print_simulation_report();
+	void create_shade_tiles_kernel();
+	cl_int enqueue_shade_tiles(cl_command_queue queue, const glm::mat4& projection, const glm::mat4& view, cl_event* event);
+	void shade_tiles(const glm::mat4& projection, const glm::mat4& view);
+
+	std::string get_profile_file_name();
+	void load_local_work_sizes();
+	void save_local_work_sizes();
+	void autotune(const glm::mat4& projection, const glm::mat4& view);
+	void report_scaling();
+
+	cl_kernel record_step(std::vector<particle::cl::kernel_step>& steps, cl_program program, const char* kernel_name, size_t work_items);
+	void record_frames();
+	void release_frames();
+	void grow_neighbor_lists();
+	cl_int replay_frame();
+	void swap_frame_buffers();
 
+	double get_time() const;
+	cl_float advance_time();
 	void move_particles();
-	void sort_particles();
-	void construct_bvh();
-	void resolve_particle_collisions();
+	void sort_particles(std::vector<particle::cl::kernel_step>& steps, bool keep_order = false);
+	void construct_bvh(std::vector<particle::cl::kernel_step>& steps);
+	void resolve_particle_collisions(std::vector<particle::cl::kernel_step>& steps, cl_uint parity, bool rebuild_neighbor_lists);
+	void resolve_neighbor_collisions(std::vector<particle::cl::kernel_step>& steps, cl_uint parity, bool rebuild_neighbor_lists);
+	void sweep_particle_collisions(std::vector<particle::cl::kernel_step>& steps, cl_uint parity);
+	void measure_residual(std::vector<particle::cl::kernel_step>& steps, cl_uint parity);
+	cl_int set_world_collider_args(cl_kernel kernel, cl_uint first_index);
+	cl_int set_statistics_arg(cl_kernel kernel, cl_mem statistics = nullptr);
+	particle::physics_metrics measure_physics();
+	void unmap_views();
 	
 public:
-	particle_system(size_t local_work_size, std::vector<cl_float> positions, std::vector<cl_float> radii);
+	particle_system(configuration config, const std::vector<cl_float>& positions, const std::vector<cl_float>& radii);
+	particle_system(configuration config, particle::seed_distribution distribution);
 	~particle_system();
 	void enter_main_loop();
+	// the counters of the last statistics_interval frames, false if the kernels were built without them
+	bool get_statistics(particle::cl::statistics* statistics) const;
+	// steps the simulation with the fixed time step and measures the physics after every step
+	particle::physics_trace run_headless(cl_uint num_steps);
+	// new particles and settings without a restart, the device, window and capture stay the ones the system was created with
+	void reconfigure(configuration config, particle::seed_distribution distribution);
+	void resize(unsigned int window_width, unsigned int window_height);
+	// for tools that embed the simulation instead of entering the main loop, configured with reconfigure and usually headless
+	void step(cl_uint num_steps = 1);
+	// enqueues the copies of the last step into the mapped views and returns the fence they are complete after, owned by the system
+	cl_event export_state();
+	// waits for the fence of the last export_state, the views stay valid until the next export_state or reconfigure
+	state_view sync();
 };
 
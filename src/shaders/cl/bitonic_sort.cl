@@ -1,21 +1,36 @@
+#ifndef SCENE_SIZE
+#define SCENE_SIZE 0
+#endif
+#define SCENE get_global_id(1)
 
 kernel void init_indices(global uint* indices, const uint num_particles) {
+	indices += SCENE * SCENE_SIZE;
 	uint GID = get_global_id(0);
 	if (GID >= num_particles) return;
 	indices[GID] = GID;
 }
 
-kernel void apply_indices(global const uint* indices, global const float4* positions_in, global float4* positions_out, global const float4* positions_old_in, global float4* positions_old_out, global const float* colors_in, global float* colors_out, const uint num_particles) {
+kernel void apply_indices(global const uint* indices, global const float4* positions_in, global float4* positions_out, global const float4* positions_old_in, global float4* positions_old_out, global const uint* ids_in, global uint* ids_out, const uint num_particles) {
+	indices += SCENE * SCENE_SIZE;
+	positions_in += SCENE * SCENE_SIZE;
+	positions_out += SCENE * SCENE_SIZE;
+	positions_old_in += SCENE * SCENE_SIZE;
+	positions_old_out += SCENE * SCENE_SIZE;
+	ids_in += SCENE * SCENE_SIZE;
+	ids_out += SCENE * SCENE_SIZE;
+
 	uint GID = get_global_id(0);
 	if (GID >= num_particles) return;
 
 	positions_out[GID] = positions_in[indices[GID]];
 	positions_old_out[GID] = positions_old_in[indices[GID]];
-	vstore3(vload3(indices[GID], colors_in), GID, colors_out);
+	ids_out[GID] = ids_in[indices[GID]];
 }
 
 
 kernel void bitonic_sort(global const float4* positions, global uint* indices, const uint num_particles,  const uint stride, const uint merge, const uint direction) {
+	positions += SCENE * SCENE_SIZE;
+	indices += SCENE * SCENE_SIZE;
 	uint GID = get_global_id(0);
 	
 	uint2 ids;
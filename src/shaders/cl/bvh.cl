@@ -1,6 +1,14 @@
 
 
+#ifndef SCENE_SIZE
+#define SCENE_SIZE 0
+#define SCENE_BVH_SIZE 0
+#endif
+#define SCENE get_global_id(1)
+
 kernel void construct_bvh(global float4* positions, global float4* bvh, const uint start_index, const uint end_index, const uint higher_start_index) {
+	positions += SCENE * SCENE_SIZE;
+	bvh += SCENE * SCENE_BVH_SIZE;
 	uint GID = get_global_id(0);
 	
 	float4 spheres[2];
@@ -0,0 +1,47 @@
+#define LEFT_HALO 0
+#define INTERIOR 1
+#define RIGHT_HALO 2
+#define LEFT_MIGRANT 3
+#define RIGHT_MIGRANT 4
+#define DROPPED 5
+#define NUM_BUCKETS 6
+
+#define PARKING_POSITION 1000000.f
+
+
+// ghosts and parked slots carry a negative w in their old position and are dropped, everything else is ordered by where it lies in the slab
+uint slab_bucket(float4 position, float4 position_old, float2 slab, float halo) {
+	if (position_old.w < 0) return DROPPED;
+	if (position.x < slab.x) return LEFT_MIGRANT;
+	if (position.x >= slab.y) return RIGHT_MIGRANT;
+	if (position.x < slab.x + halo) return LEFT_HALO;
+	if (position.x >= slab.y - halo) return RIGHT_HALO;
+	return INTERIOR;
+}
+
+kernel void count_slab_buckets(global const float4* positions, global const float4* positions_old, volatile global uint* counters, const uint num_particles, const float2 slab, const float halo) {
+	uint GID = get_global_id(0);
+	if (GID >= num_particles) return;
+	atomic_inc(&counters[slab_bucket(positions[GID], positions_old[GID], slab, halo)]);
+}
+
+// writes a permutation for apply_indices, the second half of counters are the fill cursors of the buckets
+kernel void scatter_slab_buckets(global const float4* positions, global const float4* positions_old, volatile global uint* counters, global uint* indices, const uint num_particles, const float2 slab, const float halo) {
+	uint GID = get_global_id(0);
+	if (GID >= num_particles) return;
+	uint bucket = slab_bucket(positions[GID], positions_old[GID], slab, halo);
+	uint offset = 0;
+	for (uint i = 0; i < bucket; i++) {
+		offset += counters[i];
+	}
+	indices[offset + atomic_inc(&counters[NUM_BUCKETS + bucket])] = GID;
+}
+
+// unused slots are spread out far away so they neither collide nor degenerate the bounding spheres of the bvh
+kernel void park_particles(global float4* positions, global float4* positions_old, const uint first_index, const uint num_particles) {
+	uint GID = get_global_id(0) + first_index;
+	if (GID >= num_particles) return;
+	float4 parking_position = (float4) (PARKING_POSITION + 4 * GID, PARKING_POSITION, PARKING_POSITION, 0);
+	positions[GID] = parking_position;
+	positions_old[GID] = (float4) (parking_position.xyz, -1);
+}
@@ -1,23 +1,66 @@
 
 #define EPSILON 0.000001f
 
+// in ensemble mode the second work dimension selects one of several independent scenes laid out one after the other
+#ifndef SCENE_SIZE
+#define SCENE_SIZE 0
+#define SCENE_BVH_SIZE 0
+#endif
+#define SCENE get_global_id(1)
+
+#ifdef STATISTICS
+#include "statistics.cl"
+#else
+#define STATISTICS_ARGUMENT
+#endif
+
+#define SLEEP_VELOCITY 0.1f
+#define SLEEP_FRAMES 30
+#define WAKE_DEPTH 0.01f
+
+// the simulation never reads the w of old positions, it counts the frames a particle has been resting
+// domain decomposition flags ghosts by storing it negated and offset by one
+float rest_frames(float w) {
+	return w < 0 ? -w - 1 : w;
+}
+
+float with_rest_frames(float w, float frames) {
+	return w < 0 ? -frames - 1 : frames;
+}
+
 kernel void move(global float4* positions_old, global float4* positions, const uint num_particles, const float time_delta_old, const float time_delta) {
 	uint GID = get_global_id(0);
 	if (GID >= num_particles || time_delta_old == 0) return;
 	float4 particle = positions[GID];
+	float4 particle_old = positions_old[GID];
 
 	float3 x0 = particle.xyz;
-	float3 v0 = (x0 - positions_old[GID].xyz) / time_delta_old;
+	float3 v0 = (x0 - particle_old.xyz) / time_delta_old;
 	float3 a = (float3) (0, -9.81f, 0);
 
+	// a sleeping particle keeps its position until a contact in resolve_collisions resets its count
+	float frames = length(v0) < SLEEP_VELOCITY ? min(rest_frames(particle_old.w) + 1, (float) SLEEP_FRAMES) : 0;
+	if (frames >= SLEEP_FRAMES) {
+		positions_old[GID] = (float4) (x0, with_rest_frames(particle_old.w, frames));
+		return;
+	}
+
 	float3 x1 = x0 + time_delta * v0 + pow(time_delta, 2) * a / 2.f;
 
 	x1.y = max(x1.y, 0.f);
 
-	positions_old[GID] = (float4) (x0, particle.w);
+	positions_old[GID] = (float4) (x0, with_rest_frames(particle_old.w, frames));
 	positions[GID] = (float4) (x1, particle.w);
 }
 
+// verlet integration keeps no velocities, exported ones are the displacement of the last step over its duration
+kernel void export_velocities(global const float4* positions, global const float4* positions_old, global float4* velocities, const float time_delta, const uint num_particles) {
+	uint GID = get_global_id(0);
+	if (GID >= num_particles) return;
+	float3 velocity = time_delta > 0 ? (positions[GID].xyz - positions_old[GID].xyz) / time_delta : (float3) (0);
+	velocities[GID] = (float4) (velocity, 0);
+}
+
 bool line_triangle_intersection(float3 x0, float3 x1, float3 v1, float3 v2, float3 v3, float3* n) {
 
 	float3 dir = x1 - x0;
@@ -99,51 +142,43 @@ particle init_particle(float4 position, float4 position_old) {
 	return (particle) {position_old.xyz, position.xyz, position.xyz - position_old.xyz, position.w};
 }
 
+// one entry of the triangle table built by particle::create_triangle_table
 typedef struct triangle {
-	float3 corners[3];
-	float3 n;
-	float hesse_distance;
-	float3 edges[3];
+	float4 corner;		// w: hesse distance
+	float4 edges[3];	// w: dot products of the first and the negated last edge
+	float4 normal;		// w: inverse barycentric denominator
 } triangle;
 
-triangle init_triangle(float3 v1, float3 v2, float3 v3) {
-	float3 n = normalize(cross(v2 - v1, v3 - v1));
-	return (triangle) {{v1, v2, v3}, n, dot(v1, n), {v2 - v1, v3 - v2, v1 - v3}};
-}
-
-bool vertex_triangle_intersection(float3 v, triangle t) {
-	float b1, b2, b3;
-	float3 v0 = t.corners[1] - t.corners[0];
-	float3 v1 = t.corners[2] - t.corners[0];
-	float3 v2 = v - t.corners[0];
-	float d00 = dot(v0, v0);
-	float d01 = dot(v0, v1);
-	float d11 = dot(v1, v1);
-	float d20 = dot(v2, v0);
-	float d21 = dot(v2, v1);
-	float denom = d00 * d11 - d01 * d01;
-	b1 = (d11 * d20 - d01 * d21) / denom;
-	b2 = (d00 * d21 - d01 * d20) / denom;
-	b3 = 1.f - (b1 + b2);
-	return b1 >= 0 && b2 >= 0 && b3 >= 0;
+float3 triangle_corner(const triangle* t, int i) {
+	return i == 0 ? t->corner.xyz : i == 1 ? t->corner.xyz + t->edges[0].xyz : t->corner.xyz - t->edges[2].xyz;
 }
 
+bool vertex_triangle_intersection(float3 v, const triangle* t) {
+	float3 difference = v - t->corner.xyz;
+	float d20 = dot(difference, t->edges[0].xyz);
+	float d21 = -dot(difference, t->edges[2].xyz);
+	float b1 = (t->edges[2].w * d20 - t->edges[1].w * d21) * t->normal.w;
+	float b2 = (t->edges[0].w * d21 - t->edges[1].w * d20) * t->normal.w;
+	float b3 = 1.f - (b1 + b2);
+	return b1 >= 0 && b2 >= 0 && b3 >= 0;
+}
 
-bool swept_sphere_triangle_intersection(particle p_world, triangle t_world, float3* n) {
 
-	particle p = init_particle((float4) (p_world.position_new / p_world.radius, 1), (float4) (p_world.position_old / p_world.radius, 1));
-	triangle t = init_triangle(t_world.corners[0] / p_world.radius, t_world.corners[1] / p_world.radius, t_world.corners[2] / p_world.radius);
-	float distance_old = dot(t.n, p.position_old) - t.hesse_distance;
-	float speed_in_direction = dot(t.n, p.velocity);
+// solved in world units, the quadratics below are the unit sphere ones multiplied through by powers of the radius
+bool swept_sphere_triangle_intersection(particle p, const triangle* t, float3* n) {
+	float radius_squared = p.radius * p.radius;
+	float3 normal = t->normal.xyz;
+	float distance_old = dot(normal, p.position_old) - t->corner.w;
+	float speed_in_direction = dot(normal, p.velocity);
 	if (speed_in_direction != 0) {
-		float t0 = (1 - distance_old) / speed_in_direction;
-		float t1 = -(1 + distance_old) / speed_in_direction;
+		float t0 = (p.radius - distance_old) / speed_in_direction;
+		float t1 = -(p.radius + distance_old) / speed_in_direction;
 		if ((t0 < 0 || t0 > 1) && (t1 < 0 || t1 > 1)) return false;
-		if (vertex_triangle_intersection(p.position_old - t.n + t0 * p.velocity , t)) {
-			*n = t.n;
+		if (vertex_triangle_intersection(p.position_old - p.radius * normal + t0 * p.velocity, t)) {
+			*n = normal;
 			return true; 
 		}
-	} else if (fabs(distance_old) > 1) {
+	} else if (fabs(distance_old) > p.radius) {
 		return false;
 	}
 
@@ -151,11 +186,12 @@ bool swept_sphere_triangle_intersection(particle p_world, triangle t_world, floa
 	float3 intersection_position;
 	float t_intersection = -1;
 	for (int i = 0; i < 3; i++) {
-		float3 particle_to_corner = t.corners[i] - p.position_old;
+		float3 corner = triangle_corner(t, i);
+		float3 particle_to_corner = corner - p.position_old;
 
 		float a = dot(p.velocity, p.velocity);
 		float b = 2 * dot(p.velocity, (-particle_to_corner));
-		float c = pow(length(particle_to_corner), 2)  - 1;
+		float c = dot(particle_to_corner, particle_to_corner) - radius_squared;
 
 		float radicand = pow(b, 2) - 4 * a * c;
 		if (radicand < 0) break;
@@ -180,22 +216,24 @@ bool swept_sphere_triangle_intersection(particle p_world, triangle t_world, floa
 
 		if (t_intersection == -1 || t1 < t_intersection) {
 			t_intersection = t1;
-			intersection_position = t.corners[i];
+			intersection_position = corner;
 			*n = normalize((p.position_old + t1 * p.velocity) - intersection_position);
 		}
 	}
 	
 	// test against edges
-	float velocity_length_squared = pow(length(p.velocity), 2);
+	float velocity_length_squared = dot(p.velocity, p.velocity);
 	for (int i = 0; i < 3; i++) {
-		float3 particle_to_start = t.corners[i] - p.position_old;
-		float edge_length_squared = pow(length(t.edges[i]), 2);
-		float edge_dot_velocity = dot(t.edges[i], p.velocity);
-		float edge_dot_particle_to_start = dot(t.edges[i], particle_to_start);
+		float3 corner = triangle_corner(t, i);
+		float3 edge = t->edges[i].xyz;
+		float3 particle_to_start = corner - p.position_old;
+		float edge_length_squared = dot(edge, edge);
+		float edge_dot_velocity = dot(edge, p.velocity);
+		float edge_dot_particle_to_start = dot(edge, particle_to_start);
 
 		float a = edge_length_squared * -velocity_length_squared + pow(edge_dot_velocity, 2);
 		float b = edge_length_squared * 2 * dot(p.velocity, particle_to_start) - 2 * ((edge_dot_velocity) * (edge_dot_particle_to_start));
-		float c = edge_length_squared * (1 - pow(length(particle_to_start), 2)) + pow(edge_dot_particle_to_start, 2);
+		float c = edge_length_squared * (radius_squared - dot(particle_to_start, particle_to_start)) + pow(edge_dot_particle_to_start, 2);
 
 		float radicand = pow(b, 2) - 4 * a * c;
 		if (radicand < 0) break;
@@ -221,7 +259,7 @@ bool swept_sphere_triangle_intersection(particle p_world, triangle t_world, floa
 			float f = (edge_dot_velocity * t1 - edge_dot_particle_to_start) / edge_length_squared;
 			if (f >= 0 && f <= 1) {
 				t_intersection = t1;
-				intersection_position = t.corners[i] + f * t.edges[i];
+				intersection_position = corner + f * edge;
 				*n = normalize((p.position_old + t1 * p.velocity) - intersection_position);
 			}
 		}
@@ -231,25 +269,142 @@ bool swept_sphere_triangle_intersection(particle p_world, triangle t_world, floa
 }
 
 
-#define STACK_SIZE (uint) 256
-kernel void resolve_collisions(global float4* positions_in, global float4* positions_out, global const float4* positions_old, global const float4* bvh, const uint bvh_size, global const float* world_triangles, const uint num_triangles) {
+float3 closest_point_on_triangle(float3 p, const triangle* t) {
+	float3 a = triangle_corner(t, 0);
+	float3 ab = t->edges[0].xyz;
+	float3 ac = -t->edges[2].xyz;
+	float3 ap = p - a;
+	float d1 = dot(ab, ap);
+	float d2 = dot(ac, ap);
+	if (d1 <= 0 && d2 <= 0) return a;
+
+	float3 bp = ap - ab;
+	float d3 = dot(ab, bp);
+	float d4 = dot(ac, bp);
+	if (d3 >= 0 && d4 <= d3) return a + ab;
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + d1 / (d1 - d3) * ab;
+
+	float3 cp = ap - ac;
+	float d5 = dot(ab, cp);
+	float d6 = dot(ac, cp);
+	if (d6 >= 0 && d5 <= d6) return a + ac;
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + d2 / (d2 - d6) * ac;
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) return a + ab + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * t->edges[1].xyz;
+
+	float denominator = 1 / (va + vb + vc);
+	return a + ab * vb * denominator + ac * vc * denominator;
+}
+
+float solid_angle(float3 p, const triangle* t) {
+	float3 a = triangle_corner(t, 0) - p;
+	float3 b = triangle_corner(t, 1) - p;
+	float3 c = triangle_corner(t, 2) - p;
+	float la = length(a);
+	float lb = length(b);
+	float lc = length(c);
+	return 2 * atan2(dot(a, cross(b, c)), la * lb * lc + dot(a, b) * lc + dot(a, c) * lb + dot(b, c) * la);
+}
+
+// one work item per cell center, the sign comes from the generalized winding number so overlapping boxes stay inside
+kernel void bake_distance_field(global const triangle* world_triangles, const uint num_triangles, const float4 origin, const uint4 dimensions, global float* distances) {
 	uint GID = get_global_id(0);
-	if (GID > bvh_size) return;
+	if (GID >= dimensions.x * dimensions.y * dimensions.z) return;
+	uint3 cell = (uint3) (GID % dimensions.x, (GID / dimensions.x) % dimensions.y, GID / (dimensions.x * dimensions.y));
+	float3 p = origin.xyz + (convert_float3(cell) + 0.5f) * origin.w;
+
+	float distance_squared = INFINITY;
+	float winding_number = 0;
+	for (uint i = 0; i < num_triangles; i++) {
+		triangle t = world_triangles[i];
+		float3 difference = p - closest_point_on_triangle(p, &t);
+		distance_squared = min(distance_squared, dot(difference, difference));
+		winding_number += solid_angle(p, &t);
+	}
+	winding_number /= 4 * M_PI_F;
+	distances[GID] = (fabs(winding_number) > 0.5f ? -1 : 1) * sqrt(distance_squared);
+}
 
-	particle p = init_particle(positions_in[GID], positions_old[GID]);
+#ifdef DISTANCE_FIELD
+// texel coordinates of the sample centers are offset by half a cell, which linear filtering expects
+float world_distance(read_only image3d_t world_distances, float4 origin, float3 p) {
+	const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+	return read_imagef(world_distances, sampler, (float4) ((p - origin.xyz) / origin.w, 0)).x;
+}
 
-	float3 correction_particles = (float3) (0);
-	float max_length = 0;
-	
+// central differences, left unnormalized since they cancel to zero in slabs thinner than two cells
+float3 world_gradient(read_only image3d_t world_distances, float4 origin, float3 p) {
+	float h = origin.w;
+	return (float3) (
+		world_distance(world_distances, origin, p + (float3) (h, 0, 0)) - world_distance(world_distances, origin, p - (float3) (h, 0, 0)),
+		world_distance(world_distances, origin, p + (float3) (0, h, 0)) - world_distance(world_distances, origin, p - (float3) (0, h, 0)),
+		world_distance(world_distances, origin, p + (float3) (0, 0, h)) - world_distance(world_distances, origin, p - (float3) (0, 0, h)));
+}
+#endif
+
+
+// runs after the sort, sleeping particles are copied into the second ping-pong buffer once instead of being resolved every iteration
+// every frame parity has its own counter and clears the one of the next frame
+kernel void compact_active(global const float4* positions, global float4* positions_out, global const float4* positions_old, global uint* active_indices, volatile global uint* active_counts, const uint parity, const uint num_particles) {
+	positions += SCENE * SCENE_SIZE;
+	positions_out += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	active_indices += SCENE * SCENE_SIZE;
+	active_counts += 2 * SCENE;
+
+	uint GID = get_global_id(0);
+	if (GID == 0) active_counts[1 - parity] = 0;
+	if (GID >= num_particles) return;
+	if (rest_frames(positions_old[GID].w) >= SLEEP_FRAMES) {
+		positions_out[GID] = positions[GID];
+	} else {
+		active_indices[atomic_inc(&active_counts[parity])] = GID;
+	}
+}
+
+
+#define STACK_SIZE (uint) 256
+
+// filled by every traversal, only recorded by kernels built with STATISTICS
+typedef struct {
+	uint nodes_visited;
+	bool stack_overflow;
+	bool leaf_overflow;
+} traversal;
+
+#ifdef STATISTICS
+void record_traversal(volatile global statistics* stats, const traversal* t, uint leaves) {
+	atom_inc(&stats->traversals);
+	atom_add(&stats->nodes_visited, t->nodes_visited);
+	atom_add(&stats->leaves_tested, leaves);
+	atom_inc(&stats->nodes_visited_histogram[log2_bin(t->nodes_visited)]);
+	if (t->stack_overflow) atom_inc(&stats->stack_overflows);
+	if (t->leaf_overflow) atom_inc(&stats->leaf_overflows);
+}
+
+void record_contacts(volatile global statistics* stats, uint contacts) {
+	atom_add(&stats->contacts, contacts);
+	atom_inc(&stats->contacts_histogram[linear_bin(contacts, 1)]);
+}
+#endif
+
+// gathers the leaves of every bvh sphere the particle overlaps, shrinks the radius of particles whose candidates do not fit
+uint collect_leaves(float3 position, float* radius, global const float4* bvh, const uint bvh_size, uint* leave_array, traversal* t) {
 	uint branch_stack[STACK_SIZE] = {1, 2};
 	uint branch_stack_counter = 2;
-	uint leave_array[STACK_SIZE];
 	uint leave_array_counter = 0;
+	*t = (traversal) {0, false, false};
 	
 	while (branch_stack_counter > 0 && leave_array_counter < STACK_SIZE) {
 		branch_stack_counter--;
+		t->nodes_visited++;
 		float4 sphere = bvh[branch_stack[branch_stack_counter]];
-		if(distance(p.position_new, sphere.xyz) < p.radius + sphere.w) {
+		if(distance(position, sphere.xyz) < *radius + sphere.w) {
 			uint current_index = branch_stack[branch_stack_counter];
 			if (2 * current_index + 1 < bvh_size) {
 				branch_stack[branch_stack_counter] = 2 * current_index + 1;
@@ -263,22 +418,96 @@ kernel void resolve_collisions(global float4* positions_in, global float4* posit
 			}
 		}
 		if(branch_stack_counter == STACK_SIZE - 1) {
-			p.radius = 0.5;
+			*radius = 0.5;
+			t->stack_overflow = true;
 		}
 	}
 	if (leave_array_counter == STACK_SIZE) {
-		p.radius = 0.5;
+		*radius = 0.5;
+		t->leaf_overflow = true;
 	}
+	return leave_array_counter;
+}
+
+float penetration(particle* p, float4 other) {
+	return p->radius + other.w - distance(p->position_new, other.xyz);
+}
+
+// half of the overlap with another particle, sleeping particles are not resolved and only contacts deeper than the sag of one frame of gravity wake them
+float3 contact_correction(particle* p, float4 other, global float4* positions_old, uint other_index) {
+	float3 difference = p->position_new - other.xyz;
+	if (length(difference) + EPSILON >= p->radius + other.w) return (float3) (0);
+
+	float other_w = positions_old[other_index].w;
+	if (penetration(p, other) > WAKE_DEPTH && rest_frames(other_w) >= SLEEP_FRAMES) {
+		positions_old[other_index].w = with_rest_frames(other_w, 0);
+	}
+	return (p->radius + other.w - length(difference)) / 2.0f * normalize(difference);
+}
+
+void correct_particle_contacts(particle* p, float3 correction_particles) {
+	correct_position_new(p, length(correction_particles) > p->radius - EPSILON ? (float3) (p->radius - EPSILON) * normalize(correction_particles) : correction_particles);
+}
+
+#ifdef DISTANCE_FIELD
+void collide_world(particle* p, read_only image3d_t world_distances, float4 distance_field_origin) {
+	float distance = world_distance(world_distances, distance_field_origin, p->position_new);
+	if (distance >= p->radius) return;
+	// without a gradient there is no direction to push along, the correction is skipped rather than made nan
+	float3 gradient = world_gradient(world_distances, distance_field_origin, p->position_new);
+	if (length(gradient) < EPSILON) return;
+	correct_position_new(p, (p->radius - distance) * normalize(gradient));
+}
+#else
+void collide_world(particle* p, global const triangle* world_triangles, const uint num_triangles) {
+	for (uint i = 0; i < num_triangles; i++) {
+		float3 n;
+		triangle t = world_triangles[i];
+		if (swept_sphere_triangle_intersection(*p, &t, &n)) {
+			correct_position_new(p, -((dot(n, p->velocity) - EPSILON) * n)); // nicht riichtig! wie weit muss man wirklich von der oberflche weg?! -> intersection point ...
+		}
+	}
+}
+#endif
+
+#ifdef DISTANCE_FIELD
+kernel void resolve_collisions(global float4* positions_in, global float4* positions_out, global float4* positions_old, global const float4* bvh, const uint bvh_size, global const triangle* world_triangles, const uint num_triangles, global const uint* active_indices, global const uint* active_counts, const uint parity, read_only image3d_t world_distances, const float4 distance_field_origin STATISTICS_ARGUMENT) {
+#else
+kernel void resolve_collisions(global float4* positions_in, global float4* positions_out, global float4* positions_old, global const float4* bvh, const uint bvh_size, global const triangle* world_triangles, const uint num_triangles, global const uint* active_indices, global const uint* active_counts, const uint parity STATISTICS_ARGUMENT) {
+#endif
+	positions_in += SCENE * SCENE_SIZE;
+	positions_out += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	bvh += SCENE * SCENE_BVH_SIZE;
+	active_indices += SCENE * SCENE_SIZE;
+	active_counts += 2 * SCENE;
+
+	if (get_global_id(0) >= active_counts[parity]) return;
+	uint GID = active_indices[get_global_id(0)];
+	if (GID > bvh_size) return;
+
+	particle p = init_particle(positions_in[GID], positions_old[GID]);
+
+	float3 correction_particles = (float3) (0);
+	float max_length = 0;
 	
+	uint leave_array[STACK_SIZE];
+	traversal t;
+	uint leave_array_counter = collect_leaves(p.position_new, &p.radius, bvh, bvh_size, leave_array, &t);
+	
+	uint contacts = 0;
 	for (int i = 0; i < leave_array_counter; i++) {
-		float4 collision_particle = positions_in[leave_array[i]];
-		float3 difference = p.position_new - collision_particle.xyz;
-		if ((length(difference) + EPSILON < p.radius + collision_particle.w) && (leave_array[i] != GID)) {
-			float3 correction = (p.radius + collision_particle.w - length(difference)) / 2.0f * normalize(difference);
+		if (leave_array[i] != GID) {
+			float3 correction = contact_correction(&p, positions_in[leave_array[i]], positions_old, leave_array[i]);
 			correction_particles += correction;
 			max_length = max(max_length, length(correction));
+			contacts += any(correction != (float3) (0));
 		}
 	}
+#ifdef STATISTICS
+	record_traversal(stats, &t, leave_array_counter);
+	record_contacts(stats, contacts);
+#endif
 	
 	/*
 	for (int i = 0; i <= bvh_size; i++) {
@@ -299,22 +528,379 @@ kernel void resolve_collisions(global float4* positions_in, global float4* posit
 		float3 velocity_correction_ortho = (1 - theta_correction) * (p.velocity - velocity_correction);
 		//velocity = 0.5 * velocity_correction + 0.999 * velocity_correction_ortho;
 	}
-	correct_position_new(&p, length(correction_particles) > p.radius - EPSILON ? (float3) (p.radius - EPSILON) * normalize(correction_particles) : correction_particles);
+	correct_particle_contacts(&p, correction_particles);
 
 
 	
 
 	// world collisions
-	for (int i = 0; i < 3 * num_triangles; i += 3) {
-		float3 n;
-		if (swept_sphere_triangle_intersection(p, init_triangle(vload3(i, world_triangles), vload3(i + 1, world_triangles), vload3(i + 2, world_triangles)), &n)) {
-			correct_position_new(&p, -((dot(n, p.velocity) - EPSILON) * n)); // nicht riichtig! wie weit muss man wirklich von der oberflche weg?! -> intersection point ...
+#ifdef DISTANCE_FIELD
+	collide_world(&p, world_distances, distance_field_origin);
+#else
+	collide_world(&p, world_triangles, num_triangles);
+#endif
+
+	positions_out[GID] = (float4) (p.position_new, p.radius);
+}
+
+
+// verlet neighbor lists: candidates within the skin are gathered on rebuild frames and reused until a particle has moved half the skin
+// the capacity is an argument, the host grows the buffer without rebuilding the program
+
+// every particle reserves a compact row of the neighbor buffer, rows that do not fit any more are cut short
+// and the third displacement is flagged, so the host grows the buffer and rebuilds the lists in the next frame
+kernel void build_neighbor_lists(global const float4* positions, global const float4* bvh, const uint bvh_size, global float4* neighbor_references, global uint* neighbor_offsets, global uint* neighbor_counts, global uint* neighbors, volatile global uint* neighbor_totals, global uint* displacement, const float skin, const uint num_particles, const uint neighbor_capacity STATISTICS_ARGUMENT) {
+	positions += SCENE * SCENE_SIZE;
+	bvh += SCENE * SCENE_BVH_SIZE;
+	neighbor_references += SCENE * SCENE_SIZE;
+	neighbor_offsets += SCENE * SCENE_SIZE;
+	neighbor_counts += SCENE * SCENE_SIZE;
+	neighbors += SCENE * SCENE_SIZE * neighbor_capacity;
+	neighbor_totals += SCENE;
+
+	uint GID = get_global_id(0);
+	if (GID == 0) *displacement = 0;
+	if (GID >= num_particles) return;
+
+	float4 position = positions[GID];
+	neighbor_references[GID] = position;
+	float radius = position.w + skin;
+	uint leave_array[STACK_SIZE];
+	traversal t;
+	uint leave_array_counter = collect_leaves(position.xyz, &radius, bvh, bvh_size, leave_array, &t);
+
+	uint count = 0;
+	for (uint i = 0; i < leave_array_counter; i++) {
+		uint candidate = leave_array[i];
+		if (candidate != GID && candidate < num_particles && distance(position.xyz, positions[candidate].xyz) < position.w + positions[candidate].w + skin) {
+			leave_array[count++] = candidate;
 		}
 	}
 
+	uint capacity = num_particles * neighbor_capacity;
+	uint offset = atomic_add(neighbor_totals, count);
+	if (offset + count > capacity) displacement[2] = 1;
+#ifdef STATISTICS
+	record_traversal(stats, &t, leave_array_counter);
+	if (offset + count > capacity) atom_inc(&stats->neighbor_overflows);
+#endif
+	count = offset >= capacity ? 0 : min(count, capacity - offset);
+	neighbor_offsets[GID] = offset;
+	neighbor_counts[GID] = count;
+	for (uint i = 0; i < count; i++) {
+		neighbors[offset + i] = leave_array[i];
+	}
+}
+
+// resolve_collisions with the bvh traversal replaced by the neighbor list
+#ifdef DISTANCE_FIELD
+kernel void resolve_neighbors(global float4* positions_in, global float4* positions_out, global float4* positions_old, global const uint* neighbor_offsets, global const uint* neighbor_counts, global const uint* neighbors, const uint neighbor_capacity, global const triangle* world_triangles, const uint num_triangles, global const uint* active_indices, global const uint* active_counts, const uint parity, read_only image3d_t world_distances, const float4 distance_field_origin STATISTICS_ARGUMENT) {
+#else
+kernel void resolve_neighbors(global float4* positions_in, global float4* positions_out, global float4* positions_old, global const uint* neighbor_offsets, global const uint* neighbor_counts, global const uint* neighbors, const uint neighbor_capacity, global const triangle* world_triangles, const uint num_triangles, global const uint* active_indices, global const uint* active_counts, const uint parity STATISTICS_ARGUMENT) {
+#endif
+	positions_in += SCENE * SCENE_SIZE;
+	positions_out += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	neighbor_offsets += SCENE * SCENE_SIZE;
+	neighbor_counts += SCENE * SCENE_SIZE;
+	neighbors += SCENE * SCENE_SIZE * neighbor_capacity;
+	active_indices += SCENE * SCENE_SIZE;
+	active_counts += 2 * SCENE;
+
+	if (get_global_id(0) >= active_counts[parity]) return;
+	uint GID = active_indices[get_global_id(0)];
+
+	particle p = init_particle(positions_in[GID], positions_old[GID]);
+
+	float3 correction_particles = (float3) (0);
+	uint contacts = 0;
+	for (uint i = 0; i < neighbor_counts[GID]; i++) {
+		uint neighbor = neighbors[neighbor_offsets[GID] + i];
+		float3 correction = contact_correction(&p, positions_in[neighbor], positions_old, neighbor);
+		correction_particles += correction;
+		contacts += any(correction != (float3) (0));
+	}
+#ifdef STATISTICS
+	record_contacts(stats, contacts);
+#endif
+	correct_particle_contacts(&p, correction_particles);
+
+#ifdef DISTANCE_FIELD
+	collide_world(&p, world_distances, distance_field_origin);
+#else
+	collide_world(&p, world_triangles, num_triangles);
+#endif
+
 	positions_out[GID] = (float4) (p.position_new, p.radius);
 }
 
+// the largest distance of any particle from where the lists were built, as float bits, which order like the floats for positive values
+// also empties the neighbor buffer for the next rebuild, which may come in the next frame
+// the second displacement is the largest of this step, from which the host bounds how far the next move can carry a particle
+kernel void max_displacement(global const float4* positions, global const float4* positions_old, global const float4* neighbor_references, volatile global uint* displacement, global uint* neighbor_totals, const uint num_particles) {
+	positions += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	neighbor_references += SCENE * SCENE_SIZE;
+	neighbor_totals += SCENE;
+
+	uint GID = get_global_id(0);
+	if (GID == 0) *neighbor_totals = 0;
+	if (GID >= num_particles) return;
+	atomic_max(displacement, as_uint(distance(positions[GID].xyz, neighbor_references[GID].xyz)));
+	atomic_max(displacement + 1, as_uint(distance(positions[GID].xyz, positions_old[GID].xyz)));
+}
+
+
+// the gauss-seidel solver resolves the contacts found once per frame in place, one color of independent particles at a time
+#ifndef MAX_CONTACTS
+#define MAX_CONTACTS 16
+#endif
+#ifndef MAX_COLORS
+#define MAX_COLORS 16
+#endif
+#define UNCOLORED (uint) 0xffffffff
+// candidates are gathered with a slightly larger radius so contacts opened by the corrections of the same frame are still seen
+#define CONTACT_SKIN 0.1f
+
+kernel void build_contacts(global const float4* positions, global const float4* bvh, const uint bvh_size, global uint* contacts, global uint* contact_counts, global uint* colors, global const uint* active_indices, global const uint* active_counts, const uint parity STATISTICS_ARGUMENT) {
+	positions += SCENE * SCENE_SIZE;
+	bvh += SCENE * SCENE_BVH_SIZE;
+	contacts += SCENE * SCENE_SIZE * MAX_CONTACTS;
+	contact_counts += SCENE * SCENE_SIZE;
+	colors += SCENE * SCENE_SIZE;
+	active_indices += SCENE * SCENE_SIZE;
+	active_counts += 2 * SCENE;
+
+	if (get_global_id(0) >= active_counts[parity]) return;
+	uint GID = active_indices[get_global_id(0)];
+	if (GID > bvh_size) return;
+
+	float4 position = positions[GID];
+	float radius = (1 + CONTACT_SKIN) * position.w;
+	uint leave_array[STACK_SIZE];
+	traversal t;
+	uint leave_array_counter = collect_leaves(position.xyz, &radius, bvh, bvh_size, leave_array, &t);
+
+	uint contact_counter = 0;
+	bool truncated = t.stack_overflow || t.leaf_overflow;
+	for (uint i = 0; i < leave_array_counter; i++) {
+		float4 other = positions[leave_array[i]];
+		if (leave_array[i] != GID && distance(position.xyz, other.xyz) < radius + (1 + CONTACT_SKIN) * other.w) {
+			if (contact_counter == MAX_CONTACTS) {
+				truncated = true;
+				break;
+			}
+			contacts[GID * MAX_CONTACTS + contact_counter++] = leave_array[i];
+		}
+	}
+	contact_counts[GID] = contact_counter;
+	// a cut short list may miss a contact that lists this particle, so the pair could share a color and race
+	// such particles skip the coloring and go straight to the leftovers, which are swept jacobi style
+	colors[GID] = truncated ? MAX_COLORS : UNCOLORED;
+#ifdef STATISTICS
+	record_traversal(stats, &t, leave_array_counter);
+	record_contacts(stats, contact_counter);
+	if (truncated) atom_inc(&stats->contact_overflows);
+#endif
+}
+
+uint hash(uint x) {
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	return (x >> 16) ^ x;
+}
+
+bool precedes(uint a, uint b) {
+	return hash(a) > hash(b) || (hash(a) == hash(b) && a > b);
+}
+
+// one jones-plassmann round: every uncolored particle that precedes its uncolored awake contacts takes the smallest color they do not use
+// neighbors colored in the same round are never adjacent, reading one of them stale only delays a particle to the next round
+kernel void color_contacts(global const uint* contacts, global const uint* contact_counts, global uint* colors, global const float4* positions_old, global const uint* active_indices, global const uint* active_counts, const uint parity) {
+	contacts += SCENE * SCENE_SIZE * MAX_CONTACTS;
+	contact_counts += SCENE * SCENE_SIZE;
+	colors += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	active_indices += SCENE * SCENE_SIZE;
+	active_counts += 2 * SCENE;
+
+	if (get_global_id(0) >= active_counts[parity]) return;
+	uint GID = active_indices[get_global_id(0)];
+	if (GID >= SCENE_SIZE || colors[GID] != UNCOLORED) return;
+
+	uint used_colors = 0;
+	for (uint i = 0; i < contact_counts[GID]; i++) {
+		uint contact = contacts[GID * MAX_CONTACTS + i];
+		if (rest_frames(positions_old[contact].w) >= SLEEP_FRAMES) continue;
+		uint color = colors[contact];
+		if (color == UNCOLORED) {
+			if (precedes(contact, GID)) return;
+		} else if (color < 32) {
+			used_colors |= 1u << color;
+		}
+	}
+	// whatever is left over after MAX_COLORS colors shares the last sweep
+	colors[GID] = min(31 - clz(~used_colors & (used_colors + 1)), MAX_COLORS);
+}
+
+// the colors are swept in place with positions_out being positions_in, the leftovers may touch each other and are swept into the other buffer
+// there every particle of another color is copied over, so the buffers can be swapped behind it, a color past the leftovers only copies
+#ifdef DISTANCE_FIELD
+kernel void gauss_seidel_sweep(global float4* positions_in, global float4* positions_out, global float4* positions_old, global const uint* contacts, global const uint* contact_counts, global const uint* colors, const uint color, global const triangle* world_triangles, const uint num_triangles, global const uint* active_indices, global const uint* active_counts, const uint parity, read_only image3d_t world_distances, const float4 distance_field_origin) {
+#else
+kernel void gauss_seidel_sweep(global float4* positions_in, global float4* positions_out, global float4* positions_old, global const uint* contacts, global const uint* contact_counts, global const uint* colors, const uint color, global const triangle* world_triangles, const uint num_triangles, global const uint* active_indices, global const uint* active_counts, const uint parity) {
+#endif
+	positions_in += SCENE * SCENE_SIZE;
+	positions_out += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	contacts += SCENE * SCENE_SIZE * MAX_CONTACTS;
+	contact_counts += SCENE * SCENE_SIZE;
+	colors += SCENE * SCENE_SIZE;
+	active_indices += SCENE * SCENE_SIZE;
+	active_counts += 2 * SCENE;
+
+	if (get_global_id(0) >= active_counts[parity]) return;
+	uint GID = active_indices[get_global_id(0)];
+	if (GID >= SCENE_SIZE) return;
+	// particles still uncolored after the last round are swept with the leftovers
+	if (min(colors[GID], (uint) MAX_COLORS) != color) {
+		if (color >= MAX_COLORS) positions_out[GID] = positions_in[GID];
+		return;
+	}
+
+	particle p = init_particle(positions_in[GID], positions_old[GID]);
+
+	float3 correction_particles = (float3) (0);
+	for (uint i = 0; i < contact_counts[GID]; i++) {
+		uint contact = contacts[GID * MAX_CONTACTS + i];
+		correction_particles += contact_correction(&p, positions_in[contact], positions_old, contact);
+	}
+	correct_particle_contacts(&p, correction_particles);
+
+#ifdef DISTANCE_FIELD
+	collide_world(&p, world_distances, distance_field_origin);
+#else
+	collide_world(&p, world_triangles, num_triangles);
+#endif
+
+	positions_out[GID] = (float4) (p.position_new, p.radius);
+}
+
+// the deepest remaining overlap as float bits, which order like the floats for positive values, and the number of overlapping pairs
+// every frame parity has its own pair of counters and clears the one of the next frame
+kernel void contact_residual(global const float4* positions, global const float4* positions_old, global const float4* bvh, const uint bvh_size, global const uint* active_indices, global const uint* active_counts, const uint parity, volatile global uint* residuals) {
+	positions += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	bvh += SCENE * SCENE_BVH_SIZE;
+	active_indices += SCENE * SCENE_SIZE;
+	active_counts += 2 * SCENE;
+
+	// the residual is the worst over all scenes
+	if (get_global_id(0) == 0) {
+		residuals[2 * (1 - parity)] = 0;
+		residuals[2 * (1 - parity) + 1] = 0;
+	}
+	if (get_global_id(0) >= active_counts[parity]) return;
+	uint GID = active_indices[get_global_id(0)];
+	if (GID > bvh_size) return;
+
+	particle p = init_particle(positions[GID], positions_old[GID]);
+	uint leave_array[STACK_SIZE];
+	traversal t;
+	uint leave_array_counter = collect_leaves(p.position_new, &p.radius, bvh, bvh_size, leave_array, &t);
+
+	float max_penetration = 0;
+	uint num_penetrations = 0;
+	for (uint i = 0; i < leave_array_counter; i++) {
+		// pairs of awake particles are counted by the one with the lower index
+		bool counted = leave_array[i] > GID || rest_frames(positions_old[leave_array[i]].w) >= SLEEP_FRAMES;
+		float depth = penetration(&p, positions[leave_array[i]]);
+		if (leave_array[i] != GID && counted && depth > EPSILON) {
+			max_penetration = max(max_penetration, depth);
+			num_penetrations++;
+		}
+	}
+	if (num_penetrations > 0) {
+		atomic_max(&residuals[2 * parity], as_uint(max_penetration));
+		atomic_add(&residuals[2 * parity + 1], num_penetrations);
+	}
+}
+
+// overlaps with the world shallower than this are resting contacts
+#define WORLD_PENETRATION_TOLERANCE 0.01f
+
+#ifdef DISTANCE_FIELD
+bool penetrates_world(float4 position, read_only image3d_t world_distances, float4 distance_field_origin) {
+	return world_distance(world_distances, distance_field_origin, position.xyz) < position.w - WORLD_PENETRATION_TOLERANCE;
+}
+#else
+bool penetrates_world(float4 position, global const triangle* world_triangles, const uint num_triangles) {
+	for (uint i = 0; i < num_triangles; i++) {
+		triangle t = world_triangles[i];
+		if (distance(position.xyz, closest_point_on_triangle(position.xyz, &t)) < position.w - WORLD_PENETRATION_TOLERANCE) return true;
+	}
+	return false;
+}
+#endif
+
+// sums of one step for the validation runs, reduced per work group: kinetic and potential energy, momentum, penetration depth, penetrating pairs and particles in the world
+// masses are the radius cubed, pairs are counted by the particle with the lower index and the deepest overlap is kept as float bits
+#ifdef DISTANCE_FIELD
+kernel void physics_metrics(global const float4* positions, global const float4* positions_old, global const float4* bvh, const uint bvh_size, global const triangle* world_triangles, const uint num_triangles, const float time_delta, const uint num_particles, local float8* scratch, global float8* partial_sums, volatile global uint* max_penetration, read_only image3d_t world_distances, const float4 distance_field_origin) {
+#else
+kernel void physics_metrics(global const float4* positions, global const float4* positions_old, global const float4* bvh, const uint bvh_size, global const triangle* world_triangles, const uint num_triangles, const float time_delta, const uint num_particles, local float8* scratch, global float8* partial_sums, volatile global uint* max_penetration) {
+#endif
+	positions += SCENE * SCENE_SIZE;
+	positions_old += SCENE * SCENE_SIZE;
+	bvh += SCENE * SCENE_BVH_SIZE;
+	partial_sums += SCENE * get_num_groups(0);
+
+	uint GID = get_global_id(0);
+	uint LID = get_local_id(0);
+	float8 sums = (float8) (0);
+	if (GID < num_particles) {
+		float4 position = positions[GID];
+		float mass = pown(position.w, 3);
+		float3 velocity = (position.xyz - positions_old[GID].xyz) / time_delta;
+		sums.s0 = mass * dot(velocity, velocity) / 2;
+		sums.s1 = mass * 9.81f * position.y;
+		sums.s234 = mass * velocity;
+
+		float radius = position.w;
+		uint leave_array[STACK_SIZE];
+		traversal t;
+		uint leave_array_counter = collect_leaves(position.xyz, &radius, bvh, bvh_size, leave_array, &t);
+		float deepest = 0;
+		for (uint i = 0; i < leave_array_counter; i++) {
+			uint other = leave_array[i];
+			if (other <= GID || other >= num_particles) continue;
+			float depth = position.w + positions[other].w - distance(position.xyz, positions[other].xyz);
+			if (depth > EPSILON) {
+				sums.s5 += depth;
+				sums.s6 += 1;
+				deepest = max(deepest, depth);
+			}
+		}
+		if (deepest > 0) atomic_max(max_penetration, as_uint(deepest));
+
+#ifdef DISTANCE_FIELD
+		sums.s7 = penetrates_world(position, world_distances, distance_field_origin);
+#else
+		sums.s7 = penetrates_world(position, world_triangles, num_triangles);
+#endif
+	}
+
+	scratch[LID] = sums;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint i = 1; i < get_local_size(0); i *= 2) {
+		if (LID % (2 * i) == 0 && LID + i < get_local_size(0)) {
+			scratch[LID] += scratch[LID + i];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (LID == 0) partial_sums[get_group_id(0)] = scratch[0];
+}
+
 
 
 
@@ -0,0 +1,35 @@
+
+// philox4x32-10, every particle draws from its own counter so the result does not depend on the work size or the device
+uint4 philox(uint4 counter, uint2 key) {
+	for (int i = 0; i < 10; i++) {
+		if (i > 0) key += (uint2) (0x9E3779B9, 0xBB67AE85);
+		uint hi0 = mul_hi(0xD2511F53u, counter.x);
+		uint lo0 = 0xD2511F53u * counter.x;
+		uint hi1 = mul_hi(0xCD9E8D57u, counter.z);
+		uint lo1 = 0xCD9E8D57u * counter.z;
+		counter = (uint4) (hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+	}
+	return counter;
+}
+
+float4 uniform_floats(uint4 bits) {
+	return convert_float4(bits >> 8) / 16777216.f;
+}
+
+// w of the box corners is the radius range
+kernel void seed_particles(global float4* positions, global float4* positions_old, const uint num_particles, const uint2 seed, const float4 box_min, const float4 box_max) {
+	uint GID = get_global_id(0);
+	if (GID >= num_particles) return;
+
+	float4 particle = mix(box_min, box_max, uniform_floats(philox((uint4) (GID, 0, 0, 0), seed)));
+	positions[GID] = particle;
+	// the w of old positions counts the frames a particle has been resting
+	positions_old[GID] = (float4) (particle.xyz, 0);
+}
+
+kernel void seed_colors(global float* colors, const uint num_particles, const uint2 seed) {
+	uint GID = get_global_id(0);
+	if (GID >= num_particles) return;
+
+	vstore3(uniform_floats(philox((uint4) (GID, 1, 0, 0), seed)).xyz, GID, colors);
+}
@@ -0,0 +1,219 @@
+#ifdef DEPTH_IMAGES
+#pragma OPENCL EXTENSION cl_khr_depth_images : enable
+#define depth_image2d_t image2d_depth_t
+#define read_depth(image, pixel) read_imagef(image, pixel)
+#else
+#define depth_image2d_t image2d_t
+#define read_depth(image, pixel) read_imagef(image, pixel).x
+#endif
+
+#ifndef WINDOW_WIDTH
+#define WINDOW_WIDTH  2560
+#define WINDOW_HEIGHT 1536
+#endif
+// the window covers the lower left of the render targets, which are padded up to the tile grid
+#ifndef VIEWPORT_WIDTH
+#define VIEWPORT_WIDTH WINDOW_WIDTH
+#define VIEWPORT_HEIGHT WINDOW_HEIGHT
+#endif
+
+#define TILES_HORIZONTAL 32
+#define TILES_VERTICAL 16
+
+#define TILES_NUMBER (TILES_HORIZONTAL * TILES_VERTICAL)
+
+#define TILE_WIDTH (WINDOW_WIDTH / TILES_HORIZONTAL)
+#define TILE_HEIGHT (WINDOW_HEIGHT / TILES_VERTICAL)
+
+#ifndef LOCAL_WORK_SIZE
+#define LOCAL_WORK_SIZE 256
+#endif
+
+#define PIXELS_PER_THREAD (TILE_WIDTH * TILE_HEIGHT / LOCAL_WORK_SIZE)
+
+#define STACK_SIZE (uint) 256
+#define LIGHT_NUMBER_PER_TILE 256
+
+#ifdef STATISTICS
+#include "statistics.cl"
+#else
+#define STATISTICS_ARGUMENT
+#endif
+
+
+float3 octahedral_decode(float2 e) {
+	float3 n = (float3) (e, 1 - fabs(e.x) - fabs(e.y));
+	float t = max(-n.z, 0.f);
+	n.x += n.x >= 0 ? -t : t;
+	n.y += n.y >= 0 ? -t : t;
+	return normalize(n);
+}
+
+float3 reconstruct_position(int2 pixel, float depth, float16 inverse_projection_view) {
+	float4 ndc = (float4) (2 * (pixel.x + 0.5f) / VIEWPORT_WIDTH - 1, 2 * (pixel.y + 0.5f) / VIEWPORT_HEIGHT - 1, 2 * depth - 1, 1);
+	float4 position = (float4) (
+		dot(inverse_projection_view.s048c, ndc),
+		dot(inverse_projection_view.s159d, ndc),
+		dot(inverse_projection_view.s26ae, ndc),
+		dot(inverse_projection_view.s37bf, ndc));
+	return position.xyz / position.w;
+}
+
+int2 tile_pixel(uint tile_index, uint pixel_index) {
+	// consecutive work items read consecutive pixels of a tile row
+	return (int2) (TILE_WIDTH * (tile_index % TILES_HORIZONTAL) + pixel_index % TILE_WIDTH, TILE_HEIGHT * (tile_index / TILES_HORIZONTAL) + pixel_index / TILE_WIDTH);
+}
+
+float point_aabb_distance_squared(float3 p, float3 aabb_min, float3 aabb_max) {
+	float distance_squared = 0;
+
+	if (p.x < aabb_min.x) {
+		distance_squared += pow(aabb_min.x - p.x, 2);
+	} else if (p.x > aabb_max.x) {
+		distance_squared += pow(p.x - aabb_max.x, 2);
+	}
+
+	if (p.y < aabb_min.y) {
+		distance_squared += pow(aabb_min.y - p.y, 2);
+	} else if (p.y > aabb_max.y) {
+		distance_squared += pow(p.y - aabb_max.y, 2);
+	}
+
+	if (p.z < aabb_min.z) {
+		distance_squared += pow(aabb_min.z - p.z, 2);
+	} else if (p.z > aabb_max.z) {
+		distance_squared += pow(p.z - aabb_max.z, 2);
+	}
+
+	return distance_squared;
+}
+
+float3 phong(float3 position, float3 color, float3 n, float4 light_position, float3 camera_position) {
+	float3 k_d = 0.7f * color;
+	float3 k_s = 1.0f * (float3) (1.0f, 1.0f, 1.0f);
+	float e = 5.0f;
+
+	float3 v = normalize(camera_position - position);
+	float3 l = normalize(light_position.xyz - position);
+	float3 r = 2 * n * dot(n, l) - l;
+
+	float3 diffus = k_d * max(dot(n, l), 0.f);
+	float3 specular = k_s * pow(max(dot(r, v), 0.f), e);
+	return (diffus + specular) / pown(distance(position, light_position.xyz) / light_position.w, 2);
+}
+
+
+// one work group per tile: reduce the tile aabb from the g-buffer, cull the bvh against it into local memory and shade every pixel once
+kernel void shade_tiles(read_only depth_image2d_t depths, read_only image2d_t normals, global const float4* positions, global const float4* bvh, const uint bvh_size, const float16 inverse_projection_view, const float4 camera_position, write_only image2d_t colors STATISTICS_ARGUMENT) {
+	local float3 tile_reduction[2 * LOCAL_WORK_SIZE];
+	local uint light_candidates[STACK_SIZE];
+	local uint light_candidates_counter;
+	local float4 tile_lights[LIGHT_NUMBER_PER_TILE];
+	local uint tile_lights_counter;
+
+	uint LID = get_local_id(0);
+	uint tile_index = get_group_id(0);
+
+	float3 min_position = (float3) (NAN);
+	float3 max_position = (float3) (NAN);
+	for (int i = 0; i < PIXELS_PER_THREAD; i++) {
+		int2 pixel = tile_pixel(tile_index, i * LOCAL_WORK_SIZE + LID);
+		float depth = read_depth(depths, pixel);
+		if (depth < 1) {
+			float3 world_position = reconstruct_position(pixel, depth, inverse_projection_view);
+			min_position = fmin(min_position, world_position);
+			max_position = fmax(max_position, world_position);
+		}
+	}
+	tile_reduction[LID] = min_position;
+	tile_reduction[LID + LOCAL_WORK_SIZE] = max_position;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = 1; i < LOCAL_WORK_SIZE; i*=2) {
+		if (LID % (2 * i) == 0) {
+			tile_reduction[LID] = fmin(tile_reduction[LID], tile_reduction[LID + i]);
+			tile_reduction[LID + LOCAL_WORK_SIZE] = fmax(tile_reduction[LID + LOCAL_WORK_SIZE], tile_reduction[LID + i + LOCAL_WORK_SIZE]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	float3 aabb_min = tile_reduction[0];
+	float3 aabb_max = tile_reduction[LOCAL_WORK_SIZE];
+
+
+	if (LID == 0) {
+		light_candidates_counter = 0;
+		tile_lights_counter = 0;
+
+		uint traversal_stack[STACK_SIZE] = {0};
+		uint stack_counter = isnan(aabb_min.x) ? 0 : 1;
+		uint nodes_visited = 0;
+		bool stack_overflow = false;
+		bool candidate_overflow = false;
+		while (stack_counter > 0 && stack_counter < STACK_SIZE) {
+			stack_counter--;
+			nodes_visited++;
+			float4 sphere = bvh[traversal_stack[stack_counter]];
+			if (point_aabb_distance_squared(sphere.xyz, aabb_min, aabb_max) <= 9 + pow(sphere.w, 2)) {
+				uint current_index = traversal_stack[stack_counter];
+				if (2 * current_index + 1 < bvh_size) {
+					traversal_stack[stack_counter] = 2 * current_index + 1;
+					traversal_stack[min(stack_counter + 1, STACK_SIZE - 1)] = 2 * current_index + 2;
+					stack_counter = min(stack_counter + 2, STACK_SIZE - 1);
+				} else if (light_candidates_counter + 2 <= STACK_SIZE) {
+					current_index = 2 * (current_index - (bvh_size / 2));
+					light_candidates[light_candidates_counter] = current_index;
+					light_candidates[light_candidates_counter + 1] = current_index + 1;
+					light_candidates_counter += 2;
+				} else {
+					candidate_overflow = true;
+				}
+			}
+			stack_overflow |= stack_counter == STACK_SIZE - 1;
+		}
+#ifdef STATISTICS
+		atom_inc(&stats->tiles);
+		atom_add(&stats->tile_nodes_visited, nodes_visited);
+		if (stack_overflow) atom_inc(&stats->tile_stack_overflows);
+		if (candidate_overflow) atom_inc(&stats->candidate_overflows);
+#endif
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint i = LID; i < light_candidates_counter; i += LOCAL_WORK_SIZE) {
+		float4 light = positions[light_candidates[i]];
+		if (point_aabb_distance_squared(light.xyz, aabb_min, aabb_max) < 9) {
+			uint light_index = atomic_inc(&tile_lights_counter);
+			if (light_index < LIGHT_NUMBER_PER_TILE) {
+				tile_lights[light_index] = light;
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint num_lights = min(tile_lights_counter, (uint) LIGHT_NUMBER_PER_TILE);
+#ifdef STATISTICS
+	if (LID == 0) {
+		atom_add(&stats->tile_lights, tile_lights_counter);
+		atom_inc(&stats->lights_histogram[linear_bin(tile_lights_counter, LIGHT_NUMBER_PER_TILE / HISTOGRAM_BINS)]);
+		if (tile_lights_counter > LIGHT_NUMBER_PER_TILE) atom_inc(&stats->light_overflows);
+	}
+#endif
+
+
+	for (int i = 0; i < PIXELS_PER_THREAD; i++) {
+		int2 pixel = tile_pixel(tile_index, i * LOCAL_WORK_SIZE + LID);
+		float depth = read_depth(depths, pixel);
+		if (depth >= 1) {
+			write_imagef(colors, pixel, (float4) (0));
+			continue;
+		}
+
+		float3 position = reconstruct_position(pixel, depth, inverse_projection_view);
+		float3 n = octahedral_decode(read_imagef(normals, pixel).xy);
+
+		float3 color = 0.2f * n;
+		for (uint j = 0; j < num_lights; j++) {
+			color += phong(position, n, n, tile_lights[j], camera_position.xyz);
+		}
+		write_imagef(colors, pixel, (float4) (color, 1));
+	}
+}
@@ -0,0 +1,37 @@
+
+// counters summed by the kernels built with STATISTICS until the host reads and clears them, same layout as particle::cl::statistics
+// 64 bit, since a few million particles visiting hundreds of nodes each wrap 32 bit sums within a single interval
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+
+#define HISTOGRAM_BINS 16
+
+typedef struct {
+	ulong traversals;
+	ulong nodes_visited;
+	ulong leaves_tested;
+	ulong contacts;
+	ulong stack_overflows;
+	ulong leaf_overflows;
+	ulong neighbor_overflows;
+	ulong contact_overflows;
+	ulong tiles;
+	ulong tile_nodes_visited;
+	ulong tile_lights;
+	ulong tile_stack_overflows;
+	ulong candidate_overflows;
+	ulong light_overflows;
+	ulong nodes_visited_histogram[HISTOGRAM_BINS];
+	ulong contacts_histogram[HISTOGRAM_BINS];
+	ulong lights_histogram[HISTOGRAM_BINS];
+} statistics;
+
+// appended to the parameters of every instrumented kernel, so kernels built without STATISTICS keep their arguments
+#define STATISTICS_ARGUMENT , volatile global statistics* stats
+
+uint log2_bin(uint value) {
+	return value == 0 ? 0 : min(31 - clz(value), HISTOGRAM_BINS - 1);
+}
+
+uint linear_bin(uint value, uint bin_width) {
+	return min(value / bin_width, (uint) HISTOGRAM_BINS - 1);
+}
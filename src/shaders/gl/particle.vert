@@ -2,12 +2,13 @@
 
 layout(location = 0) in vec4 particle_data;
 layout(location = 1) in vec3 vertex_position;
-layout(location = 2) in vec3 particle_color;
+layout(location = 2) in uint particle_id;
 layout(location = 3) uniform mat4 PVM;
+layout(binding = 0) uniform samplerBuffer particle_colors;
 
 out vec3 particle_color_v;
 
 void main() {
-	particle_color_v = particle_color;
+	particle_color_v = texelFetch(particle_colors, int(particle_id)).rgb;
 	gl_Position = PVM * vec4(particle_data.w * vertex_position + particle_data.xyz, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,558 @@
+#pragma once
+
+#include "tile_streaming.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <numeric>
+
+
+void tile_streaming::allocate(slot& s, cl_uint capacity) {
+	s.capacity = capacity;
+	s.bvh_levels = particle::cl::get_bvh_levels(capacity);
+	for (int i = 0; i < 2; i++) {
+		s.positions[i] = memory->allocate("particles", capacity * sizeof(cl_float4));
+		s.positions_old[i] = memory->allocate("particles", capacity * sizeof(cl_float4));
+		s.ids[i] = memory->allocate("particles", capacity * sizeof(cl_uint));
+	}
+	s.indices = memory->allocate("sort", capacity * sizeof(cl_uint));
+	s.active_indices = memory->allocate("solver", capacity * sizeof(cl_uint));
+	s.bvh = memory->allocate("bvh", (pow(2, ceil(log(capacity) / log(2))) - 1) * sizeof(cl_float4));
+
+	s.frame_parity = 0;
+	record_frames(s);
+}
+
+void tile_streaming::release(slot& s) {
+	if (s.capacity == 0) return;
+	for (int parity = 0; parity < 2; parity++) {
+		for (particle::cl::kernel_step& step : s.frame_steps[parity]) {
+			clReleaseKernel(step.kernel);
+		}
+		s.frame_steps[parity].clear();
+	}
+	clFinish(transfer_queue);
+	memory->release({s.positions[0], s.positions[1], s.positions_old[0], s.positions_old[1], s.ids[0], s.ids[1], s.indices, s.active_indices, s.bvh});
+	s.capacity = 0;
+}
+
+// the stored particles are not kept, a tile only grows right before its particles are written again
+void tile_streaming::reserve(tile& t, cl_uint capacity) {
+	if (capacity <= t.storage_capacity) return;
+	cl_int error = CL_SUCCESS;
+	if (t.storage != nullptr) {
+		error |= clEnqueueUnmapMemObject(transfer_queue, t.storage, t.positions, NULL, nullptr, nullptr);
+		clFinish(transfer_queue);
+		memory->release(t.storage);
+	}
+	t.storage_capacity = capacity + capacity / 4 + 64;
+	size_t size = t.storage_capacity * (2 * sizeof(cl_float4) + sizeof(cl_uint));
+	// pinned host memory cannot be a sub-buffer of the pooled blocks, it is only accounted
+	cl_int object_error = CL_SUCCESS;
+	t.storage = memory->adopt("tiles", clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &object_error), size);
+	error |= object_error;
+	void* data = clEnqueueMapBuffer(transfer_queue, t.storage, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, NULL, nullptr, nullptr, &object_error);
+	error |= object_error;
+	t.positions = static_cast<cl_float4*>(data);
+	t.positions_old = t.positions + t.storage_capacity;
+	t.ids = reinterpret_cast<cl_uint*>(t.positions_old + t.storage_capacity);
+	particle::cl::print_error(error, "tile_streaming::reserve");
+}
+
+void tile_streaming::set_slabs(std::vector<cl_float> boundaries) {
+	cl_float infinity = std::numeric_limits<cl_float>::infinity();
+	for (size_t i = 0; i < tiles.size(); i++) {
+		tiles[i].slab = {i == 0 ? -infinity : boundaries[i - 1], i + 1 == tiles.size() ? infinity : boundaries[i]};
+	}
+}
+
+void tile_streaming::balance_slabs() {
+	std::vector<cl_float> x;
+	for (cl_float4& position : positions) {
+		x.push_back(position.s[0]);
+	}
+	std::vector<cl_float> boundaries;
+	for (size_t i = 1; i < tiles.size(); i++) {
+		auto quantile = x.begin() + i * x.size() / tiles.size();
+		std::nth_element(x.begin(), quantile, x.end());
+		boundaries.push_back(*quantile);
+	}
+	set_slabs(boundaries);
+}
+
+void tile_streaming::rebalance() {
+	cl_uint max_owned = 0;
+	for (tile& t : tiles) {
+		max_owned = std::max(max_owned, t.num_owned);
+	}
+	// particles on the wrong side of the new borders migrate with the next steps
+	if (max_owned * tiles.size() > 1.25 * num_particles) {
+		balance_slabs();
+	}
+}
+
+cl_kernel tile_streaming::record_step(std::vector<particle::cl::kernel_step>& steps, cl_program program, const char* kernel_name, size_t work_items) {
+	cl_int error = CL_SUCCESS;
+	cl_kernel kernel = clCreateKernel(program, kernel_name, &error);
+	particle::cl::print_error(error, "tile_streaming::record_step");
+	size_t local_work_size = std::min(local_work_sizes.at(kernel_name), work_items);
+	steps.push_back({kernel, particle::cl::get_global_work_size(work_items, local_work_size), local_work_size});
+	return kernel;
+}
+
+void tile_streaming::record_frames(slot& s) {
+	// the same sort, bvh and resolve stages as domain_decomposition, over every slot of the device buffers
+	cl_int error = CL_SUCCESS;
+	for (int parity = 0; parity < 2; parity++) {
+		std::vector<particle::cl::kernel_step>& steps = s.frame_steps[parity];
+		cl_kernel init_indices_kernel = record_step(steps, bitonic_program, "init_indices", s.capacity);
+		error |= clSetKernelArg(init_indices_kernel, 0, sizeof(cl_mem), &s.indices);
+		error |= clSetKernelArg(init_indices_kernel, 1, sizeof(cl_uint), &s.capacity);
+
+		int num_work_items = pow(2, ceil(log(s.capacity) / log(2)));
+		int iterations = ceil(log(s.capacity) / log(2));
+		cl_uint direction = 0;
+		while (iterations > 1) {
+			for (int i = 0; i < iterations; i++) {
+				for (int j = 0; j <= i; j++) {
+					cl_uint stride = pow(2, i - j);
+					cl_uint merge = j == 0 ? 1 : 0;
+					cl_kernel bitonic_sort_kernel = record_step(steps, bitonic_program, "bitonic_sort", num_work_items / 2);
+					error |= clSetKernelArg(bitonic_sort_kernel, 0, sizeof(cl_mem), &s.positions[0]);
+					error |= clSetKernelArg(bitonic_sort_kernel, 1, sizeof(cl_mem), &s.indices);
+					error |= clSetKernelArg(bitonic_sort_kernel, 2, sizeof(cl_uint), &s.capacity);
+					error |= clSetKernelArg(bitonic_sort_kernel, 3, sizeof(cl_uint), &stride);
+					error |= clSetKernelArg(bitonic_sort_kernel, 4, sizeof(cl_uint), &merge);
+					error |= clSetKernelArg(bitonic_sort_kernel, 5, sizeof(cl_uint), &direction);
+				}
+			}
+			iterations--;
+			direction = (direction + 1) % 3;
+		}
+
+		cl_kernel apply_indices_kernel = record_step(steps, bitonic_program, "apply_indices", s.capacity);
+		error |= clSetKernelArg(apply_indices_kernel, 0, sizeof(cl_mem), &s.indices);
+		error |= clSetKernelArg(apply_indices_kernel, 1, sizeof(cl_mem), &s.positions[0]);
+		error |= clSetKernelArg(apply_indices_kernel, 2, sizeof(cl_mem), &s.positions[1]);
+		error |= clSetKernelArg(apply_indices_kernel, 3, sizeof(cl_mem), &s.positions_old[0]);
+		error |= clSetKernelArg(apply_indices_kernel, 4, sizeof(cl_mem), &s.positions_old[1]);
+		error |= clSetKernelArg(apply_indices_kernel, 5, sizeof(cl_mem), &s.ids[0]);
+		error |= clSetKernelArg(apply_indices_kernel, 6, sizeof(cl_mem), &s.ids[1]);
+		error |= clSetKernelArg(apply_indices_kernel, 7, sizeof(cl_uint), &s.capacity);
+		std::swap(s.positions[0], s.positions[1]);
+		std::swap(s.positions_old[0], s.positions_old[1]);
+		std::swap(s.ids[0], s.ids[1]);
+
+		size_t gws = pow(2, ceil(log(s.capacity) / log(2)) - 1);
+		for (size_t i = 0; i < s.bvh_levels.size() - 1; i++) {
+			cl_kernel construct_bvh_kernel = record_step(steps, bvh_program, "construct_bvh", gws);
+			error |= clSetKernelArg(construct_bvh_kernel, 0, sizeof(cl_mem), &s.positions[0]);
+			error |= clSetKernelArg(construct_bvh_kernel, 1, sizeof(cl_mem), &s.bvh);
+			error |= clSetKernelArg(construct_bvh_kernel, 2, sizeof(cl_uint), &s.bvh_levels[i].first);
+			error |= clSetKernelArg(construct_bvh_kernel, 3, sizeof(cl_uint), &s.bvh_levels[i].second);
+			error |= clSetKernelArg(construct_bvh_kernel, 4, sizeof(cl_uint), &s.bvh_levels[i + 1].first);
+			gws = std::max<size_t>(gws / 2, 1);
+		}
+
+		cl_uint frame_parity = parity;
+		cl_kernel compact_active_kernel = record_step(steps, particle_simulation_program, "compact_active", s.capacity);
+		error |= clSetKernelArg(compact_active_kernel, 0, sizeof(cl_mem), &s.positions[0]);
+		error |= clSetKernelArg(compact_active_kernel, 1, sizeof(cl_mem), &s.positions[1]);
+		error |= clSetKernelArg(compact_active_kernel, 2, sizeof(cl_mem), &s.positions_old[0]);
+		error |= clSetKernelArg(compact_active_kernel, 3, sizeof(cl_mem), &s.active_indices);
+		error |= clSetKernelArg(compact_active_kernel, 4, sizeof(cl_mem), &s.active_counts);
+		error |= clSetKernelArg(compact_active_kernel, 5, sizeof(cl_uint), &frame_parity);
+		error |= clSetKernelArg(compact_active_kernel, 6, sizeof(cl_uint), &s.capacity);
+
+		for (int i = 0; i < 10; i++) {
+			cl_kernel resolve_collisions_kernel = record_step(steps, particle_simulation_program, "resolve_collisions", s.capacity);
+			error |= clSetKernelArg(resolve_collisions_kernel, 0, sizeof(cl_mem), &s.positions[0]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 1, sizeof(cl_mem), &s.positions[1]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 2, sizeof(cl_mem), &s.positions_old[0]);
+			error |= clSetKernelArg(resolve_collisions_kernel, 3, sizeof(cl_mem), &s.bvh);
+			error |= clSetKernelArg(resolve_collisions_kernel, 4, sizeof(cl_uint), &s.bvh_levels[1].second);
+			error |= clSetKernelArg(resolve_collisions_kernel, 5, sizeof(cl_mem), &world_triangles_buffer);
+			error |= clSetKernelArg(resolve_collisions_kernel, 6, sizeof(cl_uint), &num_triangles);
+			error |= clSetKernelArg(resolve_collisions_kernel, 7, sizeof(cl_mem), &s.active_indices);
+			error |= clSetKernelArg(resolve_collisions_kernel, 8, sizeof(cl_mem), &s.active_counts);
+			error |= clSetKernelArg(resolve_collisions_kernel, 9, sizeof(cl_uint), &frame_parity);
+			if (distance_field_colliders) {
+				error |= clSetKernelArg(resolve_collisions_kernel, 10, sizeof(cl_mem), &world_distances);
+				error |= clSetKernelArg(resolve_collisions_kernel, 11, sizeof(cl_float4), &distance_field.origin);
+			}
+			std::swap(s.positions[0], s.positions[1]);
+		}
+	}
+	particle::cl::print_error(error, "tile_streaming::record_frames");
+}
+
+void tile_streaming::swap_buffers(slot& s) {
+	std::swap(s.positions[0], s.positions[1]);
+	std::swap(s.positions_old[0], s.positions_old[1]);
+	std::swap(s.ids[0], s.ids[1]);
+	s.frame_parity = 1 - s.frame_parity;
+}
+
+// every transfer goes through the transfer queue, so the pinned storage of a tile is read and written back in order
+cl_int tile_streaming::upload(slot& s, const cl_float4* positions, const cl_float4* positions_old, const cl_uint* ids, size_t count, cl_uint offset) {
+	cl_int error = CL_SUCCESS;
+	if (count == 0) return error;
+	error |= clEnqueueWriteBuffer(transfer_queue, s.positions[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), positions, NULL, nullptr, nullptr);
+	error |= clEnqueueWriteBuffer(transfer_queue, s.positions_old[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), positions_old, NULL, nullptr, nullptr);
+	error |= clEnqueueWriteBuffer(transfer_queue, s.ids[0], CL_FALSE, offset * sizeof(cl_uint), count * sizeof(cl_uint), ids, NULL, nullptr, nullptr);
+	return error;
+}
+
+cl_int tile_streaming::download(slot& s, cl_float4* positions, cl_float4* positions_old, cl_uint* ids, size_t count, cl_uint offset) {
+	cl_int error = CL_SUCCESS;
+	if (count == 0) return error;
+	error |= clEnqueueReadBuffer(transfer_queue, s.positions[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), positions, NULL, nullptr, nullptr);
+	error |= clEnqueueReadBuffer(transfer_queue, s.positions_old[0], CL_FALSE, offset * sizeof(cl_float4), count * sizeof(cl_float4), positions_old, NULL, nullptr, nullptr);
+	error |= clEnqueueReadBuffer(transfer_queue, s.ids[0], CL_FALSE, offset * sizeof(cl_uint), count * sizeof(cl_uint), ids, NULL, nullptr, nullptr);
+	return error;
+}
+
+cl_int tile_streaming::download(slot& s, particle_range& range, cl_uint offset, cl_uint count) {
+	range.positions.resize(count);
+	range.positions_old.resize(count);
+	range.ids.resize(count);
+	return download(s, range.positions.data(), range.positions_old.data(), range.ids.data(), count, offset);
+}
+
+cl_int tile_streaming::park(slot& s, cl_uint first_index) {
+	if (first_index >= s.capacity) return CL_SUCCESS;
+	cl_int error = CL_SUCCESS;
+	error |= clSetKernelArg(park_kernel, 0, sizeof(cl_mem), &s.positions[0]);
+	error |= clSetKernelArg(park_kernel, 1, sizeof(cl_mem), &s.positions_old[0]);
+	error |= clSetKernelArg(park_kernel, 2, sizeof(cl_uint), &first_index);
+	error |= clSetKernelArg(park_kernel, 3, sizeof(cl_uint), &s.capacity);
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("move"), s.capacity - first_index);
+	size_t global_work_size = particle::cl::get_global_work_size(s.capacity - first_index, local_work_size);
+	error |= clEnqueueNDRangeKernel(transfer_queue, park_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	return error;
+}
+
+// queued behind the downloads of the tile that used the slot before, the compute queue waits for the uploaded event
+void tile_streaming::import_tile(size_t index, slot& s) {
+	cl_int error = CL_SUCCESS;
+	tile& t = tiles[index];
+	int previous = 1 - export_parity;
+	std::vector<const particle_range*> migrants;
+	std::vector<const particle_range*> ghosts;
+	if (index > 0) {
+		migrants.push_back(&tiles[index - 1].exports[previous][RIGHT_MIGRANTS]);
+		ghosts.push_back(&tiles[index - 1].exports[previous][RIGHT_GHOSTS]);
+	}
+	if (index + 1 < tiles.size()) {
+		migrants.push_back(&tiles[index + 1].exports[previous][LEFT_MIGRANTS]);
+		ghosts.push_back(&tiles[index + 1].exports[previous][LEFT_GHOSTS]);
+	}
+
+	cl_uint num_required = t.num_owned;
+	for (const particle_range* range : migrants) num_required += range->positions.size();
+	for (const particle_range* range : ghosts) num_required += range->positions.size();
+	if (num_required > s.capacity) {
+		clFinish(compute_queue);
+		clFinish(transfer_queue);
+		release(s);
+		allocate(s, pow(2, ceil(log(2 * num_required) / log(2))));
+	}
+
+	error |= upload(s, t.positions, t.positions_old, t.ids, t.num_owned, 0);
+	cl_uint offset = t.num_owned;
+	for (const particle_range* range : migrants) {
+		error |= upload(s, range->positions.data(), range->positions_old.data(), range->ids.data(), range->positions.size(), offset);
+		offset += range->positions.size();
+	}
+	t.num_owned = offset;
+	for (const particle_range* range : ghosts) {
+		error |= upload(s, range->positions.data(), range->positions_old.data(), range->ids.data(), range->positions.size(), offset);
+		offset += range->positions.size();
+	}
+	t.num_ghosts = offset - t.num_owned;
+	error |= park(s, offset);
+	error |= clEnqueueMarkerWithWaitList(transfer_queue, NULL, nullptr, &s.uploaded);
+	error |= clFlush(transfer_queue);
+	particle::cl::print_error(error, "tile_streaming::import_tile");
+}
+
+void tile_streaming::simulate_tile(size_t index, slot& s, cl_float time_delta) {
+	cl_int error = CL_SUCCESS;
+	error |= clEnqueueBarrierWithWaitList(compute_queue, 1, &s.uploaded, nullptr);
+	clReleaseEvent(s.uploaded);
+	s.uploaded = nullptr;
+
+	if (time_delta > 0) {
+		error |= clSetKernelArg(move_kernel, 0, sizeof(cl_mem), &s.positions_old[0]);
+		error |= clSetKernelArg(move_kernel, 1, sizeof(cl_mem), &s.positions[0]);
+		error |= clSetKernelArg(move_kernel, 2, sizeof(cl_uint), &s.capacity);
+		error |= clSetKernelArg(move_kernel, 3, sizeof(cl_float), &time_delta_old);
+		error |= clSetKernelArg(move_kernel, 4, sizeof(cl_float), &time_delta);
+		size_t local_work_size = std::min<size_t>(local_work_sizes.at("move"), s.capacity);
+		size_t global_work_size = particle::cl::get_global_work_size(s.capacity, local_work_size);
+		error |= clEnqueueNDRangeKernel(compute_queue, move_kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+
+		// the partition swaps the buffers back, so the slot always runs the same parity and its active count has to be cleared here
+		cl_uint zero = 0;
+		error |= clEnqueueFillBuffer(compute_queue, s.active_counts, &zero, sizeof(cl_uint), s.frame_parity * sizeof(cl_uint), sizeof(cl_uint), NULL, nullptr, nullptr);
+		error |= particle::cl::enqueue_steps(compute_queue, s.frame_steps[s.frame_parity]);
+		swap_buffers(s);
+	}
+
+	cl_uint zero = 0;
+	error |= clEnqueueFillBuffer(compute_queue, s.counters, &zero, sizeof(cl_uint), 0, sizeof(tiles[index].bucket_sizes), NULL, nullptr, nullptr);
+	for (cl_kernel kernel : {count_kernel, scatter_kernel}) {
+		error |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &s.positions[0]);
+		error |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &s.positions_old[0]);
+		error |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &s.counters);
+	}
+	error |= clSetKernelArg(count_kernel, 3, sizeof(cl_uint), &s.capacity);
+	error |= clSetKernelArg(count_kernel, 4, sizeof(cl_float2), &tiles[index].slab);
+	error |= clSetKernelArg(count_kernel, 5, sizeof(cl_float), &halo);
+	error |= clSetKernelArg(scatter_kernel, 3, sizeof(cl_mem), &s.indices);
+	error |= clSetKernelArg(scatter_kernel, 4, sizeof(cl_uint), &s.capacity);
+	error |= clSetKernelArg(scatter_kernel, 5, sizeof(cl_float2), &tiles[index].slab);
+	error |= clSetKernelArg(scatter_kernel, 6, sizeof(cl_float), &halo);
+
+	error |= clSetKernelArg(apply_indices_kernel, 0, sizeof(cl_mem), &s.indices);
+	error |= clSetKernelArg(apply_indices_kernel, 1, sizeof(cl_mem), &s.positions[0]);
+	error |= clSetKernelArg(apply_indices_kernel, 2, sizeof(cl_mem), &s.positions[1]);
+	error |= clSetKernelArg(apply_indices_kernel, 3, sizeof(cl_mem), &s.positions_old[0]);
+	error |= clSetKernelArg(apply_indices_kernel, 4, sizeof(cl_mem), &s.positions_old[1]);
+	error |= clSetKernelArg(apply_indices_kernel, 5, sizeof(cl_mem), &s.ids[0]);
+	error |= clSetKernelArg(apply_indices_kernel, 6, sizeof(cl_mem), &s.ids[1]);
+	error |= clSetKernelArg(apply_indices_kernel, 7, sizeof(cl_uint), &s.capacity);
+
+	size_t local_work_size = std::min<size_t>(local_work_sizes.at("apply_indices"), s.capacity);
+	size_t global_work_size = particle::cl::get_global_work_size(s.capacity, local_work_size);
+	for (cl_kernel kernel : {count_kernel, scatter_kernel, apply_indices_kernel}) {
+		error |= clEnqueueNDRangeKernel(compute_queue, kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+	}
+	swap_buffers(s);
+	error |= clEnqueueReadBuffer(compute_queue, s.counters, CL_FALSE, 0, sizeof(tiles[index].bucket_sizes), tiles[index].bucket_sizes, NULL, nullptr, &s.partitioned);
+	error |= clFlush(compute_queue);
+	particle::cl::print_error(error, "tile_streaming::simulate_tile");
+}
+
+// the download sizes are only known once the partition is done, everything else of the step is already queued by then
+void tile_streaming::export_tile(size_t index, slot& s) {
+	cl_int error = CL_SUCCESS;
+	error |= clWaitForEvents(1, &s.partitioned);
+	clReleaseEvent(s.partitioned);
+	s.partitioned = nullptr;
+
+	tile& t = tiles[index];
+	particle_range* exports = t.exports[export_parity];
+	cl_uint* bucket_sizes = t.bucket_sizes;
+	cl_uint right_halo_index = bucket_sizes[0] + bucket_sizes[1];
+	cl_uint migrants_index = right_halo_index + bucket_sizes[2];
+	reserve(t, migrants_index);
+	error |= download(s, t.positions, t.positions_old, t.ids, migrants_index, 0);
+	t.num_owned = migrants_index;
+	error |= download(s, exports[LEFT_GHOSTS], 0, index > 0 ? bucket_sizes[0] : 0);
+	error |= download(s, exports[RIGHT_GHOSTS], right_halo_index, index + 1 < tiles.size() ? bucket_sizes[2] : 0);
+	error |= download(s, exports[LEFT_MIGRANTS], migrants_index, bucket_sizes[3]);
+	error |= download(s, exports[RIGHT_MIGRANTS], migrants_index + bucket_sizes[3], bucket_sizes[4]);
+	error |= clFlush(transfer_queue);
+	particle::cl::print_error(error, "tile_streaming::export_tile");
+}
+
+// the migrants are in transit between two tiles, so they are gathered from the exports
+void tile_streaming::gather() {
+	size_t gathered = 0;
+	auto append = [&](const cl_float4* tile_positions, const cl_uint* tile_ids, size_t count) {
+		count = std::min<size_t>(count, num_particles - gathered);
+		std::copy_n(tile_positions, count, positions.data() + gathered);
+		std::copy_n(tile_ids, count, ids.data() + gathered);
+		gathered += count;
+	};
+	for (tile& t : tiles) {
+		append(t.positions, t.ids, t.num_owned);
+		for (export_range range : {LEFT_MIGRANTS, RIGHT_MIGRANTS}) {
+			const particle_range& migrants = t.exports[export_parity][range];
+			append(migrants.positions.data(), migrants.ids.data(), migrants.positions.size());
+		}
+		for (export_range range : {LEFT_GHOSTS, RIGHT_GHOSTS}) {
+			for (cl_float4& position_old : t.exports[export_parity][range].positions_old) {
+				position_old.s[3] = -1 - position_old.s[3];
+			}
+		}
+	}
+	export_parity = 1 - export_parity;
+}
+
+// a zero time delta only partitions the tiles, which is how the first exports are made
+void tile_streaming::step(cl_float time_delta) {
+	auto start = std::chrono::high_resolution_clock::now();
+	import_tile(0, slots[0]);
+	for (size_t i = 0; i < tiles.size(); i++) {
+		simulate_tile(i, slots[i % 2], time_delta);
+		if (i + 1 < tiles.size()) {
+			import_tile(i + 1, slots[(i + 1) % 2]);
+		}
+		export_tile(i, slots[i % 2]);
+	}
+	clFinish(transfer_queue);
+	if (time_delta > 0) {
+		time_delta_old = time_delta;
+	}
+
+	gather();
+	rebalance();
+	step_duration = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+const std::vector<cl_float4>& tile_streaming::get_positions() const {
+	return positions;
+}
+
+const std::vector<cl_uint>& tile_streaming::get_ids() const {
+	return ids;
+}
+
+double tile_streaming::get_step_duration() const {
+	return step_duration;
+}
+
+size_t tile_streaming::get_num_tiles() const {
+	return tiles.size();
+}
+
+void tile_streaming::print_report() const {
+	size_t device_bytes = 0;
+	size_t host_bytes = 0;
+	for (const slot& s : slots) {
+		device_bytes += s.capacity * (6 * sizeof(cl_float4) + 4 * sizeof(cl_uint));
+	}
+	for (const tile& t : tiles) {
+		host_bytes += t.storage_capacity * (2 * sizeof(cl_float4) + sizeof(cl_uint));
+	}
+	std::cout << "tile streaming: " << step_duration << " ms/step, " << tiles.size() << " tiles on " << particle::cl::get_device_name(device) << ", " << device_bytes / (1 << 20) << " MiB device, " << host_bytes / (1 << 20) << " MiB pinned" << std::endl;
+	for (size_t i = 0; i < tiles.size(); i++) {
+		const tile& t = tiles[i];
+		std::cout << "  " << i << ": [" << t.slab.s[0] << ", " << t.slab.s[1] << ") owned " << t.num_owned << ", ghosts " << t.num_ghosts << std::endl;
+	}
+}
+
+void tile_streaming::print_memory_report() const {
+	std::cout << "tiles ";
+	memory->print_report();
+}
+
+tile_streaming::tile_streaming(cl_device_id device, cl_uint num_tiles, std::vector<cl_float> particle_data, std::vector<cl_float4> world_triangles, const particle::cl::distance_field* distance_field, std::map<std::string, size_t> local_work_sizes):
+	device(device),
+	local_work_sizes(local_work_sizes),
+	world_triangles(world_triangles),
+	distance_field_colliders(distance_field != nullptr),
+	num_particles(particle_data.size() / 4),
+	num_triangles(world_triangles.size() / 5),
+	halo(0) {
+	if (distance_field_colliders) {
+		this->distance_field = *distance_field;
+	}
+	positions.resize(num_particles);
+	ids.resize(num_particles);
+	std::iota(ids.begin(), ids.end(), 0);
+	for (size_t i = 0; i < num_particles; i++) {
+		std::copy_n(&particle_data[4 * i], 4, positions[i].s);
+		// a particle can reach anything within two diameters of it during the collision iterations
+		halo = std::max(halo, 4 * positions[i].s[3]);
+	}
+
+	cl_int error = CL_SUCCESS;
+	cl_int object_error = CL_SUCCESS;
+	cl_platform_id platform;
+	clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, nullptr);
+	cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform), 0};
+	context = clCreateContext(properties, 1, &device, nullptr, nullptr, &object_error);
+	error |= object_error;
+	compute_queue = clCreateCommandQueue(context, device, NULL, &object_error);
+	error |= object_error;
+	transfer_queue = clCreateCommandQueue(context, device, NULL, &object_error);
+	error |= object_error;
+	memory.reset(new device_memory(device, context, compute_queue));
+
+	particle::cl::build_program(device, context, &particle_simulation_program, "shaders/cl/particle_simulation.cl", distance_field_colliders ? "-D DISTANCE_FIELD" : "");
+	particle::cl::build_program(device, context, &bitonic_program, "shaders/cl/bitonic_sort.cl");
+	particle::cl::build_program(device, context, &bvh_program, "shaders/cl/bvh.cl");
+	particle::cl::build_program(device, context, &decomposition_program, "shaders/cl/domain_decomposition.cl");
+
+	move_kernel = clCreateKernel(particle_simulation_program, "move", &object_error);
+	error |= object_error;
+	count_kernel = clCreateKernel(decomposition_program, "count_slab_buckets", &object_error);
+	error |= object_error;
+	scatter_kernel = clCreateKernel(decomposition_program, "scatter_slab_buckets", &object_error);
+	error |= object_error;
+	apply_indices_kernel = clCreateKernel(bitonic_program, "apply_indices", &object_error);
+	error |= object_error;
+	park_kernel = clCreateKernel(decomposition_program, "park_particles", &object_error);
+	error |= object_error;
+
+	cl_uint zero = 0;
+	for (slot& s : slots) {
+		s.counters = memory->allocate("partition", 12 * sizeof(cl_uint));
+		s.active_counts = memory->allocate("solver", 2 * sizeof(cl_uint));
+		error |= clEnqueueFillBuffer(compute_queue, s.active_counts, &zero, sizeof(cl_uint), 0, 2 * sizeof(cl_uint), NULL, nullptr, nullptr);
+	}
+	world_triangles_buffer = memory->allocate("world", world_triangles.size() * sizeof(cl_float4), world_triangles.data());
+	if (distance_field_colliders) {
+		size_t distances_size = static_cast<size_t>(this->distance_field.dimensions.s[0]) * this->distance_field.dimensions.s[1] * this->distance_field.dimensions.s[2] * sizeof(cl_float);
+		world_distances = memory->adopt("world", particle::cl::bake_distance_field(context, compute_queue, particle_simulation_program, world_triangles_buffer, num_triangles, this->distance_field), distances_size);
+	}
+	particle::cl::print_error(error, "tile_streaming::tile_streaming");
+
+	tiles.resize(num_tiles);
+	for (tile& t : tiles) {
+		std::fill_n(t.bucket_sizes, 12, 0);
+	}
+	balance_slabs();
+
+	std::vector<std::vector<cl_uint>> members(tiles.size());
+	for (cl_uint i = 0; i < num_particles; i++) {
+		size_t index = 0;
+		while (positions[i].s[0] >= tiles[index].slab.s[1]) index++;
+		members[index].push_back(i);
+	}
+	cl_uint max_owned = 0;
+	for (size_t i = 0; i < tiles.size(); i++) {
+		tile& t = tiles[i];
+		reserve(t, members[i].size());
+		for (cl_uint id : members[i]) {
+			t.positions[t.num_owned] = positions[id];
+			t.positions_old[t.num_owned] = positions[id];
+			t.ids[t.num_owned] = id;
+			t.num_owned++;
+		}
+		max_owned = std::max(max_owned, t.num_owned);
+	}
+	for (slot& s : slots) {
+		allocate(s, pow(2, ceil(log(std::max(2 * max_owned, 64u)) / log(2))));
+	}
+	step(0);
+}
+
+tile_streaming::~tile_streaming() {
+	clFinish(compute_queue);
+	clFinish(transfer_queue);
+	for (slot& s : slots) {
+		release(s);
+	}
+	for (tile& t : tiles) {
+		if (t.storage == nullptr) continue;
+		clEnqueueUnmapMemObject(transfer_queue, t.storage, t.positions, NULL, nullptr, nullptr);
+	}
+	clFinish(transfer_queue);
+	memory.reset();
+	for (cl_kernel kernel : {move_kernel, count_kernel, scatter_kernel, apply_indices_kernel, park_kernel}) {
+		clReleaseKernel(kernel);
+	}
+	for (cl_program program : {particle_simulation_program, bitonic_program, bvh_program, decomposition_program}) {
+		clReleaseProgram(program);
+	}
+	clReleaseCommandQueue(compute_queue);
+	clReleaseCommandQueue(transfer_queue);
+	clReleaseContext(context);
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+#include "device_memory.hpp"
+#include "utility.hpp"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// simulates more particles than fit on the device: slabs along x are kept in pinned host memory and streamed through two device slots
+// with their ghosts, so one tile is simulated while the next one uploads and the previous one downloads on a second queue
+class tile_streaming {
+	enum export_range {
+		LEFT_GHOSTS,
+		RIGHT_GHOSTS,
+		LEFT_MIGRANTS,
+		RIGHT_MIGRANTS,
+		NUM_EXPORT_RANGES
+	};
+
+	struct particle_range {
+		std::vector<cl_float4> positions;
+		std::vector<cl_float4> positions_old;
+		std::vector<cl_uint> ids;
+	};
+
+	// the owned particles stay mapped in one pinned buffer between the turns of the tile
+	struct tile {
+		cl_mem storage = nullptr;
+		cl_float4* positions = nullptr;
+		cl_float4* positions_old = nullptr;
+		cl_uint* ids = nullptr;
+		cl_uint storage_capacity = 0;
+
+		cl_float2 slab;
+		cl_uint num_owned = 0;
+		cl_uint num_ghosts = 0;
+		cl_uint bucket_sizes[12];
+		// the neighbors read what the previous step exported while this step writes the other half
+		particle_range exports[2][NUM_EXPORT_RANGES];
+	};
+
+	// device buffers a tile is simulated in, every slot up to the capacity is simulated and the ones not imported are parked
+	struct slot {
+		cl_mem positions[2];
+		cl_mem positions_old[2];
+		cl_mem ids[2];
+		cl_mem indices;
+		cl_mem active_indices;
+		cl_mem active_counts;
+		cl_mem bvh;
+		cl_mem counters;
+
+		cl_uint capacity = 0;
+		std::vector<std::pair<cl_uint, cl_uint>> bvh_levels;
+		std::vector<particle::cl::kernel_step> frame_steps[2];
+		int frame_parity = 0;
+
+		cl_event uploaded = nullptr;
+		cl_event partitioned = nullptr;
+	};
+
+	cl_device_id device;
+	cl_context context;
+	cl_command_queue compute_queue;
+	cl_command_queue transfer_queue;
+	// the slots and the pinned storage of the tiles, releases wait for the compute queue and the transfers are finished before
+	std::unique_ptr<device_memory> memory;
+
+	cl_program particle_simulation_program;
+	cl_program bitonic_program;
+	cl_program bvh_program;
+	cl_program decomposition_program;
+
+	// shared by both slots, the arguments are set right before every enqueue on the in-order compute queue
+	cl_kernel move_kernel;
+	cl_kernel count_kernel;
+	cl_kernel scatter_kernel;
+	cl_kernel apply_indices_kernel;
+	cl_kernel park_kernel;
+
+	cl_mem world_triangles_buffer;
+	cl_mem world_distances = nullptr;
+
+	std::vector<tile> tiles;
+	slot slots[2];
+	int export_parity = 0;
+	std::map<std::string, size_t> local_work_sizes;
+	std::vector<cl_float4> world_triangles;
+	bool distance_field_colliders;
+	particle::cl::distance_field distance_field;
+	cl_uint num_particles;
+	cl_uint num_triangles;
+	cl_float halo;
+	cl_float time_delta_old = 0;
+
+	std::vector<cl_float4> positions;
+	std::vector<cl_uint> ids;
+	double step_duration = 0;
+
+	void allocate(slot& s, cl_uint capacity);
+	void release(slot& s);
+	void reserve(tile& t, cl_uint capacity);
+	void set_slabs(std::vector<cl_float> boundaries);
+	void balance_slabs();
+	void rebalance();
+
+	cl_kernel record_step(std::vector<particle::cl::kernel_step>& steps, cl_program program, const char* kernel_name, size_t work_items);
+	void record_frames(slot& s);
+	void swap_buffers(slot& s);
+
+	cl_int upload(slot& s, const cl_float4* positions, const cl_float4* positions_old, const cl_uint* ids, size_t count, cl_uint offset);
+	cl_int download(slot& s, cl_float4* positions, cl_float4* positions_old, cl_uint* ids, size_t count, cl_uint offset);
+	cl_int download(slot& s, particle_range& range, cl_uint offset, cl_uint count);
+	cl_int park(slot& s, cl_uint first_index);
+
+	void import_tile(size_t index, slot& s);
+	void simulate_tile(size_t index, slot& s, cl_float time_delta);
+	void export_tile(size_t index, slot& s);
+	void gather();
+
+public:
+	tile_streaming(cl_device_id device, cl_uint num_tiles, std::vector<cl_float> particle_data, std::vector<cl_float4> world_triangles, const particle::cl::distance_field* distance_field, std::map<std::string, size_t> local_work_sizes);
+	~tile_streaming();
+
+	void step(cl_float time_delta);
+	const std::vector<cl_float4>& get_positions() const;
+	const std::vector<cl_uint>& get_ids() const;
+	double get_step_duration() const;
+	size_t get_num_tiles() const;
+	void print_report() const;
+	void print_memory_report() const;
+};
@@ -1,14 +1,23 @@
 #pragma once
 
 #include "utility.hpp"
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <GL/glx.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #define CL_USE_DEPRECATED_OPENCL_2_0_APIS
 #include <CL/cl_gl.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <array>
+#include <limits>
+#include <cmath>
 
 
 namespace particle {
@@ -145,7 +154,149 @@ namespace particle {
 		return sphere;
 	}
 
-	
+	std::vector<cl_float4> create_triangle_table(const std::vector<GLfloat>& positions) {
+		std::vector<cl_float4> table;
+		for (size_t i = 0; i + 8 < positions.size(); i += 9) {
+			glm::vec3 v1(positions[i], positions[i + 1], positions[i + 2]);
+			glm::vec3 v2(positions[i + 3], positions[i + 4], positions[i + 5]);
+			glm::vec3 v3(positions[i + 6], positions[i + 7], positions[i + 8]);
+			glm::vec3 e1 = v2 - v1;
+			glm::vec3 e2 = v3 - v2;
+			glm::vec3 e3 = v1 - v3;
+			glm::vec3 n = normalize(cross(e1, v3 - v1));
+
+			float d00 = dot(e1, e1);
+			float d01 = dot(e1, v3 - v1);
+			float d11 = dot(v3 - v1, v3 - v1);
+			float denominator = d00 * d11 - d01 * d01;
+
+			table.push_back({v1.x, v1.y, v1.z, dot(v1, n)});
+			table.push_back({e1.x, e1.y, e1.z, d00});
+			table.push_back({e2.x, e2.y, e2.z, d01});
+			table.push_back({e3.x, e3.y, e3.z, d11});
+			// degenerate triangles get a nan denominator so no point is ever inside of them
+			table.push_back({n.x, n.y, n.z, denominator != 0 ? 1 / denominator : std::numeric_limits<float>::quiet_NaN()});
+		}
+		return table;
+	}
+
+	// philox4x32-10 with the counters and keys of shaders/cl/seed_particles.cl
+	std::vector<cl_float> seed_particles(const seed_distribution& distribution, cl_uint num_particles) {
+		auto philox = [](std::array<cl_uint, 4> counter, std::array<cl_uint, 2> key) {
+			for (int i = 0; i < 10; i++) {
+				if (i > 0) {
+					key[0] += 0x9E3779B9;
+					key[1] += 0xBB67AE85;
+				}
+				cl_ulong product0 = static_cast<cl_ulong>(0xD2511F53u) * counter[0];
+				cl_ulong product1 = static_cast<cl_ulong>(0xCD9E8D57u) * counter[2];
+				counter = {static_cast<cl_uint>(product1 >> 32) ^ counter[1] ^ key[0], static_cast<cl_uint>(product1), static_cast<cl_uint>(product0 >> 32) ^ counter[3] ^ key[1], static_cast<cl_uint>(product0)};
+			}
+			return counter;
+		};
+		std::array<cl_uint, 2> key = {static_cast<cl_uint>(distribution.seed), static_cast<cl_uint>(distribution.seed >> 32)};
+		std::vector<cl_float> particle_data(4 * static_cast<size_t>(num_particles));
+		for (cl_uint i = 0; i < num_particles; i++) {
+			std::array<cl_uint, 4> bits = philox({i, 0, 0, 0}, key);
+			for (int j = 0; j < 4; j++) {
+				cl_float t = (bits[j] >> 8) / 16777216.f;
+				particle_data[4 * i + j] = distribution.box_min.s[j] + (distribution.box_max.s[j] - distribution.box_min.s[j]) * t;
+			}
+		}
+		return particle_data;
+	}
+
+	// a header line with the scene, then one line of metrics per step
+	bool save_trace(std::string file_name, const physics_trace& trace) {
+		std::ofstream file(file_name);
+		if (!file.is_open()) {
+			std::cout << "could not open file " << file_name << std::endl;
+			return false;
+		}
+		file.precision(std::numeric_limits<double>::max_digits10);
+		file << trace.num_particles << " " << trace.num_scenes << " " << trace.seed << " " << trace.time_delta << " " << trace.steps.size();
+		for (const cl_float4* corner : {&trace.box_min, &trace.box_max}) {
+			for (int i = 0; i < 4; i++) {
+				file << " " << corner->s[i];
+			}
+		}
+		file << std::endl;
+		for (const physics_metrics& m : trace.steps) {
+			file << m.kinetic_energy << " " << m.potential_energy << " " << m.momentum[0] << " " << m.momentum[1] << " " << m.momentum[2] << " " << m.momentum_drift << " "
+				<< m.max_penetration << " " << m.mean_penetration << " " << m.penetrating_pairs << " " << m.world_penetrations << std::endl;
+		}
+		return true;
+	}
+
+	bool load_trace(std::string file_name, physics_trace* trace) {
+		std::ifstream file(file_name);
+		if (!file.is_open()) {
+			std::cout << "could not open file " << file_name << std::endl;
+			return false;
+		}
+		size_t num_steps = 0;
+		file >> trace->num_particles >> trace->num_scenes >> trace->seed >> trace->time_delta >> num_steps;
+		for (cl_float4* corner : {&trace->box_min, &trace->box_max}) {
+			for (int i = 0; i < 4; i++) {
+				file >> corner->s[i];
+			}
+		}
+		trace->steps.resize(num_steps);
+		for (physics_metrics& m : trace->steps) {
+			file >> m.kinetic_energy >> m.potential_energy >> m.momentum[0] >> m.momentum[1] >> m.momentum[2] >> m.momentum_drift
+				>> m.max_penetration >> m.mean_penetration >> m.penetrating_pairs >> m.world_penetrations;
+		}
+		if (!file || trace->num_scenes == 0 || trace->num_particles % trace->num_scenes != 0) {
+			std::cout << "could not read trace " << file_name << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// prints the first step at which every metric leaves its tolerance
+	bool compare_traces(const physics_trace& golden, const physics_trace& trace, const metric_tolerances& tolerances) {
+		bool same_box = std::equal(golden.box_min.s, golden.box_min.s + 4, trace.box_min.s) && std::equal(golden.box_max.s, golden.box_max.s + 4, trace.box_max.s);
+		if (golden.num_particles != trace.num_particles || golden.num_scenes != trace.num_scenes || golden.seed != trace.seed || !same_box || golden.time_delta != trace.time_delta || golden.steps.size() != trace.steps.size()) {
+			std::cout << "the trace does not run the scene of the golden trace" << std::endl;
+			return false;
+		}
+		std::array<std::string, 7> names = {"kinetic energy", "potential energy", "momentum", "momentum drift", "max penetration", "mean penetration", "penetration counts"};
+		std::array<size_t, 7> first_failures;
+		first_failures.fill(golden.steps.size());
+		for (size_t i = 0; i < golden.steps.size(); i++) {
+			const physics_metrics& g = golden.steps[i];
+			const physics_metrics& m = trace.steps[i];
+			double energy = tolerances.energy * (std::abs(g.kinetic_energy) + std::abs(g.potential_energy));
+			double golden_momentum = std::sqrt(g.momentum[0] * g.momentum[0] + g.momentum[1] * g.momentum[1] + g.momentum[2] * g.momentum[2]);
+			double momentum_difference = std::sqrt(std::pow(m.momentum[0] - g.momentum[0], 2) + std::pow(m.momentum[1] - g.momentum[1], 2) + std::pow(m.momentum[2] - g.momentum[2], 2));
+			auto count_within = [&](cl_uint value, cl_uint golden_value) {
+				return std::abs(static_cast<double>(value) - golden_value) <= std::max(tolerances.count * golden_value, 1.0);
+			};
+			std::array<bool, 7> within = {
+				std::abs(m.kinetic_energy - g.kinetic_energy) <= energy,
+				std::abs(m.potential_energy - g.potential_energy) <= energy,
+				momentum_difference <= tolerances.momentum * std::max(golden_momentum, 1.0),
+				std::abs(m.momentum_drift - g.momentum_drift) <= tolerances.momentum * std::max(g.momentum_drift, 1.0),
+				std::abs(m.max_penetration - g.max_penetration) <= tolerances.penetration,
+				std::abs(m.mean_penetration - g.mean_penetration) <= tolerances.penetration,
+				count_within(m.penetrating_pairs, g.penetrating_pairs) && count_within(m.world_penetrations, g.world_penetrations)
+			};
+			for (size_t j = 0; j < within.size(); j++) {
+				if (!within[j] && first_failures[j] == golden.steps.size()) {
+					first_failures[j] = i;
+				}
+			}
+		}
+		bool accepted = true;
+		for (size_t j = 0; j < names.size(); j++) {
+			if (first_failures[j] < golden.steps.size()) {
+				std::cout << names[j] << " leaves its tolerance at step " << first_failures[j] << std::endl;
+				accepted = false;
+			}
+		}
+		std::cout << (accepted ? "accepted" : "rejected") << " against the golden trace" << std::endl;
+		return accepted;
+	}
 
 	namespace gl {
 		GLuint compile_shader(std::string file_name, GLenum shader_type) {
@@ -172,6 +323,38 @@ namespace particle {
 			return shader;
 		}
 
+#ifndef _WIN32
+		// a compatibility context without any surface, everything is drawn into framebuffer objects
+		bool create_surfaceless_context() {
+			EGLDisplay display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+			if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+				std::cout << "could not initialize a surfaceless egl display" << std::endl;
+				return false;
+			}
+			EGLint config_attributes[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+			EGLConfig config;
+			EGLint num_configs = 0;
+			eglChooseConfig(display, config_attributes, &config, 1, &num_configs);
+			EGLint context_attributes[] = {
+				EGL_CONTEXT_MAJOR_VERSION, 4,
+				EGL_CONTEXT_MINOR_VERSION, 5,
+				EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+				EGL_NONE
+			};
+			EGLContext context = num_configs > 0 ? eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes) : EGL_NO_CONTEXT;
+			if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+				std::cout << "could not create a surfaceless opengl 4.5 context" << std::endl;
+				return false;
+			}
+			return true;
+		}
+#else
+		bool create_surfaceless_context() {
+			std::cout << "capture is unsupported, it needs a surfaceless egl context" << std::endl;
+			return false;
+		}
+#endif
+
 		void print_error(GLenum error, std::string message) {
 			if (message != "") message += " - ";
 			if (error != GL_NO_ERROR) {
@@ -242,35 +425,170 @@ namespace particle {
 			std::cout << device_type_text << std::endl << device_extensions << std::endl;
 		}
 
-		void init_opencl(cl_device_id* device, cl_context* context, cl_command_queue* command_queue) {
-			std::array<cl_platform_id, 8> platforms;
-			clGetPlatformIDs(platforms.size(), platforms.data(), nullptr);
-			print_platform_info(platforms[0]);
+		std::vector<cl_device_id> get_devices(cl_device_type device_type) {
+			cl_uint num_platforms = 0;
+			clGetPlatformIDs(0, nullptr, &num_platforms);
+			std::vector<cl_platform_id> platforms(num_platforms);
+			clGetPlatformIDs(num_platforms, platforms.data(), nullptr);
+
+			std::vector<cl_device_id> devices;
+			for (cl_platform_id platform : platforms) {
+				cl_uint num_devices = 0;
+				if (clGetDeviceIDs(platform, device_type, 0, nullptr, &num_devices) != CL_SUCCESS) continue;
+				std::vector<cl_device_id> platform_devices(num_devices);
+				clGetDeviceIDs(platform, device_type, num_devices, platform_devices.data(), nullptr);
+				devices.insert(devices.end(), platform_devices.begin(), platform_devices.end());
+			}
+			return devices;
+		}
+
+		double get_device_score(cl_device_id device) {
+			cl_device_type device_type;
+			cl_uint compute_units;
+			cl_uint clock_frequency;
+			cl_ulong global_memory;
+			clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, nullptr);
+			clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, nullptr);
+			clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clock_frequency, nullptr);
+			clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_memory, nullptr);
+
+			// a gpu compute unit runs many more lanes than a cpu core, and gl sharing saves the per frame copies
+			double score = compute_units * static_cast<double>(clock_frequency) * (device_type & CL_DEVICE_TYPE_GPU ? 16 : 1);
+			score += global_memory / static_cast<double>(1 << 20);
+			if (has_extension(device, "cl_khr_gl_sharing")) score *= 2;
+			return score;
+		}
+
+		// best first, every device is queried once instead of on each comparison
+		std::vector<std::pair<cl_device_id, double>> get_scored_devices(cl_device_type device_type) {
+			std::vector<std::pair<cl_device_id, double>> scored_devices;
+			for (cl_device_id device : get_devices(device_type)) {
+				scored_devices.emplace_back(device, get_device_score(device));
+			}
+			std::stable_sort(scored_devices.begin(), scored_devices.end(), [](const auto& a, const auto& b) {
+				return a.second > b.second;
+			});
+			return scored_devices;
+		}
+
+		std::vector<cl_device_id> select_devices(const device_selection& selection) {
+			std::vector<std::pair<cl_device_id, double>> devices = get_scored_devices(selection.device_type);
 
-			std::array<cl_device_id, 8> devices;
-			cl_uint num_devices;
-			clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, devices.size(), devices.data(), &num_devices);
-			for (size_t i = 0; i < num_devices; i++) {
-				print_device_info(devices[i]);
+			cl_device_id device = nullptr;
+			for (size_t i = 0; i < devices.size(); i++) {
+				std::string device_name = get_device_name(devices[i].first);
+				std::cout << i << ": " << device_name << " (score " << devices[i].second << ")" << std::endl;
+				if (device != nullptr) continue;
+				if (selection.name != "" ? device_name.find(selection.name) != std::string::npos : static_cast<int>(i) == std::max(selection.index, 0)) {
+					device = devices[i].first;
+				}
+			}
+			if (device == nullptr) {
+				std::cout << "particle::cl::select_devices - no matching OpenCL device found" << std::endl;
+				return {};
+			}
+			print_device_info(device);
+
+			std::vector<cl_device_partition_property> partition;
+			if (selection.partition_numa) {
+				partition = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+			} else if (selection.partition_compute_units > 0) {
+				partition = {CL_DEVICE_PARTITION_EQUALLY, static_cast<cl_device_partition_property>(selection.partition_compute_units), 0};
+			} else {
+				return {device};
 			}
 
-			clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, devices.size(), devices.data(), &num_devices);
-			if (num_devices == 0) return;
-			*device = devices[0];
+			cl_uint num_sub_devices = 0;
+			cl_int error = clCreateSubDevices(device, partition.data(), 0, nullptr, &num_sub_devices);
+			if (error != CL_SUCCESS || num_sub_devices == 0) {
+				print_error(error, "particle::cl::select_devices");
+				return {device};
+			}
+			std::vector<cl_device_id> sub_devices(num_sub_devices);
+			clCreateSubDevices(device, partition.data(), num_sub_devices, sub_devices.data(), nullptr);
+			std::cout << "partitioned into " << num_sub_devices << " sub-devices" << std::endl;
+			return sub_devices;
+		}
 
-			cl_context_properties properties[] = {
+		std::vector<cl_context_properties> get_gl_context_properties() {
+#ifdef _WIN32
+			return {
 				CL_GL_CONTEXT_KHR, reinterpret_cast<cl_context_properties>(wglGetCurrentContext()),
-				CL_WGL_HDC_KHR, reinterpret_cast<cl_context_properties>(wglGetCurrentDC()),
-				CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platforms[0]),
-				NULL
+				CL_WGL_HDC_KHR, reinterpret_cast<cl_context_properties>(wglGetCurrentDC())
+			};
+#else
+			if (eglGetCurrentContext() != EGL_NO_CONTEXT) {
+				return {
+					CL_GL_CONTEXT_KHR, reinterpret_cast<cl_context_properties>(eglGetCurrentContext()),
+					CL_EGL_DISPLAY_KHR, reinterpret_cast<cl_context_properties>(eglGetCurrentDisplay())
+				};
+			}
+			return {
+				CL_GL_CONTEXT_KHR, reinterpret_cast<cl_context_properties>(glXGetCurrentContext()),
+				CL_GLX_DISPLAY_KHR, reinterpret_cast<cl_context_properties>(glXGetCurrentDisplay())
 			};
+#endif
+		}
+
+		std::vector<cl_device_id> select_domain_devices(const device_selection& selection, cl_uint num_domains) {
+			std::vector<cl_device_id> devices;
+			if (selection.partition_numa || selection.partition_compute_units > 0) {
+				devices = select_devices(selection);
+			} else {
+				for (auto& scored_device : get_scored_devices(selection.device_type)) {
+					devices.push_back(scored_device.first);
+				}
+			}
+			if (devices.empty()) return {};
 
-			*context = clCreateContext(properties, 1, device,
-				[](const char* errinfo, const void* private_info, size_t cb, void* user_data) {
+			// more domains than devices share the devices round robin
+			std::vector<cl_device_id> domain_devices;
+			for (cl_uint i = 0; i < num_domains; i++) {
+				domain_devices.push_back(devices[i % devices.size()]);
+			}
+			// sub-devices no domain runs on are released, for root devices this does nothing
+			for (size_t i = num_domains; i < devices.size(); i++) {
+				clReleaseDevice(devices[i]);
+			}
+			return domain_devices;
+		}
+
+		bool init_opencl(const device_selection& selection, cl_device_id* device, cl_context* context, cl_command_queue* command_queue, bool* gl_sharing) {
+			std::vector<cl_device_id> devices = select_devices(selection);
+			if (devices.empty()) return false;
+			*device = devices[std::min<size_t>(selection.sub_device, devices.size() - 1)];
+			// the other sub-devices of a partition are not used, for root devices this does nothing
+			for (cl_device_id other : devices) {
+				if (other != *device) clReleaseDevice(other);
+			}
+
+			cl_platform_id platform;
+			clGetDeviceInfo(*device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, nullptr);
+			auto notify = [](const char* errinfo, const void* private_info, size_t cb, void* user_data) {
 				std::cout << "error: " << errinfo << std::endl;
-			}, nullptr, nullptr);
+			};
+
+			cl_int error = CL_SUCCESS;
+			*gl_sharing = has_extension(*device, "cl_khr_gl_sharing");
+			if (*gl_sharing) {
+				std::vector<cl_context_properties> properties = get_gl_context_properties();
+				properties.insert(properties.end(), {CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform), 0});
+				*context = clCreateContext(properties.data(), 1, device, notify, nullptr, &error);
+				*gl_sharing = error == CL_SUCCESS;
+			}
+			if (!*gl_sharing) {
+				// without sharing the particle system mirrors its gl objects through host memory
+				cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform), 0};
+				*context = clCreateContext(properties, 1, device, notify, nullptr, &error);
+			}
+			if (error != CL_SUCCESS) {
+				print_error(error, "particle::cl::init_opencl");
+				return false;
+			}
 
-			*command_queue = clCreateCommandQueue(*context, *device, NULL, nullptr);
+			*command_queue = clCreateCommandQueue(*context, *device, NULL, &error);
+			print_error(error, "particle::cl::init_opencl");
+			return error == CL_SUCCESS;
 		}
 
 		void print_build_log(cl_device_id device, cl_program program) {
@@ -292,13 +610,13 @@ namespace particle {
 		}
 
 
-		void build_program(cl_device_id device, cl_context context, cl_program* program, std::string file_name) {
+		void build_program(cl_device_id device, cl_context context, cl_program* program, std::string file_name, std::string options) {
 			std::string string = load_file(file_name);
 			const char* source = string.c_str();
 
 			cl_int errcode_ret;
 			*program = clCreateProgramWithSource(context, 1, &source, nullptr, &errcode_ret);
-			cl_int error = clBuildProgram(*program, 1, &device, nullptr, nullptr, nullptr);
+			cl_int error = clBuildProgram(*program, 1, &device, options.c_str(), nullptr, nullptr);
 			print_build_log(device, *program);
 			print_error(error, "particle::cl::build_program");
 		}
@@ -311,6 +629,227 @@ namespace particle {
 				return data_count + local_work_size - r;
 		}
 
+		std::vector<std::pair<cl_uint, cl_uint>> get_bvh_levels(cl_uint num_particles) {
+			std::vector<std::pair<cl_uint, cl_uint>> bvh_levels;
+			bvh_levels.push_back({0, num_particles});
+			cl_uint level_size = pow(2, ceil(log(num_particles) / log(2)) - 1);
+			cl_uint num_nodes = ceil(num_particles / 2.f);
+			cl_uint start_index = level_size - 1;
+			while (level_size > 0) {
+				bvh_levels.push_back({start_index, start_index + num_nodes});
+				level_size = floor(level_size / 2.f);
+				num_nodes = ceil(num_nodes / 2.f);
+				start_index -= level_size;
+			}
+			return bvh_levels;
+		}
+
+		std::string get_device_name(cl_device_id device) {
+			size_t string_size;
+			clGetDeviceInfo(device, CL_DEVICE_NAME, 0, nullptr, &string_size);
+			std::string device_name(string_size, ' ');
+			clGetDeviceInfo(device, CL_DEVICE_NAME, string_size, &device_name[0], nullptr);
+			device_name.resize(device_name.find('\0'));
+			return device_name;
+		}
+
+		std::string get_kernel_name(cl_kernel kernel) {
+			size_t string_size;
+			clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &string_size);
+			std::string kernel_name(string_size, ' ');
+			clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, string_size, &kernel_name[0], nullptr);
+			kernel_name.resize(kernel_name.find('\0'));
+			return kernel_name;
+		}
+
+		std::vector<size_t> get_local_work_size_candidates(cl_device_id device, cl_kernel kernel) {
+			size_t max_work_group_size;
+			size_t preferred_multiple;
+			clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_work_group_size, nullptr);
+			clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &preferred_multiple, nullptr);
+
+			// powers of two keep every candidate a divisor of the power of two work sizes of bitonic_sort and construct_bvh
+			std::vector<size_t> candidates;
+			for (size_t candidate = 1; candidate <= max_work_group_size; candidate *= 2) {
+				if (candidate >= preferred_multiple || candidate == max_work_group_size) {
+					candidates.push_back(candidate);
+				}
+			}
+			return candidates;
+		}
+
+		double get_event_duration(cl_event event) {
+			clWaitForEvents(1, &event);
+			cl_ulong start, end;
+			clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr);
+			clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr);
+			return (end - start) / 1e6;
+		}
+
+		double time_kernel(cl_command_queue profiling_queue, cl_kernel kernel, size_t global_work_size, size_t local_work_size, int repetitions) {
+			double duration = 0;
+			for (int i = 0; i < repetitions; i++) {
+				cl_event event;
+				cl_int error = clEnqueueNDRangeKernel(profiling_queue, kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, &event);
+				if (error != CL_SUCCESS) {
+					print_error(error, "particle::cl::time_kernel");
+					return std::numeric_limits<double>::max();
+				}
+				duration += get_event_duration(event);
+				clReleaseEvent(event);
+			}
+			return duration / repetitions;
+		}
+
+		cl_int enqueue_step(cl_command_queue command_queue, const kernel_step& step, cl_event* event) {
+			size_t global_work_size[2] = {step.global_work_size, step.num_scenes};
+			size_t local_work_size[2] = {step.local_work_size, 1};
+			return clEnqueueNDRangeKernel(command_queue, step.kernel, 2, nullptr, global_work_size, local_work_size, NULL, nullptr, event);
+		}
+
+		double time_steps(cl_command_queue profiling_queue, const std::vector<kernel_step>& steps, std::string kernel_name) {
+			std::vector<cl_event> events;
+			for (const kernel_step& step : steps) {
+				cl_event event;
+				cl_int error = enqueue_step(profiling_queue, step, &event);
+				if (error != CL_SUCCESS) {
+					print_error(error, "particle::cl::time_steps");
+					clFinish(profiling_queue);
+					for (cl_event event : events) clReleaseEvent(event);
+					return std::numeric_limits<double>::max();
+				}
+				events.push_back(event);
+			}
+			clFinish(profiling_queue);
+
+			double duration = 0;
+			for (size_t i = 0; i < steps.size(); i++) {
+				if (get_kernel_name(steps[i].kernel) == kernel_name) {
+					duration += get_event_duration(events[i]);
+				}
+				clReleaseEvent(events[i]);
+			}
+			return duration;
+		}
+
+		bool has_extension(cl_device_id device, std::string extension) {
+			size_t string_size;
+			clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, nullptr, &string_size);
+			std::string device_extensions(string_size, ' ');
+			clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, string_size, &device_extensions[0], nullptr);
+			return (" " + device_extensions + " ").find(" " + extension + " ") != std::string::npos;
+		}
+
+		bool load_command_buffer_functions(cl_device_id device, command_buffer_functions* functions) {
+			if (!has_extension(device, "cl_khr_command_buffer")) return false;
+			cl_platform_id platform;
+			clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, nullptr);
+
+			functions->create = reinterpret_cast<decltype(functions->create)>(clGetExtensionFunctionAddressForPlatform(platform, "clCreateCommandBufferKHR"));
+			functions->command_nd_range_kernel = reinterpret_cast<decltype(functions->command_nd_range_kernel)>(clGetExtensionFunctionAddressForPlatform(platform, "clCommandNDRangeKernelKHR"));
+			functions->finalize = reinterpret_cast<decltype(functions->finalize)>(clGetExtensionFunctionAddressForPlatform(platform, "clFinalizeCommandBufferKHR"));
+			functions->enqueue = reinterpret_cast<decltype(functions->enqueue)>(clGetExtensionFunctionAddressForPlatform(platform, "clEnqueueCommandBufferKHR"));
+			functions->release = reinterpret_cast<decltype(functions->release)>(clGetExtensionFunctionAddressForPlatform(platform, "clReleaseCommandBufferKHR"));
+			return functions->create && functions->command_nd_range_kernel && functions->finalize && functions->enqueue && functions->release;
+		}
+
+		cl_command_buffer_khr create_command_buffer(const command_buffer_functions& functions, cl_command_queue command_queue, const std::vector<kernel_step>& steps) {
+			cl_int error = CL_SUCCESS;
+			cl_command_buffer_khr command_buffer = functions.create(1, &command_queue, nullptr, &error);
+			if (error != CL_SUCCESS) {
+				print_error(error, "particle::cl::create_command_buffer");
+				return nullptr;
+			}
+
+			// chain the sync points so the recorded steps keep the order of the in-order queue
+			cl_uint sync_point = 0;
+			for (size_t i = 0; i < steps.size() && error == CL_SUCCESS; i++) {
+				cl_uint previous_sync_point = sync_point;
+				size_t global_work_size[2] = {steps[i].global_work_size, steps[i].num_scenes};
+				size_t local_work_size[2] = {steps[i].local_work_size, 1};
+				error = functions.command_nd_range_kernel(command_buffer, nullptr, nullptr, steps[i].kernel, 2, nullptr, global_work_size, local_work_size, i == 0 ? 0 : 1, i == 0 ? nullptr : &previous_sync_point, &sync_point, nullptr);
+			}
+			if (error == CL_SUCCESS) {
+				error = functions.finalize(command_buffer);
+			}
+			if (error != CL_SUCCESS) {
+				print_error(error, "particle::cl::create_command_buffer");
+				functions.release(command_buffer);
+				return nullptr;
+			}
+			return command_buffer;
+		}
+
+		cl_int enqueue_steps(cl_command_queue command_queue, const std::vector<kernel_step>& steps) {
+			cl_int error = CL_SUCCESS;
+			for (const kernel_step& step : steps) {
+				error |= enqueue_step(command_queue, step, nullptr);
+			}
+			return error;
+		}
+
+		distance_field get_distance_field(const std::vector<GLfloat>& positions, float cell_size, float margin) {
+			glm::vec3 minimum(std::numeric_limits<float>::max());
+			glm::vec3 maximum(std::numeric_limits<float>::lowest());
+			for (size_t i = 0; i + 2 < positions.size(); i += 3) {
+				glm::vec3 position(positions[i], positions[i + 1], positions[i + 2]);
+				minimum = glm::min(minimum, position);
+				maximum = glm::max(maximum, position);
+			}
+			minimum -= margin;
+			maximum += margin;
+			glm::uvec3 dimensions = glm::uvec3(glm::ceil((maximum - minimum) / cell_size));
+			return {{minimum.x, minimum.y, minimum.z, cell_size}, {dimensions.x, dimensions.y, dimensions.z, 0}};
+		}
+
+		cl_mem bake_distance_field(cl_context context, cl_command_queue command_queue, cl_program program, cl_mem triangles, cl_uint num_triangles, const distance_field& field) {
+			cl_int error = CL_SUCCESS;
+			size_t num_cells = static_cast<size_t>(field.dimensions.s[0]) * field.dimensions.s[1] * field.dimensions.s[2];
+			cl_mem distances = clCreateBuffer(context, CL_MEM_READ_WRITE, num_cells * sizeof(cl_float), nullptr, &error);
+			cl_kernel kernel = clCreateKernel(program, "bake_distance_field", &error);
+			error |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &triangles);
+			error |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &num_triangles);
+			error |= clSetKernelArg(kernel, 2, sizeof(cl_float4), &field.origin);
+			error |= clSetKernelArg(kernel, 3, sizeof(cl_uint4), &field.dimensions);
+			error |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &distances);
+			size_t local_work_size = 64;
+			size_t global_work_size = get_global_work_size(num_cells, local_work_size);
+			error |= clEnqueueNDRangeKernel(command_queue, kernel, 1, nullptr, &global_work_size, &local_work_size, NULL, nullptr, nullptr);
+
+			// baked into a buffer since writing 3d images needs cl_khr_3d_image_writes, then copied for filtered reads
+			cl_image_format format = {CL_R, CL_FLOAT};
+			cl_image_desc description = {CL_MEM_OBJECT_IMAGE3D, field.dimensions.s[0], field.dimensions.s[1], field.dimensions.s[2], 1, 0, 0, 0, 0, nullptr};
+			cl_mem image = clCreateImage(context, CL_MEM_READ_ONLY, &format, &description, nullptr, &error);
+			size_t origin[3] = {0, 0, 0};
+			size_t region[3] = {field.dimensions.s[0], field.dimensions.s[1], field.dimensions.s[2]};
+			error |= clEnqueueCopyBufferToImage(command_queue, distances, image, 0, origin, region, NULL, nullptr, nullptr);
+			clFinish(command_queue);
+
+			clReleaseKernel(kernel);
+			clReleaseMemObject(distances);
+			print_error(error, "particle::cl::bake_distance_field");
+			return image;
+		}
+
+		void print_statistics(const statistics& stats, cl_uint frames) {
+			auto average = [](cl_ulong sum, cl_ulong count) { return count == 0 ? 0.0 : static_cast<double>(sum) / count; };
+			auto print_histogram = [](const char* name, const auto& bins) {
+				std::cout << name << ":";
+				for (cl_ulong bin : bins) {
+					std::cout << " " << bin;
+				}
+				std::cout << std::endl;
+			};
+			std::cout << "statistics over " << frames << " frames" << std::endl;
+			std::cout << "traversals: " << stats.traversals << ", " << average(stats.nodes_visited, stats.traversals) << " nodes visited, " << average(stats.leaves_tested, stats.traversals) << " leaves tested, " << average(stats.contacts, stats.traversals) << " contacts" << std::endl;
+			std::cout << "overflows: " << stats.stack_overflows << " stack, " << stats.leaf_overflows << " leaves, " << stats.neighbor_overflows << " neighbors, " << stats.contact_overflows << " contacts" << std::endl;
+			std::cout << "tiles: " << stats.tiles << ", " << average(stats.tile_nodes_visited, stats.tiles) << " nodes visited, " << average(stats.tile_lights, stats.tiles) << " lights" << std::endl;
+			std::cout << "tile overflows: " << stats.tile_stack_overflows << " stack, " << stats.candidate_overflows << " candidates, " << stats.light_overflows << " lights" << std::endl;
+			print_histogram("nodes visited (log2)", stats.nodes_visited_histogram);
+			print_histogram("contacts", stats.contacts_histogram);
+			print_histogram("lights per tile (16)", stats.lights_histogram);
+		}
+
 		void print_error(cl_int error, std::string message) {
 			if (error == CL_SUCCESS) return;
 			if (message != "") message += " - ";
@@ -9,26 +9,148 @@
 #include <vector>
 
 
+typedef struct _cl_command_buffer_khr* cl_command_buffer_khr;
+
 namespace particle {
 	std::string load_file(std::string file_name);
 	std::vector<GLfloat> create_box(glm::vec3 dimensions, glm::vec3 position = glm::vec3(0), glm::vec3 rotation_vector = glm::vec3(1), float rotation_angle = 0);
 	std::vector<GLfloat> create_sphere(float radius, float tesselation, glm::vec3 position = glm::vec3(0));
 	std::vector<GLfloat> create_box_normals(glm::vec3 rotation_vector = glm::vec3(1), float rotation_angle = 0);
 	std::vector<GLfloat> create_sphere_normals(float tesselation);
+	// five float4 per triangle: first corner and plane distance, the three edges with the barycentric dot products, normal and inverse barycentric denominator
+	std::vector<cl_float4> create_triangle_table(const std::vector<GLfloat>& positions);
+
+	// particles drawn uniformly from a box on the device, the same seed gives the same particles on every device
+	struct seed_distribution {
+		cl_uint num_particles = 0;
+		cl_ulong seed = 0;
+		cl_float4 box_min = {{0, 0, 0, 0.1f}};	// w is the smallest radius
+		cl_float4 box_max = {{0, 0, 0, 0.1f}};	// w is the largest radius
+	};
+	// the same draws on the host, for scenes that are never on the device as a whole
+	std::vector<cl_float> seed_particles(const seed_distribution& distribution, cl_uint num_particles);
+
+	// what a faster sort, bvh or solver has to reproduce, summed over every particle after one step
+	struct physics_metrics {
+		double kinetic_energy = 0;		// masses are the radius cubed
+		double potential_energy = 0;
+		double momentum[3] = {0, 0, 0};
+		double momentum_drift = 0;		// length of the momentum change since the previous step
+		double max_penetration = 0;
+		double mean_penetration = 0;
+		cl_uint penetrating_pairs = 0;
+		cl_uint world_penetrations = 0;
+	};
+
+	// a fixed time step run of a seeded scene, stored as golden trace to validate later runs against
+	struct physics_trace {
+		cl_uint num_particles = 0;
+		cl_uint num_scenes = 1;
+		cl_ulong seed = 0;
+		cl_float4 box_min = {{0, 0, 0, 0}};
+		cl_float4 box_max = {{0, 0, 0, 0}};
+		float time_delta = 0;
+		std::vector<physics_metrics> steps;
+	};
+
+	struct metric_tolerances {
+		double energy = 0.05;		// relative to the golden total energy
+		double momentum = 0.05;		// relative to the golden momentum, at least one mass times unit velocity
+		double penetration = 0.01;	// absolute in world units
+		double count = 0.1;			// relative to the golden count, at least one
+	};
+
+	bool save_trace(std::string file_name, const physics_trace& trace);
+	bool load_trace(std::string file_name, physics_trace* trace);
+	bool compare_traces(const physics_trace& golden, const physics_trace& trace, const metric_tolerances& tolerances);
 
 	namespace gl {
 		GLuint compile_shader(std::string file_name, GLenum shader_type);
 		void print_error(GLenum error, std::string message = "");
 		void print_error_framebuffer(GLenum error, std::string message = "");
+		bool create_surfaceless_context();
 	}
 
 	namespace cl {
+		struct kernel_step {
+			cl_kernel kernel;
+			size_t global_work_size;
+			size_t local_work_size;
+			size_t num_scenes = 1;	// second work dimension, one work group row per ensemble scene
+		};
+
+		// entry points of cl_khr_command_buffer, resolved at runtime since the extension is not part of every icd loader
+		struct command_buffer_functions {
+			cl_command_buffer_khr (CL_API_CALL* create)(cl_uint num_queues, const cl_command_queue* queues, const cl_ulong* properties, cl_int* errcode_ret);
+			cl_int (CL_API_CALL* command_nd_range_kernel)(cl_command_buffer_khr command_buffer, cl_command_queue command_queue, const cl_ulong* properties, cl_kernel kernel, cl_uint work_dim, const size_t* global_work_offset, const size_t* global_work_size, const size_t* local_work_size, cl_uint num_sync_points_in_wait_list, const cl_uint* sync_point_wait_list, cl_uint* sync_point, void** mutable_handle);
+			cl_int (CL_API_CALL* finalize)(cl_command_buffer_khr command_buffer);
+			cl_int (CL_API_CALL* enqueue)(cl_uint num_queues, cl_command_queue* queues, cl_command_buffer_khr command_buffer, cl_uint num_events_in_wait_list, const cl_event* event_wait_list, cl_event* event);
+			cl_int (CL_API_CALL* release)(cl_command_buffer_khr command_buffer);
+		};
+
+		struct device_selection {
+			cl_device_type device_type = CL_DEVICE_TYPE_ALL;
+			int index = -1;						// position in the score ordered device list, the best device if negative
+			std::string name;					// substring of the device name, overrides index
+			cl_uint partition_compute_units = 0;	// split the device into sub-devices of this many compute units
+			bool partition_numa = false;		// split the device along its numa nodes
+			cl_uint sub_device = 0;				// sub-device to run on after partitioning
+		};
+
+		// samples of the signed distance to the world at the cell centers of a regular grid
+		struct distance_field {
+			cl_float4 origin;		// minimum corner, w is the cell size
+			cl_uint4 dimensions;
+		};
+
+		// counters of the kernels built with STATISTICS, same layout as the statistics struct of shaders/cl/statistics.cl
+		struct statistics {
+			cl_ulong traversals;
+			cl_ulong nodes_visited;
+			cl_ulong leaves_tested;
+			cl_ulong contacts;
+			cl_ulong stack_overflows;
+			cl_ulong leaf_overflows;
+			cl_ulong neighbor_overflows;		// neighbor lists cut short by the capacity
+			cl_ulong contact_overflows;		// gauss-seidel contact lists that filled up
+			cl_ulong tiles;
+			cl_ulong tile_nodes_visited;
+			cl_ulong tile_lights;
+			cl_ulong tile_stack_overflows;
+			cl_ulong candidate_overflows;	// tiles whose light candidates did not fit
+			cl_ulong light_overflows;		// tiles with more lights than they shade
+			cl_ulong nodes_visited_histogram[16];	// bin i counts traversals that visited 2^i to 2^(i+1) - 1 nodes
+			cl_ulong contacts_histogram[16];			// bin i counts particles with i contacts, the last bin also the ones with more
+			cl_ulong lights_histogram[16];			// bin i counts tiles with 16 i to 16 i + 15 lights, the last bin also the ones with more
+		};
+
 		void print_platform_info(cl_platform_id platform_id);
 		void print_device_info(cl_device_id device_id);
-		void init_opencl(cl_device_id* device, cl_context* context, cl_command_queue* command_queue);
+		std::vector<cl_device_id> get_devices(cl_device_type device_type);
+		double get_device_score(cl_device_id device);
+		std::vector<std::pair<cl_device_id, double>> get_scored_devices(cl_device_type device_type);
+		std::vector<cl_device_id> select_devices(const device_selection& selection);
+		std::vector<cl_context_properties> get_gl_context_properties();
+		std::vector<cl_device_id> select_domain_devices(const device_selection& selection, cl_uint num_domains);
+		bool init_opencl(const device_selection& selection, cl_device_id* device, cl_context* context, cl_command_queue* command_queue, bool* gl_sharing);
 		void print_build_log(cl_device_id device, cl_program program);
-		void build_program(cl_device_id device, cl_context context, cl_program* program, std::string file_name);
+		void build_program(cl_device_id device, cl_context context, cl_program* program, std::string file_name, std::string options = "");
 		size_t get_global_work_size(size_t data_count, size_t local_work_size);
+		std::vector<std::pair<cl_uint, cl_uint>> get_bvh_levels(cl_uint num_particles);
+		std::string get_device_name(cl_device_id device);
+		std::string get_kernel_name(cl_kernel kernel);
+		std::vector<size_t> get_local_work_size_candidates(cl_device_id device, cl_kernel kernel);
+		double get_event_duration(cl_event event);
+		double time_kernel(cl_command_queue profiling_queue, cl_kernel kernel, size_t global_work_size, size_t local_work_size, int repetitions);
+		cl_int enqueue_step(cl_command_queue command_queue, const kernel_step& step, cl_event* event);
+		double time_steps(cl_command_queue profiling_queue, const std::vector<kernel_step>& steps, std::string kernel_name);
+		bool has_extension(cl_device_id device, std::string extension);
+		bool load_command_buffer_functions(cl_device_id device, command_buffer_functions* functions);
+		cl_command_buffer_khr create_command_buffer(const command_buffer_functions& functions, cl_command_queue command_queue, const std::vector<kernel_step>& steps);
+		cl_int enqueue_steps(cl_command_queue command_queue, const std::vector<kernel_step>& steps);
+		distance_field get_distance_field(const std::vector<GLfloat>& positions, float cell_size, float margin);
+		cl_mem bake_distance_field(cl_context context, cl_command_queue command_queue, cl_program program, cl_mem triangles, cl_uint num_triangles, const distance_field& field);
+		void print_statistics(const statistics& stats, cl_uint frames);
 		void print_error(cl_int error, std::string message = "");
 	}
 }
\ No newline at end of file